@@ -0,0 +1,58 @@
+"""Measure how long ``import gio_pyio`` takes in a fresh interpreter.
+
+Each run starts ``python -X importtime -c 'import gio_pyio'`` and takes the
+cumulative time reported for ``gio_pyio``. The median over all runs is
+compared against ``--budget`` and the script fails if it is exceeded or if
+importing gio_pyio pulled in a ``gi.repository`` module, which is what made
+the import slow in the first place.
+"""
+import argparse
+import re
+import statistics
+import subprocess
+import sys
+
+# import time: self [us] | cumulative | imported package
+IMPORTTIME = re.compile(r'^import time:\s+(\d+) \|\s+(\d+) \|(\s*)(\S+)$')
+CHECK = ('import sys, gio_pyio\n'
+         'print(",".join(m for m in sys.modules'
+         ' if m.startswith("gi.repository")))')
+
+
+def import_time():
+    proc = subprocess.run([sys.executable, '-X', 'importtime', '-c', CHECK],
+                          capture_output=True, text=True, check=True)
+    for line in proc.stderr.splitlines():
+        match = IMPORTTIME.match(line)
+        if match and match.group(4) == 'gio_pyio':
+            return int(match.group(2)), proc.stdout.strip()
+    raise RuntimeError('gio_pyio missing from -X importtime output')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--runs', type=int, default=20)
+    parser.add_argument('--budget', type=float, default=20.0,
+                        help='maximum median import time in milliseconds'
+                             ' (default: %(default)s)')
+    args = parser.parse_args()
+
+    times = []
+    for _i in range(args.runs):
+        usec, gi_modules = import_time()
+        if gi_modules:
+            print('import gio_pyio loaded %s' % gi_modules, file=sys.stderr)
+            return 1
+        times.append(usec / 1000)
+
+    median = statistics.median(times)
+    print('import gio_pyio: median %.2f ms, min %.2f ms, max %.2f ms'
+          % (median, min(times), max(times)))
+    if median > args.budget:
+        print('over budget of %.2f ms' % args.budget, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
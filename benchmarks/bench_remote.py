@@ -0,0 +1,92 @@
+"""Benchmark :class:`gio_pyio.StreamWrapper` against simulated remote backends.
+
+The streams come from the ``_gio_pyio_testing`` helper module, which adds
+latency, jitter, bandwidth limits and short reads to an in-memory buffer. The
+profiles are rough stand-ins for the gvfs backends named after them, so
+read-ahead, caching and coalescing can be evaluated without a network.
+
+Run it with the ``benchmarks`` meson option enabled via
+``meson test --benchmark remote``. Options are those of
+:class:`pyperf.Runner`, plus ``--profile`` to select a single profile.
+"""
+import io
+import random
+
+import pyperf
+
+import _gio_pyio_testing
+import gio_pyio
+
+DATA_SIZE = 1024 * 1024
+LINE = b'spam, spam, spam, eggs, bacon and spam\n'
+SEEKS = 50
+
+PROFILES = {
+    'local': {},
+    'smb-lan': {'latency': 0.0005, 'jitter': 0.0002, 'bandwidth': 100000000},
+    'sftp-wan': {'latency': 0.02, 'jitter': 0.005, 'bandwidth': 10000000,
+                 'max_chunk': 32768},
+}
+
+
+def _open(data, profile):
+    return gio_pyio.StreamWrapper(
+        _gio_pyio_testing.throttled_input(data, **profile))
+
+
+def read_chunks(data, profile, chunk_size, buffered):
+    f = _open(data, profile)
+    if buffered:
+        f = io.BufferedReader(f)
+    with f:
+        while f.read(chunk_size):
+            pass
+
+
+def iterate_lines(data, profile):
+    with _open(data, profile) as f:
+        for _line in f:
+            pass
+
+
+def seek_read(data, profile, offsets):
+    with _open(data, profile) as f:
+        for offset in offsets:
+            f.seek(offset)
+            f.read(4096)
+
+
+def _add_cmdline_args(cmd, args):
+    if args.profile:
+        cmd.extend(('--profile', args.profile))
+
+
+def main():
+    runner = pyperf.Runner(add_cmdline_args=_add_cmdline_args)
+    runner.metadata['description'] = __doc__.splitlines()[0]
+    runner.argparser.add_argument('--profile', choices=sorted(PROFILES),
+                                  help='only run this backend profile')
+    args = runner.parse_args()
+
+    rng = random.Random(0)
+    binary = rng.randbytes(DATA_SIZE)
+    lines = LINE * (DATA_SIZE // len(LINE))
+    offsets = [rng.randrange(DATA_SIZE - 4096) for _i in range(SEEKS)]
+
+    for name, profile in PROFILES.items():
+        if args.profile and name != args.profile:
+            continue
+        for size in (4096, 64 * 1024):
+            for buffered in (False, True):
+                runner.bench_func(
+                    'read-%dk%s:%s' % (size // 1024,
+                                       '-buffered' if buffered else '', name),
+                    read_chunks, binary, profile, size, buffered)
+        runner.bench_func('iterate-lines:%s' % name, iterate_lines, lines,
+                          profile)
+        runner.bench_func('seek-read:%s' % name, seek_read, binary, profile,
+                          offsets)
+
+
+if __name__ == '__main__':
+    main()
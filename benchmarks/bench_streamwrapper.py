@@ -0,0 +1,186 @@
+"""Compare :class:`gio_pyio.StreamWrapper` against python's native io.
+
+Every case is run against four implementations:
+
+* ``StreamWrapper`` -- ``gio_pyio.open(native=False)`` without buffering
+* ``gio_pyio.open`` -- ``gio_pyio.open(native=False)`` with buffering
+* ``io.FileIO`` -- python's unbuffered raw file
+* ``open`` -- python's builtin :func:`open` with buffering
+
+Run it with ``python benchmarks/bench_streamwrapper.py`` or, with the
+``benchmarks`` meson option enabled, ``meson test --benchmark``. Options are
+those of :class:`pyperf.Runner`, e.g. ``--fast`` or ``-o result.json``, plus
+``--filter`` to select cases by glob pattern. Results of two runs can be
+compared with ``python -m pyperf compare_to old.json new.json``.
+"""
+import fnmatch
+import io
+import os
+import pickle
+import random
+import tempfile
+
+import pyperf
+from gi.repository import Gio
+
+import gio_pyio
+
+FILE_SIZE = 8 * 1024 * 1024
+CHUNK_SIZES = (1024, 64 * 1024, 1024 * 1024)
+SEEKS = 1000
+LINE = b'spam, spam, spam, eggs, bacon and spam\n'
+
+
+def _data_path(name):
+    return os.path.join(tempfile.gettempdir(), 'gio-pyio-bench-' + name)
+
+
+def _prepare():
+    """Create the input files once, pyperf workers share them."""
+    binary = _data_path('binary')
+    if not os.path.exists(binary):
+        with open(binary, 'wb') as f:
+            f.write(random.Random(0).randbytes(FILE_SIZE))
+    lines = _data_path('lines')
+    if not os.path.exists(lines):
+        with open(lines, 'wb') as f:
+            f.write(LINE * (FILE_SIZE // len(LINE)))
+    pickled = _data_path('pickle')
+    if not os.path.exists(pickled):
+        with open(pickled, 'wb') as f:
+            pickle.dump(_pickle_payload(), f)
+    return binary, lines, pickled
+
+
+def _pickle_payload():
+    return [{'id': i, 'name': 'item %d' % i, 'values': list(range(16))}
+            for i in range(20000)]
+
+
+def _open_streamwrapper(path, mode):
+    return gio_pyio.open(Gio.File.new_for_path(path), mode, buffering=0,
+                         native=False)
+
+
+def _open_gio_buffered(path, mode):
+    return gio_pyio.open(Gio.File.new_for_path(path), mode, native=False)
+
+
+def _open_fileio(path, mode):
+    return io.FileIO(path, mode.replace('b', ''))
+
+
+def _open_builtin(path, mode):
+    return open(path, mode)
+
+
+IMPLEMENTATIONS = {
+    'StreamWrapper': _open_streamwrapper,
+    'gio_pyio.open': _open_gio_buffered,
+    'io.FileIO': _open_fileio,
+    'open': _open_builtin,
+}
+BUFFERED = ('gio_pyio.open', 'open')
+
+
+def read_chunks(opener, path, chunk_size):
+    with opener(path, 'rb') as f:
+        while f.read(chunk_size):
+            pass
+
+
+def write_chunks(opener, path, chunk_size):
+    chunk = b'\0' * chunk_size
+    with opener(path, 'wb') as f:
+        for _i in range(FILE_SIZE // chunk_size):
+            f.write(chunk)
+
+
+def iterate_lines(opener, path):
+    with opener(path, 'rb') as f:
+        for _line in f:
+            pass
+
+
+def readlines(opener, path):
+    with opener(path, 'rb') as f:
+        f.readlines()
+
+
+def readall(opener, path):
+    with opener(path, 'rb') as f:
+        f.readall() if hasattr(f, 'readall') else f.read()
+
+
+def seek_read(opener, path, offsets):
+    with opener(path, 'rb') as f:
+        for offset in offsets:
+            f.seek(offset)
+            f.read(4096)
+
+
+def pickle_load(opener, path):
+    with opener(path, 'rb') as f:
+        pickle.load(f)
+
+
+def pickle_dump(opener, path, payload):
+    with opener(path, 'wb') as f:
+        pickle.dump(payload, f)
+
+
+def text_read(opener, path):
+    with opener(path, 'r') as f:
+        for _line in f:
+            pass
+
+
+def _add_cmdline_args(cmd, args):
+    if args.filter:
+        cmd.extend(('--filter', args.filter))
+
+
+def main():
+    runner = pyperf.Runner(add_cmdline_args=_add_cmdline_args)
+    runner.metadata['description'] = __doc__.splitlines()[0]
+    runner.argparser.add_argument('--filter', default=None,
+                                  help='only run cases matching this glob')
+    args = runner.parse_args()
+
+    binary, lines, pickled = _prepare()
+    scratch = _data_path('scratch-%d' % os.getpid())
+    rng = random.Random(1)
+    offsets = [rng.randrange(FILE_SIZE - 4096) for _i in range(SEEKS)]
+    payload = _pickle_payload()
+
+    cases = []
+    for impl, opener in IMPLEMENTATIONS.items():
+        for size in CHUNK_SIZES:
+            cases.append(('read-%dk' % (size // 1024), impl, read_chunks,
+                          (opener, binary, size)))
+            cases.append(('write-%dk' % (size // 1024), impl, write_chunks,
+                          (opener, scratch, size)))
+        cases += [
+            ('iterate-lines', impl, iterate_lines, (opener, lines)),
+            ('readlines', impl, readlines, (opener, lines)),
+            ('readall', impl, readall, (opener, binary)),
+            ('seek-read', impl, seek_read, (opener, binary, offsets)),
+            ('pickle-load', impl, pickle_load, (opener, pickled)),
+            ('pickle-dump', impl, pickle_dump, (opener, scratch, payload)),
+        ]
+        if impl in BUFFERED:
+            cases.append(('text-read', impl, text_read, (opener, lines)))
+
+    try:
+        for case, impl, func, func_args in cases:
+            name = '%s:%s' % (case, impl)
+            if args.filter and not fnmatch.fnmatch(name, args.filter):
+                continue
+            runner.bench_func(name, func, *func_args)
+    finally:
+        if os.path.exists(scratch):
+            os.unlink(scratch)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,223 @@
+"""Measure how :class:`gio_pyio.StreamWrapper` throughput scales with threads.
+
+Every run reads the same data with 1 to ``--max-threads`` threads in one of
+two modes:
+
+* ``private`` -- each thread reads its own wrapper front to back
+* ``shared`` -- all threads read random blocks from a single wrapper with
+  :meth:`~gio_pyio.StreamWrapper.readinto_many_at`
+
+over a local file and, if the ``_gio_pyio_testing`` helper is importable, a
+stream with simulated network latency. Aggregate throughput, Jain's fairness
+index of the per-thread throughput and the contention are reported. The
+wrapper's locks can't be observed from Python, so contention is the share of
+each read's latency added over the single-threaded run of the same mode.
+
+With ``--stress`` the script instead hammers a single wrapper with concurrent
+reads, seeks and closes, checking that every successful read returns the
+expected data. Run it against an extension built with ``-Db_sanitize=thread``
+to detect data races.
+"""
+import argparse
+import os
+import random
+import sys
+import tempfile
+import threading
+import time
+
+from gi.repository import Gio
+
+import gio_pyio
+
+try:
+    import _gio_pyio_testing
+except ImportError:
+    _gio_pyio_testing = None
+
+DATA_SIZE = 16 * 1024 * 1024
+BLOCK_SIZE = 64 * 1024
+REMOTE = {'latency': 0.001, 'jitter': 0.0005, 'bandwidth': 200000000}
+
+
+class Backend:
+    """Opens wrappers over the benchmark data."""
+
+    def __init__(self, name, data, path):
+        self.name = name
+        self.data = data
+        self.path = path
+
+    def open(self):
+        if self.name == 'local':
+            return gio_pyio.open(Gio.File.new_for_path(self.path), 'rb',
+                                 buffering=0, native=False)
+        return gio_pyio.StreamWrapper(
+            _gio_pyio_testing.throttled_input(self.data, **REMOTE))
+
+
+class Result:
+
+    def __init__(self):
+        self.bytes = 0
+        self.reads = 0
+        self.elapsed = 0.0
+
+
+def _read_private(backend, result, size):
+    with backend.open() as f:
+        start = time.perf_counter()
+        while True:
+            chunk = f.read(BLOCK_SIZE)
+            if not chunk:
+                break
+            result.bytes += len(chunk)
+            result.reads += 1
+            if result.bytes >= size:
+                break
+        result.elapsed = time.perf_counter() - start
+
+
+def _read_shared(f, offsets, result):
+    buffers = [bytearray(BLOCK_SIZE)]
+    start = time.perf_counter()
+    for offset in offsets:
+        result.bytes += f.readinto_many_at(offset, buffers)
+        result.reads += 1
+    result.elapsed = time.perf_counter() - start
+
+
+def run(backend, mode, n_threads, size):
+    results = [Result() for _i in range(n_threads)]
+    shared = backend.open() if mode == 'shared' else None
+    rng = random.Random(0)
+    blocks = size // BLOCK_SIZE // n_threads
+    threads = []
+    for result in results:
+        if shared is not None:
+            offsets = [rng.randrange(0, DATA_SIZE - BLOCK_SIZE)
+                       for _i in range(blocks)]
+            args = (shared, offsets, result)
+            threads.append(threading.Thread(target=_read_shared, args=args))
+        else:
+            args = (backend, result, size // n_threads)
+            threads.append(threading.Thread(target=_read_private, args=args))
+
+    start = time.perf_counter()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.perf_counter() - start
+    if shared is not None:
+        shared.close()
+
+    rates = [r.bytes / r.elapsed for r in results if r.elapsed]
+    squares = sum(r * r for r in rates)
+    # Threads that read nothing were all treated alike
+    fairness = sum(rates) ** 2 / (len(rates) * squares) if squares else 1.0
+    reads = sum(r.reads for r in results)
+    latency = sum(r.elapsed for r in results) / reads if reads else 0.0
+    throughput = sum(r.bytes for r in results) / elapsed
+    return throughput, fairness, latency
+
+
+def scaling(backends, max_threads, size):
+    print('%-8s %-8s %7s %12s %9s %11s' % ('backend', 'mode', 'threads',
+                                           'MiB/s', 'fairness', 'contention'))
+    for backend in backends:
+        for mode in ('private', 'shared'):
+            n_threads = 1
+            while n_threads <= max_threads:
+                throughput, fairness, latency = run(backend, mode, n_threads,
+                                                    size)
+                if n_threads == 1:
+                    baseline = latency
+                contention = (max(1 - baseline / latency, 0.0) if latency
+                              else 0.0)
+                print('%-8s %-8s %7d %12.1f %9.3f %10.1f%%' % (
+                    backend.name, mode, n_threads, throughput / 2 ** 20,
+                    fairness, contention * 100))
+                n_threads *= 2
+
+
+def _stress_worker(f, data, deadline, seed, failures):
+    rng = random.Random(seed)
+    expected_errors = (ValueError, OSError, RuntimeError)
+    while time.monotonic() < deadline:
+        action = rng.random()
+        try:
+            if action < 0.01:
+                f.close()
+            elif action < 0.5:
+                offset = rng.randrange(len(data))
+                size = rng.randrange(1, BLOCK_SIZE)
+                # seek and read are separate calls, another thread may
+                # move the position in between
+                pos = f.seek(offset)
+                chunk = f.read(size)
+                if chunk and data.find(chunk) < 0:
+                    failures.append('read at %d returned bad data' % pos)
+            else:
+                buf = bytearray(rng.randrange(1, BLOCK_SIZE))
+                f.readinto(buf)
+                f.tell()
+        except expected_errors:
+            pass
+
+
+def stress(backends, n_threads, duration):
+    failures = []
+    for backend in backends:
+        deadline = time.monotonic() + duration
+        rounds = 0
+        while time.monotonic() < deadline:
+            f = backend.open()
+            round_deadline = min(deadline, time.monotonic() + 0.5)
+            threads = [threading.Thread(target=_stress_worker,
+                                        args=(f, backend.data, round_deadline,
+                                              rounds * n_threads + i,
+                                              failures))
+                       for i in range(n_threads)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            f.close()
+            rounds += 1
+        print('%s: %d rounds with %d threads' % (backend.name, rounds,
+                                                 n_threads))
+    for failure in failures:
+        print(failure, file=sys.stderr)
+    return not failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--max-threads', type=int,
+                        default=min(os.cpu_count() or 1, 16))
+    parser.add_argument('--size', type=int, default=256,
+                        help='MiB read per run (default: %(default)s)')
+    parser.add_argument('--stress', action='store_true',
+                        help='run the stress test instead')
+    parser.add_argument('--duration', type=float, default=10.0,
+                        help='seconds per backend with --stress')
+    args = parser.parse_args()
+
+    data = random.Random(0).randbytes(DATA_SIZE)
+    with tempfile.NamedTemporaryFile(prefix='gio-pyio-threads-') as tmp:
+        tmp.write(data)
+        tmp.flush()
+        backends = [Backend('local', data, tmp.name)]
+        if _gio_pyio_testing is not None:
+            backends.append(Backend('remote', data, tmp.name))
+
+        if args.stress:
+            return 0 if stress(backends, args.max_threads,
+                               args.duration) else 1
+        scaling(backends, args.max_threads, args.size * 2 ** 20)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
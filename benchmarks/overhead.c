@@ -0,0 +1,502 @@
+/*
+ * Measure the cost StreamWrapper adds on top of GIO.
+ *
+ * Every case calls a StreamWrapper method from embedded Python and the
+ * equivalent GIO function on an identical GDataInputStream, then reports
+ * both in ns per call. Where perf_event_open is permitted, instructions and
+ * cache misses per call are reported as well.
+ *
+ * Usage: overhead [ITERATIONS]
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <glib/gstdio.h>
+#include <pygobject.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define DEFAULT_ITERATIONS 200000
+#define DATA_SIZE (1024 * 1024)
+#define LINE_LENGTH 64
+#define READ_SIZE 4096
+
+typedef enum
+{
+  SOURCE_MEMORY,
+  SOURCE_UNIX,
+} Source;
+
+typedef struct
+{
+  Source source;
+  // StreamWrapper under test and the fd backing it, if any
+  PyObject *wrapper;
+  int wrapper_fd;
+  // GIO stream the wrapper is compared against
+  GDataInputStream *direct;
+  int direct_fd;
+} Fixture;
+
+typedef gboolean (*DirectFunc) (Fixture *fixture, gboolean *eof);
+
+typedef struct
+{
+  const char *name;
+  const char *method;
+  Py_ssize_t size; // argument of the method, -1 for none
+  gboolean readinto;
+  DirectFunc direct;
+  gboolean needs_seek;
+} Case;
+
+typedef struct
+{
+  double ns;
+  double instructions; // negative if unavailable
+  double cache_misses; // negative if unavailable
+} Sample;
+
+static char data[DATA_SIZE];
+static char scratch[READ_SIZE];
+static const char *tmp_path;
+
+/* perf counters */
+
+typedef struct
+{
+  int instructions;
+  int cache_misses;
+} Counters;
+
+#ifdef __linux__
+static int
+counter_open (guint64 config, int group)
+{
+  struct perf_event_attr attr;
+
+  memset (&attr, 0, sizeof (attr));
+  attr.size = sizeof (attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = group == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall (SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+static void
+counters_open (Counters *counters)
+{
+  counters->instructions = -1;
+  counters->cache_misses = -1;
+#ifdef __linux__
+  counters->instructions = counter_open (PERF_COUNT_HW_INSTRUCTIONS, -1);
+  if (counters->instructions >= 0)
+    counters->cache_misses = counter_open (PERF_COUNT_HW_CACHE_MISSES,
+                                           counters->instructions);
+#endif
+}
+
+static void
+counters_close (Counters *counters)
+{
+  if (counters->cache_misses >= 0)
+    close (counters->cache_misses);
+  if (counters->instructions >= 0)
+    close (counters->instructions);
+}
+
+static void
+counters_start (Counters *counters)
+{
+#ifdef __linux__
+  if (counters->instructions < 0)
+    return;
+  ioctl (counters->instructions, PERF_EVENT_IOC_RESET,
+         PERF_IOC_FLAG_GROUP);
+  ioctl (counters->instructions, PERF_EVENT_IOC_ENABLE,
+         PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+static double
+counter_read (int fd)
+{
+  guint64 value;
+
+  if (fd < 0 || read (fd, &value, sizeof (value)) != sizeof (value))
+    return -1;
+  return (double)value;
+}
+
+static void
+counters_stop (Counters *counters, Sample *sample, long iterations)
+{
+#ifdef __linux__
+  if (counters->instructions >= 0)
+    ioctl (counters->instructions, PERF_EVENT_IOC_DISABLE,
+           PERF_IOC_FLAG_GROUP);
+#endif
+  sample->instructions = counter_read (counters->instructions);
+  sample->cache_misses = counter_read (counters->cache_misses);
+  if (sample->instructions >= 0)
+    sample->instructions /= iterations;
+  if (sample->cache_misses >= 0)
+    sample->cache_misses /= iterations;
+}
+
+static gint64
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Fixtures */
+
+static GInputStream *
+open_source (Source source, int *fd)
+{
+  if (source == SOURCE_MEMORY)
+    {
+      *fd = -1;
+      return g_memory_input_stream_new_from_data (data, DATA_SIZE, NULL);
+    }
+
+  *fd = open (tmp_path, O_RDONLY);
+  if (*fd < 0)
+    g_error ("Failed to open %s", tmp_path);
+  return g_unix_input_stream_new (*fd, TRUE);
+}
+
+static gboolean
+fixture_init (Fixture *fixture, Source source, PyObject *wrapper_type)
+{
+  GInputStream *stream;
+
+  fixture->source = source;
+
+  stream = open_source (source, &fixture->wrapper_fd);
+  PyObject *py_stream = pygobject_new (G_OBJECT (stream));
+  g_object_unref (stream);
+  if (!py_stream)
+    return FALSE;
+  fixture->wrapper = PyObject_CallFunctionObjArgs (wrapper_type, py_stream,
+                                                   NULL);
+  Py_DECREF (py_stream);
+  if (!fixture->wrapper)
+    return FALSE;
+
+  // Mirror what StreamWrapper does internally
+  stream = open_source (source, &fixture->direct_fd);
+  fixture->direct = g_data_input_stream_new (stream);
+  g_data_input_stream_set_newline_type (fixture->direct,
+                                        G_DATA_STREAM_NEWLINE_TYPE_LF);
+  g_object_unref (stream);
+  return TRUE;
+}
+
+static void
+fixture_clear (Fixture *fixture)
+{
+  Py_CLEAR (fixture->wrapper);
+  g_clear_object (&fixture->direct);
+}
+
+/* Rewinding happens at EOF, when the GDataInputStream buffer is empty, so
+ * non-seekable streams are rewound by seeking their fd directly. */
+
+static gboolean
+rewind_wrapper (Fixture *fixture)
+{
+  if (fixture->wrapper_fd >= 0)
+    return lseek (fixture->wrapper_fd, 0, SEEK_SET) == 0;
+
+  PyObject *result = PyObject_CallMethod (fixture->wrapper, "seek", "i", 0);
+  Py_XDECREF (result);
+  return result != NULL;
+}
+
+static gboolean
+rewind_direct (Fixture *fixture)
+{
+  if (fixture->direct_fd >= 0)
+    return lseek (fixture->direct_fd, 0, SEEK_SET) == 0;
+
+  return g_seekable_seek (G_SEEKABLE (fixture->direct), 0, G_SEEK_SET, NULL,
+                          NULL);
+}
+
+/* Direct GIO equivalents of the wrapper methods */
+
+static gboolean
+direct_read (Fixture *fixture, gsize size, gboolean *eof)
+{
+  gssize n = g_input_stream_read (G_INPUT_STREAM (fixture->direct), scratch,
+                                  size, NULL, NULL);
+  *eof = n == 0;
+  return n >= 0;
+}
+
+static gboolean
+direct_read_1 (Fixture *fixture, gboolean *eof)
+{
+  return direct_read (fixture, 1, eof);
+}
+
+static gboolean
+direct_read_block (Fixture *fixture, gboolean *eof)
+{
+  return direct_read (fixture, READ_SIZE, eof);
+}
+
+static gboolean
+direct_readline (Fixture *fixture, gboolean *eof)
+{
+  gsize length;
+  GError *error = NULL;
+  char *line = g_data_input_stream_read_line (fixture->direct, &length,
+                                              NULL, &error);
+  *eof = line == NULL;
+  g_free (line);
+  if (error)
+    {
+      g_error_free (error);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+direct_tell (Fixture *fixture, gboolean *eof)
+{
+  *eof = FALSE;
+  return g_seekable_tell (G_SEEKABLE (fixture->direct)) >= 0;
+}
+
+static gboolean
+direct_nothing (Fixture *fixture, gboolean *eof)
+{
+  *eof = FALSE;
+  return TRUE;
+}
+
+static const Case cases[] = {
+  { "read(1)", "read", 1, FALSE, direct_read_1, FALSE },
+  { "read(4096)", "read", READ_SIZE, FALSE, direct_read_block, FALSE },
+  { "readinto(4096)", "readinto", READ_SIZE, TRUE, direct_read_block, FALSE },
+  { "readline()", "readline", -1, FALSE, direct_readline, FALSE },
+  { "tell()", "tell", -1, FALSE, direct_tell, TRUE },
+  { "readable()", "readable", -1, FALSE, direct_nothing, FALSE },
+};
+
+/* Measurement */
+
+static gboolean
+run_wrapper (Fixture *fixture, const Case *c, long iterations)
+{
+  PyObject *name = PyUnicode_InternFromString (c->method);
+  PyObject *arg = NULL;
+  gboolean ok = FALSE;
+
+  if (c->readinto)
+    arg = PyByteArray_FromStringAndSize (NULL, c->size);
+  else if (c->size >= 0)
+    arg = PyLong_FromSsize_t (c->size);
+
+  for (long i = 0; i < iterations; i++)
+    {
+      PyObject *result
+          = PyObject_CallMethodObjArgs (fixture->wrapper, name, arg, NULL);
+      if (!result)
+        goto out;
+
+      gboolean eof = (PyBytes_Check (result) && PyBytes_GET_SIZE (result) == 0)
+                     || (c->readinto && PyLong_AsLong (result) == 0);
+      Py_DECREF (result);
+      if (eof && !rewind_wrapper (fixture))
+        goto out;
+    }
+  ok = TRUE;
+
+out:
+  Py_XDECREF (arg);
+  Py_DECREF (name);
+  return ok;
+}
+
+static gboolean
+run_direct (Fixture *fixture, const Case *c, long iterations)
+{
+  for (long i = 0; i < iterations; i++)
+    {
+      gboolean eof;
+      if (!c->direct (fixture, &eof))
+        return FALSE;
+      if (eof && !rewind_direct (fixture))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+measure (Fixture *fixture, const Case *c, gboolean wrapped, long iterations,
+         Counters *counters, Sample *sample)
+{
+  gboolean ok;
+
+  counters_start (counters);
+  gint64 start = now_ns ();
+  if (wrapped)
+    ok = run_wrapper (fixture, c, iterations);
+  else
+    ok = run_direct (fixture, c, iterations);
+  sample->ns = (double)(now_ns () - start) / iterations;
+  counters_stop (counters, sample, iterations);
+
+  return ok;
+}
+
+static void
+print_metric (double value)
+{
+  if (value < 0)
+    printf (" %10s", "n/a");
+  else
+    printf (" %10.1f", value);
+}
+
+static void
+print_row (const char *source, const Case *c, const Sample *wrapped,
+           const Sample *direct)
+{
+  printf ("%-7s %-15s %10.1f %10.1f %10.1f", source, c->name, wrapped->ns,
+          direct->ns, wrapped->ns - direct->ns);
+  print_metric (wrapped->instructions);
+  print_metric (direct->instructions);
+  print_metric (wrapped->cache_misses);
+  print_metric (direct->cache_misses);
+  printf ("\n");
+}
+
+static gboolean
+write_tmp_file (void)
+{
+  gchar *path = NULL;
+  int fd = g_file_open_tmp ("gio-pyio-overhead-XXXXXX", &path, NULL);
+
+  if (fd < 0)
+    return FALSE;
+  tmp_path = path;
+
+  gboolean ok = write (fd, data, DATA_SIZE) == DATA_SIZE;
+  close (fd);
+  return ok;
+}
+
+static int
+run (long iterations)
+{
+  static const char *source_names[] = { "memory", "unix" };
+  Counters counters;
+  int status = 0;
+
+  PyObject *module = PyImport_ImportModule ("gio_pyio");
+  PyObject *wrapper_type
+      = module ? PyObject_GetAttrString (module, "StreamWrapper") : NULL;
+  Py_XDECREF (module);
+  if (!wrapper_type)
+    {
+      PyErr_Print ();
+      return 1;
+    }
+
+  counters_open (&counters);
+  printf ("%-7s %-15s %10s %10s %10s %10s %10s %10s %10s\n", "source",
+          "case", "ns", "ns(gio)", "overhead", "instr", "instr(gio)",
+          "misses", "miss(gio)");
+
+  for (Source source = SOURCE_MEMORY; source <= SOURCE_UNIX; source++)
+    {
+      for (gsize i = 0; i < G_N_ELEMENTS (cases); i++)
+        {
+          const Case *c = &cases[i];
+          Fixture fixture = { 0 };
+          Sample wrapped, direct;
+
+          if (c->needs_seek && source != SOURCE_MEMORY)
+            continue;
+
+          if (!fixture_init (&fixture, source, wrapper_type)
+              || !measure (&fixture, c, TRUE, iterations, &counters,
+                           &wrapped)
+              || !measure (&fixture, c, FALSE, iterations, &counters,
+                           &direct))
+            {
+              if (PyErr_Occurred ())
+                PyErr_Print ();
+              fprintf (stderr, "%s %s failed\n", source_names[source],
+                       c->name);
+              status = 1;
+            }
+          else
+            print_row (source_names[source], c, &wrapped, &direct);
+          fixture_clear (&fixture);
+        }
+    }
+
+  counters_close (&counters);
+  Py_DECREF (wrapper_type);
+  return status;
+}
+
+int
+main (int argc, char **argv)
+{
+  long iterations = argc > 1 ? atol (argv[1]) : DEFAULT_ITERATIONS;
+  int status;
+
+  if (iterations <= 0)
+    {
+      fprintf (stderr, "usage: %s [ITERATIONS]\n", argv[0]);
+      return 2;
+    }
+
+  for (gsize i = 0; i < DATA_SIZE; i++)
+    data[i] = (i + 1) % LINE_LENGTH ? 'a' + i % 26 : '\n';
+  // Every exit from here on goes through the unlink below
+  if (!write_tmp_file ())
+    {
+      fprintf (stderr, "Failed to write temporary file\n");
+      status = 1;
+      goto out;
+    }
+
+  Py_Initialize ();
+  if (!pygobject_init (-1, -1, -1))
+    {
+      PyErr_Print ();
+      status = 1;
+    }
+  else
+    status = run (iterations);
+  if (Py_FinalizeEx () < 0)
+    status = 1;
+
+out:
+  if (tmp_path)
+    g_unlink (tmp_path);
+  return status;
+}
@@ -1,16 +1,27 @@
 """gio_pyio lib."""
+import contextlib
 import io
+import json
 import os
+import threading
+import time
 
-from gi.repository import GLib, Gio
+from ._gio_pyio import (Limiter, Scheduler, SpooledStreamWrapper,
+                        StreamWrapper, TRACEMALLOC_DOMAIN, backend_stats,
+                        io_pool_stats, set_backend_concurrency, set_io_pool)
 
-from ._gio_pyio import StreamWrapper
+__all__ = ['Limiter', 'Scheduler', 'SpooledStreamWrapper', 'StreamHandle',
+           'StreamWrapper', 'TRACEMALLOC_DOMAIN', 'backend_stats', 'concat',
+           'io_pool_stats', 'set_backend_concurrency', 'set_io_pool',
+           'split_ranges', 'tee']
 
-__all__ = ['StreamWrapper']
+concat = StreamWrapper.concat
+tee = StreamWrapper.tee
 
 
 def open(file, mode='r', buffering=-1, encoding=None, errors=None,
-         newline=None, native=True):
+         newline=None, native=True, priority=0, limiter=None, scheduler=None,
+         tenant=None, retries=0):
     r"""Open the file and create a corresponding `file object`_.
 
     If the file cannot be opened, an OSError is raised. This behaves analog to
@@ -89,9 +100,33 @@ def open(file, mode='r', buffering=-1, encoding=None, errors=None,
           newline is '', no translation takes place. If newline is any of
           the other legal values, any '\n' characters written are translated
           to the given string.
-    :param bool native:
+    :param native:
         Try and obtain a file descriptor and use python standard io libraries.
-        If False, the result will always be a wrapped Gio stream.
+        If False, the result will always be a wrapped Gio stream. Pass
+        ``'auto'`` to also open files on gvfs mounts through their FUSE path
+        when that was measured to be faster than the Gio stream. The first
+        such open on a mount reads a sample of the file both ways, for
+        sequential access and for random access, and keeps the throughputs
+        in a profile in the user's cache directory, or in the file named by
+        the ``GIO_PYIO_ROUTE_PROFILE`` environment variable. Files opened
+        for updating are routed by random access, others by sequential
+        access. Measurements are repeated after a week.
+    :param int priority:
+        I/O priority of a file opened as a Gio stream, one of the
+        ``GLib.PRIORITY_*`` values. See :attr:`StreamWrapper.priority`.
+    :param Limiter limiter:
+        Limiter the reads and writes of a file opened as a Gio stream have
+        to pass.
+    :param Scheduler scheduler:
+        Scheduler the reads and writes of a file opened as a Gio stream are
+        queued in, on behalf of *tenant*.
+    :param str tenant:
+        Name of the tenant of *scheduler* the file is opened for.
+    :param int retries:
+        Reopen a file opened for reading as a Gio stream up to this many
+        times when the connection to its backend drops, and resume reading
+        where it stopped if the file is unchanged. See
+        :class:`StreamWrapper`.
     :rtype: file-like
     :returns:
         A new `file object`_. When used to open a file in a text mode ('w',
@@ -113,11 +148,17 @@ def open(file, mode='r', buffering=-1, encoding=None, errors=None,
     .. _file object: https://docs.python.org/3/glossary.html#term-file-object
     .. _Reading and Writing Files: https://docs.python.org/3/tutorial/inputoutput.html#tut-files
     """
+    # Deferred, loading the typelibs is expensive and not needed to import
+    # this module
+    from gi.repository import Gio
+
     # Argument validation
     if not isinstance(mode, str):
         raise TypeError('invalid mode: %r' % mode)
     if not isinstance(buffering, int):
         raise TypeError('invalid buffering: %r' % buffering)
+    if isinstance(native, str) and native != 'auto':
+        raise ValueError('invalid native: %r' % native)
     modes = set(mode)
     if modes - set('axrwb+t') or len(mode) > len(modes):
         raise ValueError('invalid mode: %r' % mode)
@@ -145,6 +186,8 @@ def open(file, mode='r', buffering=-1, encoding=None, errors=None,
         raise ValueError("binary mode doesn't take an errors argument")
     if binary and newline is not None:
         raise ValueError("binary mode doesn't take a newline argument")
+    if retries and not (reading and not updating):
+        raise ValueError('retries are only supported for reading')
 
     # For non-native files we use the result of `file.get_basename()`
     rep_str = file.peek_path() if file.is_native() else file.get_basename()
@@ -159,9 +202,16 @@ def open(file, mode='r', buffering=-1, encoding=None, errors=None,
     if buffering == 0 and not binary:
         raise ValueError("can't have unbuffered text I/O")
 
-    if native and file.is_native():
+    if native == 'auto':
+        path = _route(file, 'random' if updating else 'sequential')
+    elif native and file.is_native():
+        path = file.peek_path()
+    else:
+        path = None
+
+    if path is not None:
         file_like = io.FileIO(
-            file.peek_path(),
+            path,
             (creating and 'x' or '') +
             (reading and 'r' or '') +
             (writing and 'w' or '') +
@@ -194,7 +244,9 @@ def open(file, mode='r', buffering=-1, encoding=None, errors=None,
         # at this point stream should not be `None` or input validation has
         # failed substantially
         assert stream is not None
-        file_like = StreamWrapper(stream)
+        file_like = StreamWrapper(stream, file=file, priority=priority,
+                                  limiter=limiter, scheduler=scheduler,
+                                  tenant=tenant, retries=retries)
     line_buffering = False
     if buffering != 0:
         if buffering == 1:
@@ -222,3 +274,371 @@ def open(file, mode='r', buffering=-1, encoding=None, errors=None,
                                      line_buffering=line_buffering)
         file_like.mode = mode
     return file_like
+
+
+_PROBE_CHUNK = 64 * 1024
+_PROBE_SEQUENTIAL = 1024 * 1024
+_PROBE_RANDOM = 16
+_PROBE_RANDOM_SIZE = 4096
+_PROFILE_MAX_AGE = 7 * 24 * 3600
+_PROFILE_MAX_MOUNTS = 64
+
+
+def _probe(opener, size):
+    """Return the sequential and random read throughput in bytes/s."""
+    buffer = bytearray(_PROBE_CHUNK)
+    start = time.perf_counter()
+    with opener() as f:
+        done = 0
+        while done < min(size, _PROBE_SEQUENTIAL):
+            n = f.readinto(buffer)
+            if not n:
+                break
+            done += n
+    sequential = done / max(time.perf_counter() - start, 1e-9)
+
+    view = memoryview(buffer)[:_PROBE_RANDOM_SIZE]
+    start = time.perf_counter()
+    with opener() as f:
+        done = 0
+        # Visit evenly spread blocks in an order that never runs forward
+        stride = max(size // _PROBE_RANDOM, 1)
+        for i in range(_PROBE_RANDOM):
+            f.seek((i * 7 % _PROBE_RANDOM) * stride)
+            done += f.readinto(view) or 0
+    random = done / max(time.perf_counter() - start, 1e-9)
+    return sequential, random
+
+
+class _RouteProfile:
+    """Read throughputs per mount, through FUSE and through Gio."""
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._path = None
+        self._mounts = None
+
+    def _load(self):
+        path = os.environ.get('GIO_PYIO_ROUTE_PROFILE')
+        if not path:
+            from gi.repository import GLib
+
+            path = os.path.join(GLib.get_user_cache_dir(), 'gio_pyio',
+                                'routes.json')
+        if path != self._path:
+            self._path = path
+            try:
+                with io.open(path, encoding='utf-8') as f:
+                    self._mounts = json.load(f)
+                if not isinstance(self._mounts, dict):
+                    self._mounts = {}
+            except (OSError, ValueError):
+                self._mounts = {}
+
+    def _save(self):
+        # Written aside and renamed, so concurrent processes never read
+        # half a profile
+        temporary = '%s.%d' % (self._path, os.getpid())
+        try:
+            os.makedirs(os.path.dirname(self._path), exist_ok=True)
+            with io.open(temporary, 'w', encoding='utf-8') as f:
+                json.dump(self._mounts, f)
+            os.replace(temporary, self._path)
+        except OSError:
+            with contextlib.suppress(OSError):
+                os.unlink(temporary)
+
+    def lookup(self, mount):
+        with self._lock:
+            self._load()
+            entry = self._mounts.get(mount)
+        try:
+            if time.time() - entry['time'] < _PROFILE_MAX_AGE:
+                return entry
+        except (KeyError, TypeError):
+            pass
+        return None
+
+    def record(self, mount, entry):
+        with self._lock:
+            self._load()
+            self._mounts[mount] = entry
+            if len(self._mounts) > _PROFILE_MAX_MOUNTS:
+                oldest = min(self._mounts,
+                             key=lambda m: self._mounts[m].get('time', 0))
+                del self._mounts[oldest]
+            self._save()
+
+
+_route_profile = _RouteProfile()
+
+
+def _mount_key(file):
+    from gi.repository import GLib
+
+    try:
+        return file.find_enclosing_mount(None).get_root().get_uri()
+    except GLib.Error:
+        scheme, _, rest = file.get_uri().partition('://')
+        return '%s://%s' % (scheme, rest.split('/', 1)[0])
+
+
+def _route(file, access):
+    """Return the local path to open *file* by for *access*, or None."""
+    if file.is_native():
+        return file.peek_path()
+    path = file.get_path()
+    if path is None:
+        return None
+
+    mount = _mount_key(file)
+    entry = _route_profile.lookup(mount)
+    if entry is None:
+        from gi.repository import GLib
+
+        try:
+            size = os.stat(path).st_size
+            if not size:
+                # Nothing to measure with, the next open tries again
+                return None
+            openers = {
+                'fuse': lambda: io.FileIO(path, 'rb'),
+                'gio': lambda: StreamWrapper(file.read(None), file=file),
+            }
+            # Whichever runs first reads cold caches, so the order is
+            # mirrored and each route keeps its better run
+            results = {}
+            for route in ('fuse', 'gio', 'gio', 'fuse'):
+                result = _probe(openers[route], size)
+                results[route] = tuple(map(max, results.get(route, result),
+                                           result))
+            fuse, gio = results['fuse'], results['gio']
+        except (OSError, GLib.Error):
+            return None
+        entry = {'time': time.time(),
+                 'sequential': {'fuse': fuse[0], 'gio': gio[0]},
+                 'random': {'fuse': fuse[1], 'gio': gio[1]}}
+        _route_profile.record(mount, entry)
+
+    try:
+        faster = entry[access]['fuse'] > entry[access]['gio']
+    except (KeyError, TypeError):
+        faster = False
+    return path if faster else None
+
+
+class StreamHandle:
+    """Picklable description of a byte range of a file.
+
+    Handles are created by :meth:`StreamWrapper.handle` and reopened with
+    :meth:`open`, typically in another process. Pickled for a
+    :mod:`multiprocessing` worker, a handle carries a duplicate of its file
+    descriptor, passed with ``SCM_RIGHTS`` where the platform supports it.
+    Plain :mod:`pickle` only keeps the URI. A handle owns its descriptor and
+    closes it when it is garbage collected.
+
+    :ivar str uri:
+        URI of the file, ``None`` if the wrapper was not opened from one.
+    :ivar str mode:
+        Either 'rb' or 'r+b', handles never truncate.
+    :ivar int offset:
+        Start of the range.
+    :ivar int length:
+        Length of the range, -1 for everything after *offset*.
+    :ivar str etag:
+        Entity tag of the file when the handle was created, if the backend
+        provides one.
+    """
+
+    __slots__ = ('uri', 'mode', 'offset', 'length', 'etag', '_fd', '_owned')
+
+    def __init__(self, uri, mode, offset, length, etag=None, fd=None):
+        self.uri = uri
+        self.mode = mode
+        self.offset = offset
+        self.length = length
+        self.etag = etag
+        self._fd = fd
+        self._owned = fd is not None
+        _register_reducer()
+
+    def __repr__(self):
+        return '<%s %s [%d:%s]>' % (
+            type(self).__name__, self.uri or 'fd=%d' % self._fd, self.offset,
+            '' if self.length < 0 else self.offset + self.length)
+
+    def __reduce__(self):
+        return (StreamHandle, (self.uri, self.mode, self.offset, self.length,
+                               self.etag))
+
+    def __del__(self):
+        if self._owned:
+            os.close(self._fd)
+
+    def open(self):
+        """Open a new wrapper restricted to the range.
+
+        Positions of the wrapper are relative to the start of the range and
+        reads stop at its end. The position is independent of the wrapper
+        the handle was created from and of other wrappers opened from the
+        handle. Wrappers reopened from a file descriptor read it as a plain
+        stream and can't seek.
+
+        :rtype: StreamWrapper
+        :raises OSError:
+            The file can't be opened, or was modified since the handle was
+            created. Handles with a file descriptor but no URI can't be
+            checked for modifications.
+        """
+        if self._fd is not None:
+            return self._open_fd()
+        return self._open_uri()
+
+    def _open_fd(self):
+        if self.uri is not None and self.etag is not None:
+            from gi.repository import Gio
+
+            file = Gio.File.new_for_uri(self.uri)
+            info = file.query_info(Gio.FILE_ATTRIBUTE_ETAG_VALUE,
+                                   Gio.FileQueryInfoFlags.NONE, None)
+            self._check_etag(info)
+
+        # Reopening through /proc gives a new open file description, a
+        # plain dup() would share the file position
+        try:
+            fd = os.open('/proc/self/fd/%d' % self._fd,
+                         os.O_RDWR if '+' in self.mode else os.O_RDONLY)
+        except OSError:
+            fd = os.dup(self._fd)
+        try:
+            return StreamWrapper.from_fd(fd, self.mode, offset=self.offset,
+                                         length=self.length)
+        except BaseException:
+            os.close(fd)
+            raise
+
+    def _open_uri(self):
+        if self.uri is None:
+            raise OSError('handle has neither a URI nor a file descriptor')
+
+        from gi.repository import Gio
+
+        file = Gio.File.new_for_uri(self.uri)
+        if '+' in self.mode:
+            stream = file.open_readwrite(None)
+        else:
+            stream = file.read(None)
+        if self.etag is not None:
+            info = stream.query_info(Gio.FILE_ATTRIBUTE_ETAG_VALUE, None)
+            try:
+                self._check_etag(info)
+            except OSError:
+                stream.close(None)
+                raise
+        return StreamWrapper(stream, file=file, offset=self.offset,
+                             length=self.length)
+
+    def _check_etag(self, info):
+        if info.get_etag() != self.etag:
+            raise OSError("file changed since handle was created: '%s'"
+                          % self.uri)
+
+
+def _rebuild_handle(uri, mode, offset, length, etag, dup_fd):
+    fd = None if dup_fd is None else dup_fd.detach()
+    return StreamHandle(uri, mode, offset, length, etag, fd)
+
+
+def _reduce_handle(handle):
+    from multiprocessing.reduction import DupFd
+
+    dup_fd = None if handle._fd is None else DupFd(handle._fd)
+    return (_rebuild_handle, (handle.uri, handle.mode, handle.offset,
+                              handle.length, handle.etag, dup_fd))
+
+
+_reducer_registered = False
+
+
+def _register_reducer():
+    # Keeps multiprocessing out of the import of gio_pyio
+    global _reducer_registered
+    if not _reducer_registered:
+        from multiprocessing.reduction import register
+
+        register(StreamHandle, _reduce_handle)
+        _reducer_registered = True
+
+
+def _next_record(f, target, delimiter, size):
+    """Return the end of the first *delimiter* ending at or after *target*."""
+    base = max(target - len(delimiter), 0)
+    f.seek(base)
+    window = b''
+    while True:
+        chunk = f.read(64 * 1024)
+        if not chunk:
+            return size
+        window += chunk
+        index = window.find(delimiter)
+        if index >= 0:
+            return base + index + len(delimiter)
+        # Keep enough to find a delimiter spanning two chunks
+        keep = len(delimiter) - 1
+        base += len(window) - keep
+        window = window[len(window) - keep:] if keep else b''
+
+
+def split_ranges(file, n, delimiter=b'\n'):
+    """Split a file into *n* ranges of whole records.
+
+    Split points are first placed evenly, then moved forward to just after
+    the next *delimiter*, so no record is cut in half. Each range can be
+    opened with :meth:`StreamHandle.open` or handed to another process, for
+    example to process a large file with a :mod:`multiprocessing` pool.
+
+    :param file:
+        The file to split, either a :class:`Gio.File` or a readable,
+        seekable :class:`StreamWrapper`. The position of a wrapper is
+        restored afterwards.
+    :param int n:
+        Number of ranges. Ranges are empty if there are fewer records.
+    :param bytes delimiter:
+        Byte sequence ending a record.
+    :rtype: list[StreamHandle]
+    :returns:
+        *n* adjacent, non-overlapping ranges covering the whole file.
+    :raises ValueError:
+        *n* is less than 1 or *delimiter* is empty.
+    """
+    if n < 1:
+        raise ValueError('n must be at least 1')
+    if not delimiter:
+        raise ValueError('empty delimiter')
+
+    if isinstance(file, StreamWrapper):
+        f = file
+        position = f.tell()
+    else:
+        f = StreamWrapper(file.read(None), file=file)
+        position = None
+
+    try:
+        size = f.seek(0, io.SEEK_END)
+        bounds = [0]
+        for i in range(1, n):
+            target = max(size * i // n, bounds[-1])
+            if target == bounds[-1] or target >= size:
+                bounds.append(min(target, size))
+            else:
+                bounds.append(_next_record(f, target, delimiter, size))
+        bounds.append(size)
+
+        handles = [f.handle(start, end - start)
+                   for start, end in zip(bounds, bounds[1:])]
+    finally:
+        if position is None:
+            f.close()
+        else:
+            f.seek(position)
+    return handles
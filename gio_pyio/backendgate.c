@@ -0,0 +1,375 @@
+#define PY_SSIZE_T_CLEAN
+#include "backendgate.h"
+
+/*
+ * Transfers enter the gate of their backend before they start and leave it
+ * when they are done, without running any Python code in between. Once the
+ * limit is reached further transfers queue up and are let in first come,
+ * first served. Auto-tuned gates look for the limit with the best
+ * throughput by hill climbing: every window in which the limit was reached
+ * they take a step, reversing direction whenever the throughput did not
+ * improve on the previous window.
+ */
+struct _BackendGate
+{
+  GMutex mutex;
+  GCond changed;
+  // 0 for unlimited
+  guint limit;
+  gboolean auto_tune;
+  guint active;
+  // Addresses of waiting callers' stack variables, in arrival order
+  GQueue waiting;
+  // Statistics, see backend_stats()
+  guint64 total_ops;
+  guint64 total_bytes;
+  // Measurement of the current auto-tuning window
+  gint64 window_start;
+  guint64 window_bytes;
+  gboolean saturated;
+  double last_rate;
+  int direction;
+};
+
+#define AUTO_INITIAL_LIMIT 4
+#define AUTO_MAX_LIMIT 64
+#define AUTO_WINDOW_USEC (G_USEC_PER_SEC / 2)
+
+static GMutex gates_mutex;
+static GHashTable *gates;
+
+/*
+ * Reduce *uri* to the backend it points into, its scheme and host. Returns
+ * NULL if it isn't a URI.
+ */
+char *
+backend_key_for_uri (const char *uri)
+{
+  char *scheme = NULL;
+  char *host = NULL;
+  int port = -1;
+
+  if (!g_uri_split (uri, G_URI_FLAGS_NONE, &scheme, NULL, &host, &port, NULL,
+                    NULL, NULL, NULL))
+    return NULL;
+  if (!scheme)
+    {
+      // A relative reference
+      g_free (host);
+      return NULL;
+    }
+
+  char *key = port < 0
+                  ? g_strdup_printf ("%s://%s", scheme, host ? host : "")
+                  : g_strdup_printf ("%s://%s:%d", scheme,
+                                     host ? host : "", port);
+  char *folded = g_ascii_strdown (key, -1);
+  g_free (key);
+  g_free (scheme);
+  g_free (host);
+  return folded;
+}
+
+static BackendGate *
+gate_for_key (char *key)
+{
+  g_mutex_lock (&gates_mutex);
+  if (!gates)
+    gates = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  BackendGate *gate = g_hash_table_lookup (gates, key);
+  if (gate)
+    g_free (key);
+  else
+    {
+      gate = g_new0 (BackendGate, 1);
+      g_mutex_init (&gate->mutex);
+      g_cond_init (&gate->changed);
+      g_queue_init (&gate->waiting);
+      gate->direction = 1;
+      g_hash_table_insert (gates, key, gate);
+    }
+  g_mutex_unlock (&gates_mutex);
+  return gate;
+}
+
+BackendGate *
+backend_gate_for_file (GFile *file)
+{
+  char *uri = g_file_get_uri (file);
+  char *key = backend_key_for_uri (uri);
+  g_free (uri);
+  return key ? gate_for_key (key) : NULL;
+}
+
+// Called with the mutex held
+static gboolean
+has_room (BackendGate *gate)
+{
+  return gate->limit == 0 || gate->active < gate->limit;
+}
+
+// Called with the mutex held
+static void
+admit (BackendGate *gate)
+{
+  gate->active++;
+  gate->total_ops++;
+  if (gate->limit > 0 && gate->active >= gate->limit)
+    gate->saturated = TRUE;
+}
+
+/*
+ * Enter *gate* if that doesn't mean waiting.
+ */
+gboolean
+backend_gate_try_enter (BackendGate *gate)
+{
+  g_mutex_lock (&gate->mutex);
+  gboolean entered = g_queue_is_empty (&gate->waiting) && has_room (gate);
+  if (entered)
+    admit (gate);
+  g_mutex_unlock (&gate->mutex);
+  return entered;
+}
+
+static void
+wake_waiters (GCancellable *cancellable, gpointer data)
+{
+  BackendGate *gate = data;
+
+  g_mutex_lock (&gate->mutex);
+  g_cond_broadcast (&gate->changed);
+  g_mutex_unlock (&gate->mutex);
+}
+
+/*
+ * Wait for *gate* to let the caller in, after everyone who came before.
+ * Fails if *cancellable* is cancelled first.
+ */
+gboolean
+backend_gate_enter (BackendGate *gate, GCancellable *cancellable,
+                    GError **error)
+{
+  gulong handler
+      = g_cancellable_connect (cancellable, G_CALLBACK (wake_waiters), gate,
+                               NULL);
+  int ticket;
+  gboolean entered = FALSE;
+
+  g_mutex_lock (&gate->mutex);
+  g_queue_push_tail (&gate->waiting, &ticket);
+  gate->saturated = TRUE;
+  for (;;)
+    {
+      if (g_queue_peek_head (&gate->waiting) == &ticket && has_room (gate))
+        {
+          admit (gate);
+          entered = TRUE;
+          break;
+        }
+      if (g_cancellable_is_cancelled (cancellable))
+        break;
+      g_cond_wait (&gate->changed, &gate->mutex);
+    }
+  g_queue_remove (&gate->waiting, &ticket);
+  // The next in line may be able to go now too, or be first now
+  g_cond_broadcast (&gate->changed);
+  g_mutex_unlock (&gate->mutex);
+
+  g_cancellable_disconnect (cancellable, handler);
+  if (!entered)
+    g_cancellable_set_error_if_cancelled (cancellable, error);
+  return entered;
+}
+
+// Called with the mutex held
+static void
+tune (BackendGate *gate)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 elapsed = now - gate->window_start;
+  if (elapsed < AUTO_WINDOW_USEC)
+    return;
+
+  // Throughput is only telling if the limit was what held it back
+  if (gate->saturated)
+    {
+      double rate = (double)gate->window_bytes * G_USEC_PER_SEC / elapsed;
+      if (rate < gate->last_rate * 1.05)
+        gate->direction = -gate->direction;
+      gate->last_rate = rate;
+
+      guint limit = gate->limit;
+      if (gate->direction > 0 && limit < AUTO_MAX_LIMIT)
+        gate->limit = limit + 1;
+      else if (gate->direction < 0 && limit > 1)
+        gate->limit = limit - 1;
+      if (gate->limit > limit)
+        g_cond_broadcast (&gate->changed);
+    }
+
+  gate->window_start = now;
+  gate->window_bytes = 0;
+  gate->saturated = gate->active >= gate->limit;
+}
+
+void
+backend_gate_leave (BackendGate *gate)
+{
+  g_mutex_lock (&gate->mutex);
+  gate->active--;
+  if (!g_queue_is_empty (&gate->waiting))
+    g_cond_broadcast (&gate->changed);
+  g_mutex_unlock (&gate->mutex);
+}
+
+/*
+ * Record *bytes* transferred by an operation in the gate, which auto-tuned
+ * gates measure throughput by.
+ */
+void
+backend_gate_consume (BackendGate *gate, gsize bytes)
+{
+  g_mutex_lock (&gate->mutex);
+  gate->total_bytes += bytes;
+  gate->window_bytes += bytes;
+  if (gate->auto_tune)
+    tune (gate);
+  g_mutex_unlock (&gate->mutex);
+}
+
+static BackendGate *
+parse_backend (const char *uri)
+{
+  char *key = backend_key_for_uri (uri);
+  if (!key)
+    {
+      PyErr_Format (PyExc_ValueError, "not a URI: %s", uri);
+      return NULL;
+    }
+  return gate_for_key (key);
+}
+
+PyDoc_STRVAR (
+    set_backend_concurrency_doc,
+    "Cap the number of operations in flight against a backend.\n"
+    "\n"
+    "Backends are told apart by URI scheme and host, so all files of one\n"
+    "SFTP server share a cap, as do all local files. Wrappers opened from\n"
+    "a file of the backend, see the *file* argument of\n"
+    ":class:`StreamWrapper`, wait for a free slot before each read or\n"
+    "write, in the order they arrived, and hold it for that transfer\n"
+    "only. The wait counts towards :attr:`StreamWrapper.timeout`. The cap\n"
+    "applies to the whole process and can be changed at any time.\n"
+    "\n"
+    ":param str backend:\n"
+    "   Any URI on the backend, such as ``'sftp://example.com/'``.\n"
+    ":param limit:\n"
+    "   The number of operations let through at once, 0 for unlimited, or\n"
+    "   ``'auto'`` to search for the number giving the most throughput,\n"
+    "   starting from 4.\n"
+    ":type limit: int or str\n"
+    ":raises ValueError:\n"
+    "   Invalid backend or limit.");
+static PyObject *
+set_backend_concurrency_impl (PyObject *module, PyObject *args)
+{
+  const char *uri;
+  PyObject *py_limit;
+
+  if (!PyArg_ParseTuple (args, "sO", &uri, &py_limit))
+    return NULL;
+
+  gboolean auto_tune = FALSE;
+  unsigned long limit = AUTO_INITIAL_LIMIT;
+  if (PyUnicode_Check (py_limit))
+    {
+      if (PyUnicode_CompareWithASCIIString (py_limit, "auto") != 0)
+        {
+          PyErr_SetString (PyExc_ValueError, "invalid limit");
+          return NULL;
+        }
+      auto_tune = TRUE;
+    }
+  else
+    {
+      limit = PyLong_AsUnsignedLong (py_limit);
+      if (limit == (unsigned long)-1 && PyErr_Occurred ())
+        return NULL;
+      if (limit > G_MAXUINT)
+        {
+          PyErr_SetString (PyExc_ValueError, "invalid limit");
+          return NULL;
+        }
+    }
+
+  BackendGate *gate = parse_backend (uri);
+  if (!gate)
+    return NULL;
+
+  g_mutex_lock (&gate->mutex);
+  gate->limit = (guint)limit;
+  gate->auto_tune = auto_tune;
+  gate->window_start = g_get_monotonic_time ();
+  gate->window_bytes = 0;
+  gate->last_rate = 0;
+  gate->direction = 1;
+  g_cond_broadcast (&gate->changed);
+  g_mutex_unlock (&gate->mutex);
+
+  Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR (backend_stats_doc,
+              "Report the state of a backend's concurrency cap.\n"
+              "\n"
+              ":param str backend:\n"
+              "   Any URI on the backend.\n"
+              ":rtype: dict\n"
+              ":returns:\n"
+              "   A mapping of ``limit`` (current cap, 0 for unlimited),\n"
+              "   ``auto`` (whether the cap is tuned), ``active`` and\n"
+              "   ``waiting`` (operations in flight and queued),\n"
+              "   ``operations`` and ``bytes`` (totals since the start).\n"
+              ":raises ValueError:\n"
+              "   Invalid backend.");
+static PyObject *
+backend_stats_impl (PyObject *module, PyObject *args)
+{
+  const char *uri;
+
+  if (!PyArg_ParseTuple (args, "s", &uri))
+    return NULL;
+
+  BackendGate *gate = parse_backend (uri);
+  if (!gate)
+    return NULL;
+
+  g_mutex_lock (&gate->mutex);
+  unsigned int limit = gate->limit;
+  int auto_tune = gate->auto_tune;
+  unsigned int active = gate->active;
+  unsigned int waiting = g_queue_get_length (&gate->waiting);
+  unsigned long long total_ops = gate->total_ops;
+  unsigned long long total_bytes = gate->total_bytes;
+  g_mutex_unlock (&gate->mutex);
+
+  return Py_BuildValue ("{s:I,s:N,s:I,s:I,s:K,s:K}", "limit", limit, "auto",
+                        PyBool_FromLong (auto_tune), "active", active,
+                        "waiting", waiting, "operations", total_ops, "bytes",
+                        total_bytes);
+}
+
+static PyMethodDef BackendGate_functions[]
+    = { { "set_backend_concurrency", (PyCFunction)set_backend_concurrency_impl,
+          METH_VARARGS, set_backend_concurrency_doc },
+        { "backend_stats", (PyCFunction)backend_stats_impl, METH_VARARGS,
+          backend_stats_doc },
+        { NULL } };
+
+int
+PyBackendGate_AddFunctions (PyObject *module)
+{
+  return PyModule_AddFunctions (module, BackendGate_functions);
+}
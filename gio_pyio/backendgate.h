@@ -0,0 +1,22 @@
+#ifndef BACKENDGATE_H
+#define BACKENDGATE_H
+
+#include <Python.h>
+#include <gio/gio.h>
+
+/* Caps the operations in flight against one backend, a URI scheme and
+ * host. Gates live as long as the process and are shared by all wrappers
+ * and interpreters. */
+typedef struct _BackendGate BackendGate;
+
+char *backend_key_for_uri (const char *uri);
+BackendGate *backend_gate_for_file (GFile *file);
+gboolean backend_gate_try_enter (BackendGate *gate);
+gboolean backend_gate_enter (BackendGate *gate, GCancellable *cancellable,
+                             GError **error);
+void backend_gate_leave (BackendGate *gate);
+void backend_gate_consume (BackendGate *gate, gsize bytes);
+
+int PyBackendGate_AddFunctions (PyObject *module);
+
+#endif
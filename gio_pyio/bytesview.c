@@ -0,0 +1,62 @@
+#define PY_SSIZE_T_CLEAN
+#include "bytesview.h"
+
+/*
+ * Exports the data of a GBytes through the buffer protocol, so memoryviews
+ * of it need neither a copy nor the GBytes outliving them by luck.
+ */
+typedef struct
+{
+  PyObject_HEAD GBytes *bytes;
+} BytesView;
+
+static int
+BytesView_getbuffer (BytesView *self, Py_buffer *view, int flags)
+{
+  gsize size = 0;
+  gconstpointer data = self->bytes ? g_bytes_get_data (self->bytes, &size)
+                                   : NULL;
+
+  return PyBuffer_FillInfo (view, (PyObject *)self, (void *)data,
+                            (Py_ssize_t)size, 1, flags);
+}
+
+static void
+BytesView_dealloc (BytesView *self)
+{
+  g_clear_pointer (&self->bytes, g_bytes_unref);
+  PyTypeObject *type = Py_TYPE (self);
+  type->tp_free ((PyObject *)self);
+  // Instances of heap types own a reference to their type
+  Py_DECREF (type);
+}
+
+static PyType_Slot BytesView_slots[]
+    = { { Py_tp_dealloc, (void *)BytesView_dealloc },
+        { Py_bf_getbuffer, (void *)BytesView_getbuffer },
+        { 0, NULL } };
+
+static PyType_Spec BytesView_spec = { .name = "gio_pyio._BytesView",
+                                      .basicsize = sizeof (BytesView),
+                                      .itemsize = 0,
+                                      .flags = Py_TPFLAGS_DEFAULT,
+                                      .slots = BytesView_slots };
+
+PyObject *
+PyBytesViewType_Create (PyObject *module)
+{
+  return PyType_FromModuleAndSpec (module, &BytesView_spec, NULL);
+}
+
+PyObject *
+bytes_view_new (PyTypeObject *type, GBytes *bytes)
+{
+  BytesView *self = PyObject_New (BytesView, type);
+  if (!self)
+    return NULL;
+  self->bytes = g_bytes_ref (bytes);
+
+  PyObject *view = PyMemoryView_FromObject ((PyObject *)self);
+  Py_DECREF (self);
+  return view;
+}
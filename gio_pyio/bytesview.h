@@ -0,0 +1,12 @@
+#ifndef BYTESVIEW_H
+#define BYTESVIEW_H
+
+#include <Python.h>
+#include <glib.h>
+
+PyObject *PyBytesViewType_Create (PyObject *module);
+
+/* Read-only memoryview of *bytes*, keeping a reference to it. */
+PyObject *bytes_view_new (PyTypeObject *type, GBytes *bytes);
+
+#endif
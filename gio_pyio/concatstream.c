@@ -0,0 +1,543 @@
+#include "concatstream.h"
+#include "iopool.h"
+#include "iopriority.h"
+
+/*
+ * Reads a list of files and streams one after another, as a single seekable
+ * stream. Offsets are mapped to segments with an index of their sizes, which
+ * are queried up front where possible and learned on EOF otherwise. Files
+ * are only opened once they are read, and the next file is opened in the
+ * background while the current one is read, hiding the latency of opening
+ * remote files. Only one file is kept open at a time.
+ */
+typedef struct
+{
+  // Opened lazily if set, otherwise stream was passed in
+  GFile *file;
+  GInputStream *stream;
+  // Position of stream where the segment starts
+  goffset origin;
+  // Offset in the concatenation, valid for the first n_indexed segments
+  goffset start;
+  // -1 if unknown until EOF
+  goffset size;
+} Segment;
+
+// Opening of a file segment running on the pool of its backend
+typedef struct
+{
+  GFile *file;
+  guint index;
+  GCancellable *cancellable;
+  // ioprio of the reader, the pool worker opens the file with it
+  int ioprio;
+  GInputStream *stream;
+  GError *error;
+  GMutex mutex;
+  GCond done;
+  gboolean finished;
+} Prefetch;
+
+struct _ConcatInputStream
+{
+  GInputStream parent_instance;
+  Segment *segments;
+  guint n_segments;
+  guint n_indexed;
+  // Segment being read, n_segments past the end
+  guint current;
+  // Offset within the current segment
+  goffset offset;
+  goffset position;
+  Prefetch *prefetch;
+};
+
+static void concat_input_stream_seekable_iface_init (GSeekableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (
+    ConcatInputStream, concat_input_stream, G_TYPE_INPUT_STREAM,
+    G_IMPLEMENT_INTERFACE (G_TYPE_SEEKABLE,
+                           concat_input_stream_seekable_iface_init))
+
+static void
+update_index (ConcatInputStream *self)
+{
+  guint i = MAX (self->n_indexed, 1);
+  for (; i < self->n_segments; i++)
+    {
+      Segment *previous = &self->segments[i - 1];
+      if (previous->size < 0)
+        break;
+      self->segments[i].start = previous->start + previous->size;
+    }
+  self->n_indexed = MIN (i, self->n_segments);
+}
+
+static goffset
+total_size (ConcatInputStream *self)
+{
+  if (self->n_segments == 0)
+    return 0;
+
+  Segment *last = &self->segments[self->n_segments - 1];
+  if (self->n_indexed < self->n_segments || last->size < 0)
+    return -1;
+  return last->start + last->size;
+}
+
+/*
+ * Find the segment containing *target* by bisecting the index, n_segments if
+ * it lies past the end.
+ */
+static gboolean
+find_segment (ConcatInputStream *self, goffset target, guint *index,
+              GError **error)
+{
+  if (self->n_segments == 0)
+    {
+      *index = 0;
+      return TRUE;
+    }
+
+  // Last segment starting at or before target, skipping empty ones
+  guint lo = 0, hi = self->n_indexed;
+  while (hi - lo > 1)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      if (self->segments[mid].start <= target)
+        lo = mid;
+      else
+        hi = mid;
+    }
+
+  Segment *segment = &self->segments[lo];
+  if (segment->size < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Size of segment %u is unknown", lo);
+      return FALSE;
+    }
+
+  // Otherwise lo is the last segment, its successor would be indexed
+  *index = target < segment->start + segment->size ? lo : self->n_segments;
+  return TRUE;
+}
+
+static gboolean
+can_seek (GInputStream *stream)
+{
+  return G_IS_SEEKABLE (stream) && g_seekable_can_seek (G_SEEKABLE (stream));
+}
+
+static gboolean
+skip_to (GInputStream *stream, goffset offset, GCancellable *cancellable,
+         GError **error)
+{
+  while (offset > 0)
+    {
+      gssize n = g_input_stream_skip (stream, MIN (offset, G_MAXSSIZE),
+                                      cancellable, error);
+      if (n < 0)
+        return FALSE;
+      if (n == 0)
+        break;
+      offset -= n;
+    }
+  return TRUE;
+}
+
+static void
+prefetch_func (gpointer data, gpointer user_data)
+{
+  Prefetch *prefetch = data;
+
+  int saved = io_priority_apply (prefetch->ioprio);
+  GInputStream *stream = G_INPUT_STREAM (
+      g_file_read (prefetch->file, prefetch->cancellable, &prefetch->error));
+  io_priority_pop (saved);
+
+  g_mutex_lock (&prefetch->mutex);
+  prefetch->stream = stream;
+  prefetch->finished = TRUE;
+  g_cond_signal (&prefetch->done);
+  g_mutex_unlock (&prefetch->mutex);
+}
+
+static void
+start_prefetch (ConcatInputStream *self, guint index)
+{
+  if (index >= self->n_segments || !self->segments[index].file
+      || self->segments[index].stream)
+    return;
+
+  if (self->prefetch)
+    return;
+
+  Prefetch *prefetch = g_new0 (Prefetch, 1);
+  prefetch->file = g_object_ref (self->segments[index].file);
+  prefetch->index = index;
+  prefetch->cancellable = g_cancellable_new ();
+  prefetch->ioprio = io_priority_current ();
+  g_mutex_init (&prefetch->mutex);
+  g_cond_init (&prefetch->done);
+  self->prefetch = prefetch;
+  io_pool_push (io_pool_for_file (prefetch->file), prefetch_func, prefetch);
+}
+
+// Wait for the running prefetch and return its stream
+static GInputStream *
+finish_prefetch (ConcatInputStream *self, GError **error)
+{
+  Prefetch *prefetch = self->prefetch;
+  self->prefetch = NULL;
+
+  g_mutex_lock (&prefetch->mutex);
+  while (!prefetch->finished)
+    g_cond_wait (&prefetch->done, &prefetch->mutex);
+  g_mutex_unlock (&prefetch->mutex);
+
+  GInputStream *stream = prefetch->stream;
+  if (!stream)
+    g_propagate_error (error, prefetch->error);
+
+  g_object_unref (prefetch->file);
+  g_object_unref (prefetch->cancellable);
+  g_mutex_clear (&prefetch->mutex);
+  g_cond_clear (&prefetch->done);
+  g_free (prefetch);
+  return stream;
+}
+
+static void
+drop_prefetch (ConcatInputStream *self)
+{
+  if (!self->prefetch)
+    return;
+
+  g_cancellable_cancel (self->prefetch->cancellable);
+  GInputStream *stream = finish_prefetch (self, NULL);
+  if (stream)
+    g_object_unref (stream);
+}
+
+static gboolean
+open_segment (ConcatInputStream *self, GCancellable *cancellable,
+              GError **error)
+{
+  Segment *segment = &self->segments[self->current];
+  if (segment->stream)
+    return TRUE;
+
+  GInputStream *stream;
+  if (self->prefetch && self->prefetch->index == self->current)
+    stream = finish_prefetch (self, error);
+  else
+    {
+      // Seeked away from the file being prefetched
+      drop_prefetch (self);
+      stream = G_INPUT_STREAM (g_file_read (segment->file, cancellable, error));
+    }
+  if (!stream)
+    return FALSE;
+
+  gboolean positioned
+      = can_seek (stream)
+            ? g_seekable_seek (G_SEEKABLE (stream), self->offset, G_SEEK_SET,
+                               cancellable, error)
+            : skip_to (stream, self->offset, cancellable, error);
+  if (!positioned)
+    {
+      g_object_unref (stream);
+      return FALSE;
+    }
+
+  segment->stream = stream;
+  start_prefetch (self, self->current + 1);
+  return TRUE;
+}
+
+// Close the stream of a file segment, it is reopened when read again
+static void
+release_segment (ConcatInputStream *self, guint index)
+{
+  Segment *segment = &self->segments[index];
+
+  if (segment->file && segment->stream)
+    {
+      g_input_stream_close (segment->stream, NULL, NULL);
+      g_clear_object (&segment->stream);
+    }
+}
+
+static gssize
+concat_input_stream_read (GInputStream *stream, void *buffer, gsize count,
+                          GCancellable *cancellable, GError **error)
+{
+  ConcatInputStream *self = CONCAT_INPUT_STREAM (stream);
+
+  if (count == 0)
+    return 0;
+
+  while (self->current < self->n_segments)
+    {
+      Segment *segment = &self->segments[self->current];
+      if (!open_segment (self, cancellable, error))
+        return -1;
+
+      gsize want = count;
+      if (segment->size >= 0)
+        want = MIN (count, (guint64)(segment->size - self->offset));
+
+      gssize n = 0;
+      if (want > 0)
+        n = g_input_stream_read (segment->stream, buffer, want, cancellable,
+                                 error);
+      if (n < 0)
+        return -1;
+      if (n > 0)
+        {
+          self->offset += n;
+          self->position += n;
+          return n;
+        }
+
+      if (segment->size < 0)
+        {
+          segment->size = self->offset;
+          update_index (self);
+        }
+      else if (self->offset < segment->size)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                       "Segment %u ended before its size", self->current);
+          return -1;
+        }
+
+      release_segment (self, self->current);
+      self->current++;
+      self->offset = 0;
+    }
+
+  return 0;
+}
+
+static gboolean
+concat_input_stream_close (GInputStream *stream, GCancellable *cancellable,
+                           GError **error)
+{
+  ConcatInputStream *self = CONCAT_INPUT_STREAM (stream);
+  gboolean success = TRUE;
+
+  drop_prefetch (self);
+  for (guint i = 0; i < self->n_segments; i++)
+    {
+      Segment *segment = &self->segments[i];
+      if (segment->stream
+          && !g_input_stream_close (segment->stream, cancellable,
+                                    success ? error : NULL))
+        success = FALSE;
+      if (segment->file)
+        g_clear_object (&segment->stream);
+    }
+  return success;
+}
+
+static goffset
+concat_input_stream_tell (GSeekable *seekable)
+{
+  return CONCAT_INPUT_STREAM (seekable)->position;
+}
+
+static gboolean
+concat_input_stream_can_seek (GSeekable *seekable)
+{
+  return TRUE;
+}
+
+static gboolean
+concat_input_stream_seek (GSeekable *seekable, goffset offset, GSeekType type,
+                          GCancellable *cancellable, GError **error)
+{
+  ConcatInputStream *self = CONCAT_INPUT_STREAM (seekable);
+  goffset target;
+
+  switch (type)
+    {
+    case G_SEEK_SET:
+      target = offset;
+      break;
+    case G_SEEK_CUR:
+      target = self->position + offset;
+      break;
+    default:
+      {
+        goffset size = total_size (self);
+        if (size < 0)
+          {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                 "Size of the stream is unknown");
+            return FALSE;
+          }
+        target = size + offset;
+      }
+    }
+
+  if (target < 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                           "Invalid seek request");
+      return FALSE;
+    }
+
+  if (target == self->position)
+    return TRUE;
+
+  guint index;
+  if (!find_segment (self, target, &index, error))
+    return FALSE;
+
+  Segment *segment
+      = index < self->n_segments ? &self->segments[index] : NULL;
+  if (segment && !segment->file && !can_seek (segment->stream))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Segment %u is not seekable", index);
+      return FALSE;
+    }
+
+  if (index != self->current && self->current < self->n_segments)
+    release_segment (self, self->current);
+
+  self->current = index;
+  self->position = target;
+  self->offset = segment ? target - segment->start : 0;
+  if (!segment || !segment->stream)
+    // Positioned once opened
+    return TRUE;
+
+  if (can_seek (segment->stream))
+    return g_seekable_seek (G_SEEKABLE (segment->stream),
+                            segment->origin + self->offset, G_SEEK_SET,
+                            cancellable, error);
+
+  release_segment (self, index);
+  return TRUE;
+}
+
+static gboolean
+concat_input_stream_can_truncate (GSeekable *seekable)
+{
+  return FALSE;
+}
+
+static gboolean
+concat_input_stream_truncate (GSeekable *seekable, goffset offset,
+                              GCancellable *cancellable, GError **error)
+{
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Truncate not supported on stream");
+  return FALSE;
+}
+
+static void
+concat_input_stream_seekable_iface_init (GSeekableIface *iface)
+{
+  iface->tell = concat_input_stream_tell;
+  iface->can_seek = concat_input_stream_can_seek;
+  iface->seek = concat_input_stream_seek;
+  iface->can_truncate = concat_input_stream_can_truncate;
+  iface->truncate_fn = concat_input_stream_truncate;
+}
+
+static void
+concat_input_stream_finalize (GObject *object)
+{
+  ConcatInputStream *self = CONCAT_INPUT_STREAM (object);
+
+  drop_prefetch (self);
+  for (guint i = 0; i < self->n_segments; i++)
+    {
+      g_clear_object (&self->segments[i].stream);
+      g_clear_object (&self->segments[i].file);
+    }
+  g_free (self->segments);
+
+  G_OBJECT_CLASS (concat_input_stream_parent_class)->finalize (object);
+}
+
+static void
+concat_input_stream_class_init (ConcatInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = concat_input_stream_finalize;
+  stream_class->read_fn = concat_input_stream_read;
+  stream_class->close_fn = concat_input_stream_close;
+}
+
+static void
+concat_input_stream_init (ConcatInputStream *self)
+{
+}
+
+static gboolean
+setup_segment (Segment *segment, GObject *gobj, GCancellable *cancellable,
+               GError **error)
+{
+  segment->size = -1;
+
+  if (G_IS_FILE (gobj))
+    {
+      segment->file = g_object_ref (G_FILE (gobj));
+      GFileInfo *info = g_file_query_info (
+          segment->file, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+          G_FILE_QUERY_INFO_NONE, cancellable, error);
+      if (!info)
+        return FALSE;
+
+      if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE))
+        segment->size = g_file_info_get_size (info);
+      g_object_unref (info);
+      return TRUE;
+    }
+
+  segment->stream = g_object_ref (G_INPUT_STREAM (gobj));
+  if (!can_seek (segment->stream))
+    return TRUE;
+
+  // The segment is the rest of the stream from where it is now
+  GSeekable *seekable = G_SEEKABLE (segment->stream);
+  segment->origin = g_seekable_tell (seekable);
+  if (!g_seekable_seek (seekable, 0, G_SEEK_END, cancellable, error))
+    return FALSE;
+  segment->size = g_seekable_tell (seekable) - segment->origin;
+  return g_seekable_seek (seekable, segment->origin, G_SEEK_SET, cancellable,
+                          error);
+}
+
+/*
+ * Create a stream reading *segments* one after another, each either a GFile
+ * or a GInputStream. Blocks while the sizes of the segments are queried.
+ */
+GInputStream *
+concat_input_stream_new (GObject **segments, guint n_segments,
+                         GCancellable *cancellable, GError **error)
+{
+  ConcatInputStream *self = g_object_new (CONCAT_TYPE_INPUT_STREAM, NULL);
+
+  self->segments = g_new0 (Segment, n_segments);
+  self->n_segments = n_segments;
+  for (guint i = 0; i < n_segments; i++)
+    {
+      if (!setup_segment (&self->segments[i], segments[i], cancellable,
+                          error))
+        {
+          g_object_unref (self);
+          return NULL;
+        }
+    }
+
+  update_index (self);
+  return G_INPUT_STREAM (self);
+}
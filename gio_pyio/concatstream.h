@@ -0,0 +1,18 @@
+#ifndef CONCATSTREAM_H
+#define CONCATSTREAM_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define CONCAT_TYPE_INPUT_STREAM (concat_input_stream_get_type ())
+G_DECLARE_FINAL_TYPE (ConcatInputStream, concat_input_stream, CONCAT,
+                      INPUT_STREAM, GInputStream)
+
+GInputStream *concat_input_stream_new (GObject **segments, guint n_segments,
+                                       GCancellable *cancellable,
+                                       GError **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,86 @@
+#include "deadline.h"
+
+/*
+ * Armed deadlines are kept in a queue sorted by expiry. The watchdog thread
+ * sleeps until the first one expires and is woken whenever an earlier one is
+ * armed. Cancelling happens with the mutex held, so once disarmed a deadline
+ * can no longer cancel anything.
+ */
+static GMutex mutex;
+static GCond changed;
+static GQueue armed = G_QUEUE_INIT;
+static GThread *watchdog;
+
+static gint
+compare_expiry (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const Deadline *deadline_a = a, *deadline_b = b;
+
+  return deadline_a->expires < deadline_b->expires   ? -1
+         : deadline_a->expires > deadline_b->expires ? 1
+                                                     : 0;
+}
+
+static gpointer
+watchdog_thread (gpointer data)
+{
+  g_mutex_lock (&mutex);
+  for (;;)
+    {
+      Deadline *next = g_queue_peek_head (&armed);
+      if (!next)
+        g_cond_wait (&changed, &mutex);
+      else if (g_get_monotonic_time () < next->expires)
+        g_cond_wait_until (&changed, &mutex, next->expires);
+      else
+        {
+          g_queue_pop_head (&armed);
+          next->armed = FALSE;
+          next->fired = TRUE;
+          g_cancellable_cancel (next->cancellable);
+        }
+    }
+  return NULL;
+}
+
+void
+deadline_arm (Deadline *deadline, GCancellable *cancellable,
+              gint64 timeout_usec)
+{
+  g_mutex_lock (&mutex);
+  if (!watchdog)
+    watchdog = g_thread_new ("gio-pyio-deadline", watchdog_thread, NULL);
+
+  deadline->expires = g_get_monotonic_time () + timeout_usec;
+  deadline->cancellable = cancellable;
+  deadline->armed = TRUE;
+  deadline->fired = FALSE;
+  g_queue_insert_sorted (&armed, deadline, compare_expiry, NULL);
+  if (g_queue_peek_head (&armed) == deadline)
+    g_cond_signal (&changed);
+  g_mutex_unlock (&mutex);
+}
+
+void
+deadline_disarm (Deadline *deadline)
+{
+  g_mutex_lock (&mutex);
+  if (deadline->armed)
+    {
+      g_queue_remove (&armed, deadline);
+      deadline->armed = FALSE;
+    }
+  g_mutex_unlock (&mutex);
+}
+
+/*
+ * Whether the deadline cancelled its cancellable since it was last armed.
+ */
+gboolean
+deadline_fired (Deadline *deadline)
+{
+  g_mutex_lock (&mutex);
+  gboolean fired = deadline->fired;
+  g_mutex_unlock (&mutex);
+  return fired;
+}
@@ -0,0 +1,21 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <gio/gio.h>
+
+/* Cancels a GCancellable once a timeout expires, unless disarmed first. All
+ * deadlines are watched by one shared thread. */
+typedef struct
+{
+  gint64 expires;
+  GCancellable *cancellable;
+  gboolean armed;
+  gboolean fired;
+} Deadline;
+
+void deadline_arm (Deadline *deadline, GCancellable *cancellable,
+                   gint64 timeout_usec);
+void deadline_disarm (Deadline *deadline);
+gboolean deadline_fired (Deadline *deadline);
+
+#endif
@@ -0,0 +1,164 @@
+#include "fdio.h"
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef IOV_MAX
+#define FD_IOV_MAX IOV_MAX
+#else
+#define FD_IOV_MAX 1024
+#endif
+
+static void
+set_errno_error (GError **error, int errsv, const char *what)
+{
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+               "Error %s file: %s", what, g_strerror (errsv));
+}
+
+gboolean
+fd_is_regular (int fd)
+{
+  struct stat st;
+
+  return fd >= 0 && fstat (fd, &st) == 0 && S_ISREG (st.st_mode);
+}
+
+// Whether a call interrupted by a signal is to be restarted
+static gboolean
+interrupted (GCancellable *cancellable)
+{
+  return errno == EINTR && !g_cancellable_is_cancelled (cancellable);
+}
+
+static void
+read_failed (GCancellable *cancellable, GError **error)
+{
+  if (errno == EINTR)
+    g_cancellable_set_error_if_cancelled (cancellable, error);
+  else
+    set_errno_error (error, errno, "reading from");
+}
+
+gssize
+fd_read (int fd, void *buffer, gsize count, GCancellable *cancellable,
+         GError **error)
+{
+  gssize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  do
+    n = read (fd, buffer, MIN (count, G_MAXSSIZE));
+  while (n < 0 && interrupted (cancellable));
+
+  if (n < 0)
+    read_failed (cancellable, error);
+  return n;
+}
+
+gssize
+fd_pread (int fd, void *buffer, gsize count, goffset offset,
+          GCancellable *cancellable, GError **error)
+{
+  gssize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  do
+    n = pread (fd, buffer, MIN (count, G_MAXSSIZE), offset);
+  while (n < 0 && interrupted (cancellable));
+
+  if (n < 0)
+    read_failed (cancellable, error);
+  return n;
+}
+
+gssize
+fd_readv (int fd, const struct iovec *iov, int n_iov,
+          GCancellable *cancellable, GError **error)
+{
+  gssize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  do
+    n = readv (fd, iov, MIN (n_iov, FD_IOV_MAX));
+  while (n < 0 && interrupted (cancellable));
+
+  if (n < 0)
+    read_failed (cancellable, error);
+  return n;
+}
+
+gssize
+fd_preadv (int fd, const struct iovec *iov, int n_iov, goffset offset,
+           GCancellable *cancellable, GError **error)
+{
+  gssize n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  do
+    n = preadv (fd, iov, MIN (n_iov, FD_IOV_MAX), offset);
+  while (n < 0 && interrupted (cancellable));
+
+  if (n < 0)
+    read_failed (cancellable, error);
+  return n;
+}
+
+gboolean
+fd_write_all (int fd, const void *buffer, gsize count, gsize *written,
+              GCancellable *cancellable, GError **error)
+{
+  *written = 0;
+  while (*written < count)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      gssize n = write (fd, (const char *)buffer + *written,
+                        MIN (count - *written, G_MAXSSIZE));
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          set_errno_error (error, errno, "writing to");
+          return FALSE;
+        }
+      *written += n;
+    }
+  return TRUE;
+}
+
+/*
+ * Move *fd* and return the new position, or -1 on failure.
+ */
+goffset
+fd_seek (int fd, goffset offset, GSeekType type, GError **error)
+{
+  int whence;
+
+  switch (type)
+    {
+    case G_SEEK_CUR:
+      whence = SEEK_CUR;
+      break;
+    case G_SEEK_END:
+      whence = SEEK_END;
+      break;
+    default:
+      whence = SEEK_SET;
+    }
+
+  off_t position = lseek (fd, offset, whence);
+  if (position < 0)
+    set_errno_error (error, errno, "seeking in");
+  return position;
+}
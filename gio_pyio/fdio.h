@@ -0,0 +1,29 @@
+#ifndef FDIO_H
+#define FDIO_H
+
+#include <gio/gio.h>
+#include <sys/uio.h>
+
+G_BEGIN_DECLS
+
+/* System calls on a file descriptor, reporting errors the way GIO's local
+ * file streams do. Only for regular files, which never block indefinitely,
+ * so *cancellable* is only checked up front. Vectored reads may fill fewer
+ * than *n_iov* buffers, like any other read. */
+gboolean fd_is_regular (int fd);
+gssize fd_read (int fd, void *buffer, gsize count, GCancellable *cancellable,
+                GError **error);
+gssize fd_pread (int fd, void *buffer, gsize count, goffset offset,
+                 GCancellable *cancellable, GError **error);
+gssize fd_readv (int fd, const struct iovec *iov, int n_iov,
+                 GCancellable *cancellable, GError **error);
+gssize fd_preadv (int fd, const struct iovec *iov, int n_iov, goffset offset,
+                  GCancellable *cancellable, GError **error);
+gboolean fd_write_all (int fd, const void *buffer, gsize count,
+                       gsize *written, GCancellable *cancellable,
+                       GError **error);
+goffset fd_seek (int fd, goffset offset, GSeekType type, GError **error);
+
+G_END_DECLS
+
+#endif
@@ -1,62 +1,191 @@
 #define PY_SSIZE_T_CLEAN
+#include "backendgate.h"
+#include "bytesview.h"
 #include "gio_pyio.h"
+#include "iopool.h"
+#include "limiter.h"
+#include "scheduler.h"
+#include "memtrack.h"
 #include "streamwrapper.h"
 #include <Python.h>
+#include <glib.h>
 
-PyObject *UnsupportedOperation = NULL;
-PyObject *PyGObjectClass = NULL;
+/*
+ * Return the state of the module that created *type*, or the nearest base of
+ * it that the module created, as classes subclassing ours in Python have no
+ * module. Wrappers look it up through their type, so every interpreter uses
+ * its own classes.
+ */
+ModuleState *
+get_module_state (PyTypeObject *type)
+{
+  for (PyTypeObject *base = type; base; base = base->tp_base)
+    {
+      PyObject *module = PyType_GetModule (base);
+      if (module)
+        return PyModule_GetState (module);
+      if (!base->tp_base)
+        return NULL;
+      PyErr_Clear ();
+    }
+  return NULL;
+}
 
-static struct PyModuleDef _gio_pyio_module
-    = { PyModuleDef_HEAD_INIT,
-        "_gio_pyio",
-        "Module wrapping GIO streams as Python file objects",
-        -1,
-        NULL,
-        NULL,
-        NULL,
-        NULL,
-        NULL };
+/*
+ * Importing gi.repository.GObject loads typelibs and initialises PyGObject,
+ * which is too expensive to do for every import of gio_pyio. Look the class
+ * up when the first StreamWrapper is constructed instead.
+ */
+PyObject *
+get_gobject_class (ModuleState *state)
+{
+  PyObject *cached = g_atomic_pointer_get (&state->gobject_class);
+  if (cached)
+    return cached;
 
-PyMODINIT_FUNC
-PyInit__gio_pyio (void)
+  PyObject *gi_module = PyImport_ImportModule ("gi.repository.GObject");
+  if (!gi_module)
+    return NULL;
+
+  PyObject *gobject_class = PyObject_GetAttrString (gi_module, "GObject");
+  Py_DECREF (gi_module);
+  if (!gobject_class)
+    return NULL;
+
+  // Another thread may have got here first, free-threaded builds have no GIL
+  // serialising this
+  if (!g_atomic_pointer_compare_and_exchange (&state->gobject_class, NULL,
+                                              gobject_class))
+    Py_DECREF (gobject_class);
+  return g_atomic_pointer_get (&state->gobject_class);
+}
+
+static int
+_gio_pyio_exec (PyObject *m)
 {
-  PyObject *m;
+  ModuleState *state = PyModule_GetState (m);
 
   PyObject *io_module = PyImport_ImportModule ("io");
   if (!io_module)
-    return NULL;
+    return -1;
 
-  UnsupportedOperation
+  state->unsupported_operation
       = PyObject_GetAttrString (io_module, "UnsupportedOperation");
   Py_DECREF (io_module);
-  if (!UnsupportedOperation)
-    return NULL;
-  Py_INCREF (UnsupportedOperation);
+  if (!state->unsupported_operation)
+    return -1;
 
-  PyObject *gi_module = PyImport_ImportModule ("gi.repository.GObject");
-  if (!gi_module)
-    return NULL;
+  state->streamwrapper_type = PyStreamWrapperType_Create (m);
+  if (!state->streamwrapper_type)
+    return -1;
 
-  PyGObjectClass = PyObject_GetAttrString (gi_module, "GObject");
-  Py_DECREF (gi_module);
-  if (!PyGObjectClass)
-    return NULL;
-  Py_INCREF (PyGObjectClass);
+  if (PyModule_AddType (m, (PyTypeObject *)state->streamwrapper_type) < 0)
+    return -1;
 
-  m = PyModule_Create (&_gio_pyio_module);
-  if (m == NULL)
-    return NULL;
+  state->spooledstreamwrapper_type
+      = PySpooledStreamWrapperType_Create (m, state->streamwrapper_type);
+  if (!state->spooledstreamwrapper_type)
+    return -1;
 
-  PyObject *streamwrapper_type = PyStreamWrapperType_Create ();
-  if (!streamwrapper_type)
-    return NULL;
+  if (PyModule_AddType (m,
+                        (PyTypeObject *)state->spooledstreamwrapper_type)
+      < 0)
+    return -1;
 
-  if (PyModule_AddObject (m, "StreamWrapper", streamwrapper_type) < 0)
-    {
-      Py_DECREF (streamwrapper_type);
-      Py_DECREF (m);
-      return NULL;
-    }
+  state->bytesview_type = PyBytesViewType_Create (m);
+  if (!state->bytesview_type)
+    return -1;
+
+  state->limiter_type = PyLimiterType_Create (m);
+  if (!state->limiter_type)
+    return -1;
+
+  if (PyModule_AddType (m, (PyTypeObject *)state->limiter_type) < 0)
+    return -1;
+
+  state->scheduler_type = PySchedulerType_Create (m);
+  if (!state->scheduler_type)
+    return -1;
+
+  if (PyModule_AddType (m, (PyTypeObject *)state->scheduler_type) < 0)
+    return -1;
+
+  if (PyBackendGate_AddFunctions (m) < 0)
+    return -1;
+
+  if (PyIOPool_AddFunctions (m) < 0)
+    return -1;
+
+  if (PyModule_AddIntConstant (m, "TRACEMALLOC_DOMAIN",
+                               GIO_PYIO_TRACEMALLOC_DOMAIN)
+      < 0)
+    return -1;
+
+  return 0;
+}
+
+static int
+_gio_pyio_traverse (PyObject *m, visitproc visit, void *arg)
+{
+  ModuleState *state = PyModule_GetState (m);
+
+  Py_VISIT (state->unsupported_operation);
+  Py_VISIT (state->gobject_class);
+  Py_VISIT (state->streamwrapper_type);
+  Py_VISIT (state->spooledstreamwrapper_type);
+  Py_VISIT (state->bytesview_type);
+  Py_VISIT (state->limiter_type);
+  Py_VISIT (state->scheduler_type);
+  return 0;
+}
+
+static int
+_gio_pyio_clear (PyObject *m)
+{
+  ModuleState *state = PyModule_GetState (m);
+
+  Py_CLEAR (state->unsupported_operation);
+  Py_CLEAR (state->gobject_class);
+  Py_CLEAR (state->streamwrapper_type);
+  Py_CLEAR (state->spooledstreamwrapper_type);
+  Py_CLEAR (state->bytesview_type);
+  Py_CLEAR (state->limiter_type);
+  Py_CLEAR (state->scheduler_type);
+  return 0;
+}
+
+static void
+_gio_pyio_free (void *m)
+{
+  _gio_pyio_clear ((PyObject *)m);
+}
+
+static PyModuleDef_Slot _gio_pyio_slots[] = {
+  { Py_mod_exec, _gio_pyio_exec },
+#if PY_VERSION_HEX >= 0x030C0000
+  // No global state is left, each interpreter gets its own module and types
+  { Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+#ifdef Py_GIL_DISABLED
+  // Wrappers serialise access through their own locks
+  { Py_mod_gil, Py_MOD_GIL_NOT_USED },
+#endif
+  { 0, NULL }
+};
+
+static struct PyModuleDef _gio_pyio_module
+    = { PyModuleDef_HEAD_INIT,
+        "_gio_pyio",
+        "Module wrapping GIO streams as Python file objects",
+        sizeof (ModuleState),
+        NULL,
+        _gio_pyio_slots,
+        _gio_pyio_traverse,
+        _gio_pyio_clear,
+        _gio_pyio_free };
 
-  return m;
+PyMODINIT_FUNC
+PyInit__gio_pyio (void)
+{
+  return PyModuleDef_Init (&_gio_pyio_module);
 }
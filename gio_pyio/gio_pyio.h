@@ -3,7 +3,21 @@
 
 #include <Python.h>
 
-extern PyObject *UnsupportedOperation;
-extern PyObject *PyGObjectClass;
+// Per-interpreter state of the _gio_pyio module
+typedef struct
+{
+  PyObject *unsupported_operation;
+  // Looked up on first use, see get_gobject_class()
+  PyObject *gobject_class;
+  PyObject *streamwrapper_type;
+  PyObject *spooledstreamwrapper_type;
+  // Not exposed, see bytes_view_new()
+  PyObject *bytesview_type;
+  PyObject *limiter_type;
+  PyObject *scheduler_type;
+} ModuleState;
+
+ModuleState *get_module_state (PyTypeObject *type);
+PyObject *get_gobject_class (ModuleState *state);
 
 #endif
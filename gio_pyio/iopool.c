@@ -0,0 +1,408 @@
+#define PY_SSIZE_T_CLEAN
+#include "iopool.h"
+#include "backendgate.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/*
+ * Workers are started on demand up to the size of the pool and exit when
+ * the pool shrinks below their number. Each is named after its pool and
+ * pinned to the pool's CPUs, which it checks for changes before every job.
+ * Jobs never wait for other jobs, work that would is run inline by callers
+ * that are workers themselves, see io_pool_in_worker(), so a full pool can
+ * only delay work, not deadlock.
+ */
+struct _IOPool
+{
+  GMutex mutex;
+  GCond changed;
+  char *name;
+  guint max_threads;
+  guint threads;
+  guint idle;
+  guint active;
+  GQueue jobs;
+#ifdef __linux__
+  // No affinity if empty
+  cpu_set_t cpus;
+  gboolean pinned;
+#endif
+  // Bumped whenever the CPUs change
+  guint generation;
+  // Statistics, see io_pool_stats()
+  guint64 completed;
+  gint64 queue_time;
+};
+
+typedef struct
+{
+  GFunc func;
+  gpointer data;
+  gint64 queued;
+} Job;
+
+#define DEFAULT_MAX_THREADS 8
+
+static GMutex pools_mutex;
+static IOPool *default_pool;
+// Backend keys to pools, see backend_key_for_uri()
+static GHashTable *pools;
+static GPrivate current_pool;
+
+static IOPool *
+pool_new (const char *name, guint max_threads)
+{
+  IOPool *pool = g_new0 (IOPool, 1);
+  g_mutex_init (&pool->mutex);
+  g_cond_init (&pool->changed);
+  g_queue_init (&pool->jobs);
+  pool->name = g_strdup (name);
+  pool->max_threads = max_threads;
+  return pool;
+}
+
+IOPool *
+io_pool_default (void)
+{
+  g_mutex_lock (&pools_mutex);
+  if (!default_pool)
+    default_pool = pool_new ("gio-pyio-io", DEFAULT_MAX_THREADS);
+  IOPool *pool = default_pool;
+  g_mutex_unlock (&pools_mutex);
+  return pool;
+}
+
+/*
+ * Return the pool of the backend *file* is on, the default pool unless one
+ * was set up for it.
+ */
+IOPool *
+io_pool_for_file (GFile *file)
+{
+  char *uri = g_file_get_uri (file);
+  char *key = backend_key_for_uri (uri);
+  g_free (uri);
+
+  IOPool *pool = NULL;
+  g_mutex_lock (&pools_mutex);
+  if (key && pools)
+    pool = g_hash_table_lookup (pools, key);
+  g_mutex_unlock (&pools_mutex);
+  g_free (key);
+  return pool ? pool : io_pool_default ();
+}
+
+/*
+ * Whether the calling thread is a worker of any pool.
+ */
+gboolean
+io_pool_in_worker (void)
+{
+  return g_private_get (&current_pool) != NULL;
+}
+
+#ifdef __linux__
+// Called with the mutex held
+static void
+apply_affinity (IOPool *pool, const cpu_set_t *initial)
+{
+  sched_setaffinity (0, sizeof (cpu_set_t),
+                     pool->pinned ? &pool->cpus : initial);
+}
+#endif
+
+static gpointer
+worker_thread (gpointer data)
+{
+  IOPool *pool = data;
+  guint generation = 0;
+#ifdef __linux__
+  cpu_set_t initial;
+  sched_getaffinity (0, sizeof (cpu_set_t), &initial);
+#endif
+
+  g_private_set (&current_pool, pool);
+  g_mutex_lock (&pool->mutex);
+  for (;;)
+    {
+      while (g_queue_is_empty (&pool->jobs)
+             && pool->threads <= pool->max_threads)
+        {
+          pool->idle++;
+          g_cond_wait (&pool->changed, &pool->mutex);
+          pool->idle--;
+        }
+      if (pool->threads > pool->max_threads)
+        break;
+
+      Job *job = g_queue_pop_head (&pool->jobs);
+      pool->active++;
+      pool->queue_time += g_get_monotonic_time () - job->queued;
+      if (generation != pool->generation)
+        {
+#ifdef __linux__
+          apply_affinity (pool, &initial);
+#endif
+          generation = pool->generation;
+        }
+      g_mutex_unlock (&pool->mutex);
+
+      job->func (job->data, NULL);
+      g_free (job);
+
+      g_mutex_lock (&pool->mutex);
+      pool->active--;
+      pool->completed++;
+    }
+  pool->threads--;
+  g_mutex_unlock (&pool->mutex);
+  return NULL;
+}
+
+/*
+ * Run *func* with *data* on a worker of *pool*. Runs it right away in the
+ * calling thread if no worker can be started at all.
+ */
+void
+io_pool_push (IOPool *pool, GFunc func, gpointer data)
+{
+  Job *job = g_new (Job, 1);
+  job->func = func;
+  job->data = data;
+  job->queued = g_get_monotonic_time ();
+
+  g_mutex_lock (&pool->mutex);
+  g_queue_push_tail (&pool->jobs, job);
+  if (pool->idle < g_queue_get_length (&pool->jobs)
+      && pool->threads < pool->max_threads)
+    {
+      GThread *thread
+          = g_thread_try_new (pool->name, worker_thread, pool, NULL);
+      if (thread)
+        {
+          pool->threads++;
+          g_thread_unref (thread);
+        }
+    }
+  g_cond_signal (&pool->changed);
+
+  gboolean stranded = pool->threads == 0;
+  if (stranded)
+    g_queue_remove (&pool->jobs, job);
+  g_mutex_unlock (&pool->mutex);
+
+  if (stranded)
+    {
+      func (data, NULL);
+      g_free (job);
+    }
+}
+
+PyDoc_STRVAR (
+    set_io_pool_doc,
+    "Configure the worker threads gio_pyio does background I/O on.\n"
+    "\n"
+    "Opening the next file of :func:`concat` ahead of time and writing to\n"
+    "the destinations of :func:`tee` in parallel run on these threads.\n"
+    "Work for a backend with a pool of its own runs there, so a slow\n"
+    "remote backend can't hold up work for local disks, everything else\n"
+    "runs on the default pool of 8 threads. Threads are named after their\n"
+    "pool and started as needed.\n"
+    "\n"
+    ":param str backend:\n"
+    "   Any URI on the backend, such as ``'sftp://example.com/'``, or\n"
+    "   ``None`` for the default pool.\n"
+    ":param int threads:\n"
+    "   Largest number of threads in the pool.\n"
+    ":param cpus:\n"
+    "   CPUs to run the threads on, ``None`` for all. Linux only.\n"
+    ":type cpus: iterable of int\n"
+    ":raises ValueError:\n"
+    "   Invalid backend, size or CPU.");
+static PyObject *
+set_io_pool_impl (PyObject *module, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = { "backend", "threads", "cpus", NULL };
+  const char *uri;
+  unsigned int threads;
+  PyObject *py_cpus = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "zI|O", kwlist, &uri,
+                                    &threads, &py_cpus))
+    return NULL;
+
+  if (threads == 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "a pool needs threads");
+      return NULL;
+    }
+
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO (&cpus);
+#endif
+  gboolean pinned = py_cpus != Py_None;
+  if (pinned)
+    {
+      PyObject *seq = PySequence_Fast (py_cpus, "cpus must be iterable");
+      if (!seq)
+        return NULL;
+      for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE (seq); i++)
+        {
+          long cpu = PyLong_AsLong (PySequence_Fast_GET_ITEM (seq, i));
+          if (cpu == -1 && PyErr_Occurred ())
+            {
+              Py_DECREF (seq);
+              return NULL;
+            }
+#ifdef __linux__
+          if (cpu < 0 || cpu >= CPU_SETSIZE)
+            {
+              Py_DECREF (seq);
+              PyErr_Format (PyExc_ValueError, "invalid CPU %ld", cpu);
+              return NULL;
+            }
+          CPU_SET (cpu, &cpus);
+#endif
+        }
+      Py_DECREF (seq);
+    }
+
+  IOPool *pool;
+  if (!uri)
+    pool = io_pool_default ();
+  else
+    {
+      char *key = backend_key_for_uri (uri);
+      if (!key)
+        {
+          PyErr_Format (PyExc_ValueError, "not a URI: %s", uri);
+          return NULL;
+        }
+
+      g_mutex_lock (&pools_mutex);
+      if (!pools)
+        pools = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      pool = g_hash_table_lookup (pools, key);
+      if (!pool)
+        {
+          // Linux cuts thread names to 15 characters
+          char *scheme = g_uri_parse_scheme (uri);
+          char *name = g_strdup_printf ("gio-pyio-%s", scheme);
+          pool = pool_new (name, threads);
+          g_free (name);
+          g_free (scheme);
+          g_hash_table_insert (pools, key, pool);
+        }
+      else
+        g_free (key);
+      g_mutex_unlock (&pools_mutex);
+    }
+
+  g_mutex_lock (&pool->mutex);
+  pool->max_threads = threads;
+#ifdef __linux__
+  pool->cpus = cpus;
+  pool->pinned = pinned;
+#endif
+  pool->generation++;
+  // Surplus workers exit
+  g_cond_broadcast (&pool->changed);
+  g_mutex_unlock (&pool->mutex);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+pool_stats (IOPool *pool)
+{
+  g_mutex_lock (&pool->mutex);
+  unsigned int max_threads = pool->max_threads;
+  unsigned int threads = pool->threads;
+  unsigned int active = pool->active;
+  unsigned int queued = g_queue_get_length (&pool->jobs);
+  unsigned long long completed = pool->completed;
+  gint64 queue_time = pool->queue_time;
+  g_mutex_unlock (&pool->mutex);
+
+  return Py_BuildValue ("{s:I,s:I,s:I,s:I,s:K,s:d}", "max_threads",
+                        max_threads, "threads", threads, "active", active,
+                        "queued", queued, "completed", completed,
+                        "queue_time", (double)queue_time / G_USEC_PER_SEC);
+}
+
+PyDoc_STRVAR (io_pool_stats_doc,
+              "Report the state of the background I/O pools.\n"
+              "\n"
+              ":rtype: dict\n"
+              ":returns:\n"
+              "   A mapping of backends, ``None`` for the default pool, to\n"
+              "   mappings of ``max_threads``, ``threads`` (running),\n"
+              "   ``active`` (busy with a job), ``queued`` (jobs waiting\n"
+              "   for a thread), ``completed`` (jobs done) and\n"
+              "   ``queue_time`` (seconds jobs spent waiting in total).");
+static PyObject *
+io_pool_stats_impl (PyObject *module, PyObject *Py_UNUSED (ignored))
+{
+  PyObject *result = PyDict_New ();
+  if (!result)
+    return NULL;
+
+  PyObject *stats = pool_stats (io_pool_default ());
+  if (!stats || PyDict_SetItem (result, Py_None, stats) < 0)
+    goto error;
+  Py_DECREF (stats);
+
+  // Pools and their keys are never freed, a snapshot of the table stays
+  // valid after unlocking
+  GPtrArray *snapshot = g_ptr_array_new ();
+  g_mutex_lock (&pools_mutex);
+  if (pools)
+    {
+      GHashTableIter iter;
+      gpointer key, value;
+      g_hash_table_iter_init (&iter, pools);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          g_ptr_array_add (snapshot, key);
+          g_ptr_array_add (snapshot, value);
+        }
+    }
+  g_mutex_unlock (&pools_mutex);
+
+  for (guint i = 0; i < snapshot->len; i += 2)
+    {
+      stats = pool_stats (g_ptr_array_index (snapshot, i + 1));
+      if (!stats
+          || PyDict_SetItemString (result, g_ptr_array_index (snapshot, i),
+                                   stats)
+                 < 0)
+        {
+          g_ptr_array_unref (snapshot);
+          goto error;
+        }
+      Py_DECREF (stats);
+    }
+  g_ptr_array_unref (snapshot);
+  return result;
+
+error:
+  Py_XDECREF (stats);
+  Py_DECREF (result);
+  return NULL;
+}
+
+static PyMethodDef IOPool_functions[]
+    = { { "set_io_pool", (PyCFunction)set_io_pool_impl,
+          METH_VARARGS | METH_KEYWORDS, set_io_pool_doc },
+        { "io_pool_stats", (PyCFunction)io_pool_stats_impl, METH_NOARGS,
+          io_pool_stats_doc },
+        { NULL } };
+
+int
+PyIOPool_AddFunctions (PyObject *module)
+{
+  return PyModule_AddFunctions (module, IOPool_functions);
+}
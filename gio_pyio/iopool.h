@@ -0,0 +1,18 @@
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <Python.h>
+#include <gio/gio.h>
+
+/* Worker threads for background I/O, one pool per configured backend and a
+ * default pool for the rest. Pools live as long as the process. */
+typedef struct _IOPool IOPool;
+
+IOPool *io_pool_default (void);
+IOPool *io_pool_for_file (GFile *file);
+void io_pool_push (IOPool *pool, GFunc func, gpointer data);
+gboolean io_pool_in_worker (void);
+
+int PyIOPool_AddFunctions (PyObject *module);
+
+#endif
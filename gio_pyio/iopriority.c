@@ -0,0 +1,96 @@
+#include "iopriority.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// From linux/ioprio.h, which not every system has installed
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(class, data)                                        \
+  (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+/*
+ * Map a GLib priority to an ioprio value. G_PRIORITY_HIGH and above get the
+ * highest best-effort level and G_PRIORITY_DEFAULT the kernel's default of
+ * 4, with the levels in between and down to G_PRIORITY_DEFAULT_IDLE spread
+ * linearly. Anything lower only gets the disk when it is otherwise idle.
+ * The real-time class is left out, it needs CAP_SYS_ADMIN.
+ */
+static int
+to_ioprio (int priority)
+{
+  int level;
+
+  if (priority >= G_PRIORITY_DEFAULT_IDLE)
+    return IOPRIO_PRIO_VALUE (IOPRIO_CLASS_IDLE, 0);
+
+  if (priority <= G_PRIORITY_HIGH)
+    level = 0;
+  else if (priority <= G_PRIORITY_DEFAULT)
+    level = 4 * (priority - G_PRIORITY_HIGH)
+            / (G_PRIORITY_DEFAULT - G_PRIORITY_HIGH);
+  else
+    level = 5 + 3 * (priority - 1) / G_PRIORITY_DEFAULT_IDLE;
+  return IOPRIO_PRIO_VALUE (IOPRIO_CLASS_BE, level);
+}
+#endif
+
+/*
+ * Apply *priority* to the calling thread. Returns the previous ioprio to
+ * pass to io_priority_pop(), or -1 if nothing was changed.
+ */
+int
+io_priority_push (int priority)
+{
+#ifdef __linux__
+  // Thread-level when given the calling thread as 0
+  int saved = syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+  if (saved >= 0
+      && syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, to_ioprio (priority))
+             == 0)
+    return saved;
+#endif
+  return -1;
+}
+
+void
+io_priority_pop (int saved)
+{
+#ifdef __linux__
+  if (saved >= 0)
+    syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, saved);
+#endif
+}
+
+/*
+ * The ioprio of the calling thread, or -1 if unknown.
+ */
+int
+io_priority_current (void)
+{
+#ifdef __linux__
+  return syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+#else
+  return -1;
+#endif
+}
+
+/*
+ * Apply *ioprio*, as returned by io_priority_current() on another thread, to
+ * the calling thread. Returns the value to pass to io_priority_pop(), -1 if
+ * nothing was changed.
+ */
+int
+io_priority_apply (int ioprio)
+{
+#ifdef __linux__
+  int saved = syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+  if (ioprio >= 0 && saved >= 0 && saved != ioprio
+      && syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == 0)
+    return saved;
+#endif
+  return -1;
+}
@@ -0,0 +1,16 @@
+#ifndef IOPRIORITY_H
+#define IOPRIORITY_H
+
+#include <glib.h>
+
+/* Class the block I/O of the calling thread by a GLib priority until undone
+ * with the returned value. Does nothing where the kernel can't do that. */
+int io_priority_push (int priority);
+void io_priority_pop (int saved);
+
+/* Carry the ioprio of the calling thread over to work it hands to another
+ * thread, for example an I/O pool worker. */
+int io_priority_current (void);
+int io_priority_apply (int ioprio);
+
+#endif
@@ -0,0 +1,405 @@
+#define PY_SSIZE_T_CLEAN
+#include "limiter.h"
+
+/*
+ * Token buckets for bytes and operations, shared by any number of wrappers
+ * and threads. An operation waits until the bytes are out of debt and an
+ * operation token is available, takes the latter and pays for its bytes once
+ * it knows how many it transferred. Transfers are split so none costs more
+ * than a full bucket, which keeps the debt and with it the wait of the next
+ * operation bounded by the burst.
+ */
+typedef struct
+{
+  PyObject_HEAD GMutex mutex;
+  // Refill rates per second, 0 for unlimited
+  double byte_rate;
+  double op_rate;
+  // Seconds worth of tokens a bucket holds when full
+  double burst;
+  // Tokens available, bytes go negative for transfers not yet paid off
+  double bytes;
+  double ops;
+  gint64 refilled;
+  // Statistics, see stats()
+  guint64 total_bytes;
+  guint64 total_ops;
+  guint64 waits;
+  gint64 wait_time;
+} Limiter;
+
+static double
+byte_capacity (Limiter *self)
+{
+  return MAX (self->byte_rate * self->burst, 1);
+}
+
+static double
+op_capacity (Limiter *self)
+{
+  return MAX (self->op_rate * self->burst, 1);
+}
+
+// Called with the mutex held
+static void
+refill (Limiter *self)
+{
+  gint64 now = g_get_monotonic_time ();
+  double elapsed = (double)(now - self->refilled) / G_USEC_PER_SEC;
+  self->refilled = now;
+
+  self->bytes
+      = MIN (self->bytes + elapsed * self->byte_rate, byte_capacity (self));
+  self->ops = MIN (self->ops + elapsed * self->op_rate, op_capacity (self));
+}
+
+/*
+ * Wait until *limiter* admits another operation, without the GIL. Fails if
+ * *cancellable* is cancelled while waiting.
+ */
+gboolean
+limiter_acquire (PyObject *limiter, GCancellable *cancellable, GError **error)
+{
+  Limiter *self = (Limiter *)limiter;
+  gint64 waited_since = 0;
+
+  for (;;)
+    {
+      g_mutex_lock (&self->mutex);
+      refill (self);
+      double delay = 0;
+      if (self->byte_rate > 0 && self->bytes < 0)
+        delay = -self->bytes / self->byte_rate;
+      if (self->op_rate > 0 && self->ops < 1)
+        delay = MAX (delay, (1 - self->ops) / self->op_rate);
+      if (delay == 0)
+        {
+          if (self->op_rate > 0)
+            self->ops -= 1;
+          self->total_ops++;
+          if (waited_since)
+            self->wait_time += g_get_monotonic_time () - waited_since;
+          g_mutex_unlock (&self->mutex);
+          return TRUE;
+        }
+      if (!waited_since)
+        {
+          self->waits++;
+          waited_since = g_get_monotonic_time ();
+        }
+      g_mutex_unlock (&self->mutex);
+
+      // Round up, waking early would only spin
+      gint timeout_ms = (gint)MIN (delay * 1000 + 1, G_MAXINT);
+      GPollFD pollfd;
+      if (g_cancellable_make_pollfd (cancellable, &pollfd))
+        {
+          g_poll (&pollfd, 1, timeout_ms);
+          g_cancellable_release_fd (cancellable);
+        }
+      else
+        g_usleep ((gulong)timeout_ms * 1000);
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          g_mutex_lock (&self->mutex);
+          self->wait_time += g_get_monotonic_time () - waited_since;
+          g_mutex_unlock (&self->mutex);
+          return FALSE;
+        }
+    }
+}
+
+/*
+ * Charge *bytes* transferred by an operation admitted by limiter_acquire().
+ */
+void
+limiter_consume (PyObject *limiter, gsize bytes)
+{
+  Limiter *self = (Limiter *)limiter;
+
+  g_mutex_lock (&self->mutex);
+  refill (self);
+  if (self->byte_rate > 0)
+    self->bytes -= (double)bytes;
+  self->total_bytes += bytes;
+  g_mutex_unlock (&self->mutex);
+}
+
+/*
+ * Largest transfer a single operation should make, the size of the full
+ * byte bucket.
+ */
+gsize
+limiter_max_chunk (PyObject *limiter)
+{
+  Limiter *self = (Limiter *)limiter;
+
+  g_mutex_lock (&self->mutex);
+  gsize max_chunk = self->byte_rate > 0 ? (gsize)MIN (byte_capacity (self),
+                                                      (double)G_MAXSSIZE)
+                                        : G_MAXSIZE;
+  g_mutex_unlock (&self->mutex);
+  return max_chunk;
+}
+
+/*
+ * Parse a rate given to Python, None meaning unlimited, into *rate*.
+ */
+static int
+parse_rate (PyObject *value, const char *name, double *rate)
+{
+  if (!value || value == Py_None)
+    {
+      *rate = 0;
+      return 0;
+    }
+
+  double parsed = PyFloat_AsDouble (value);
+  if (parsed == -1.0 && PyErr_Occurred ())
+    return -1;
+  if (!(parsed > 0) || parsed == HUGE_VAL)
+    {
+      PyErr_Format (PyExc_ValueError, "invalid %s", name);
+      return -1;
+    }
+
+  *rate = parsed;
+  return 0;
+}
+
+static PyObject *
+format_rate (double rate)
+{
+  if (rate == 0)
+    Py_RETURN_NONE;
+  return PyFloat_FromDouble (rate);
+}
+
+/*
+ * Change one of the rates or the burst, keeping the tokens earned so far.
+ * A bucket that was unlimited starts out full.
+ */
+static int
+set_rate (Limiter *self, double *field, double value)
+{
+  g_mutex_lock (&self->mutex);
+  refill (self);
+  gboolean byte_was_limited = self->byte_rate > 0;
+  gboolean op_was_limited = self->op_rate > 0;
+  *field = value;
+  self->bytes = byte_was_limited ? MIN (self->bytes, byte_capacity (self))
+                                 : byte_capacity (self);
+  self->ops = op_was_limited ? MIN (self->ops, op_capacity (self))
+                             : op_capacity (self);
+  g_mutex_unlock (&self->mutex);
+  return 0;
+}
+
+PyDoc_STRVAR (
+    Limiter_doc,
+    "Limit the bandwidth and operation rate of the wrappers sharing it.\n"
+    "\n"
+    "Pass it as *limiter* to any number of :class:`StreamWrapper` objects\n"
+    "or :func:`open` calls. Their reads and writes then wait, without the\n"
+    "GIL, for the limiter to admit them. The rates can be changed at any\n"
+    "time, for example to throttle bulk transfers during the day only.\n"
+    "\n"
+    ":param float bandwidth:\n"
+    "   Initial value of :attr:`bandwidth`.\n"
+    ":param float iops:\n"
+    "   Initial value of :attr:`iops`.\n"
+    ":param float burst:\n"
+    "   Initial value of :attr:`burst`.\n"
+    ":raises ValueError:\n"
+    "   Invalid rate or burst.");
+static PyObject *
+Limiter_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  Limiter *self = (Limiter *)PyType_GenericNew (type, args, kwds);
+  if (!self)
+    return NULL;
+
+  g_mutex_init (&self->mutex);
+  self->burst = 1;
+  self->bytes = 1;
+  self->ops = 1;
+  self->refilled = g_get_monotonic_time ();
+  return (PyObject *)self;
+}
+
+static int
+Limiter_init (Limiter *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = { "bandwidth", "iops", "burst", NULL };
+  PyObject *py_bandwidth = Py_None;
+  PyObject *py_iops = Py_None;
+  double burst = 1;
+  double byte_rate, op_rate;
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|OOd", kwlist,
+                                    &py_bandwidth, &py_iops, &burst))
+    return -1;
+
+  if (parse_rate (py_bandwidth, "bandwidth", &byte_rate) < 0
+      || parse_rate (py_iops, "iops", &op_rate) < 0)
+    return -1;
+  if (!(burst > 0) || burst == HUGE_VAL)
+    {
+      PyErr_SetString (PyExc_ValueError, "invalid burst");
+      return -1;
+    }
+
+  // Start out with full buckets
+  g_mutex_lock (&self->mutex);
+  self->byte_rate = byte_rate;
+  self->op_rate = op_rate;
+  self->burst = burst;
+  self->bytes = byte_capacity (self);
+  self->ops = op_capacity (self);
+  self->refilled = g_get_monotonic_time ();
+  g_mutex_unlock (&self->mutex);
+  return 0;
+}
+
+PyDoc_STRVAR (Limiter_bandwidth_doc,
+              "Bytes per second, ``None`` for unlimited.");
+static PyObject *
+Limiter_get_bandwidth (Limiter *self, void *closure)
+{
+  g_mutex_lock (&self->mutex);
+  double rate = self->byte_rate;
+  g_mutex_unlock (&self->mutex);
+  return format_rate (rate);
+}
+
+static int
+Limiter_set_bandwidth (Limiter *self, PyObject *value, void *closure)
+{
+  double rate;
+  if (parse_rate (value, "bandwidth", &rate) < 0)
+    return -1;
+  return set_rate (self, &self->byte_rate, rate);
+}
+
+PyDoc_STRVAR (Limiter_iops_doc,
+              "Reads and writes per second, ``None`` for unlimited.");
+static PyObject *
+Limiter_get_iops (Limiter *self, void *closure)
+{
+  g_mutex_lock (&self->mutex);
+  double rate = self->op_rate;
+  g_mutex_unlock (&self->mutex);
+  return format_rate (rate);
+}
+
+static int
+Limiter_set_iops (Limiter *self, PyObject *value, void *closure)
+{
+  double rate;
+  if (parse_rate (value, "iops", &rate) < 0)
+    return -1;
+  return set_rate (self, &self->op_rate, rate);
+}
+
+PyDoc_STRVAR (Limiter_burst_doc,
+              "Seconds worth of unused bandwidth and operations that can be\n"
+              "saved up and spent at once. Single reads and writes are split\n"
+              "to be no larger than that.");
+static PyObject *
+Limiter_get_burst (Limiter *self, void *closure)
+{
+  g_mutex_lock (&self->mutex);
+  double burst = self->burst;
+  g_mutex_unlock (&self->mutex);
+  return PyFloat_FromDouble (burst);
+}
+
+static int
+Limiter_set_burst (Limiter *self, PyObject *value, void *closure)
+{
+  if (!value)
+    {
+      PyErr_SetString (PyExc_AttributeError, "can't delete burst");
+      return -1;
+    }
+
+  double burst = PyFloat_AsDouble (value);
+  if (burst == -1.0 && PyErr_Occurred ())
+    return -1;
+  if (!(burst > 0) || burst == HUGE_VAL)
+    {
+      PyErr_SetString (PyExc_ValueError, "invalid burst");
+      return -1;
+    }
+  return set_rate (self, &self->burst, burst);
+}
+
+PyDoc_STRVAR (Limiter_stats_doc,
+              "Report what passed the limiter since it was created.\n"
+              "\n"
+              ":rtype: dict\n"
+              ":returns:\n"
+              "   A mapping of ``bytes`` and ``operations`` (totals\n"
+              "   admitted), ``waits`` (operations that had to wait) and\n"
+              "   ``wait_time`` (seconds spent waiting, summed over all\n"
+              "   threads).");
+static PyObject *
+Limiter_stats_impl (Limiter *self, PyObject *Py_UNUSED (ignored))
+{
+  g_mutex_lock (&self->mutex);
+  unsigned long long total_bytes = self->total_bytes;
+  unsigned long long total_ops = self->total_ops;
+  unsigned long long waits = self->waits;
+  gint64 wait_time = self->wait_time;
+  g_mutex_unlock (&self->mutex);
+
+  return Py_BuildValue ("{s:K,s:K,s:K,s:d}", "bytes", total_bytes,
+                        "operations", total_ops, "waits", waits,
+                        "wait_time", (double)wait_time / G_USEC_PER_SEC);
+}
+
+static void
+Limiter_dealloc (Limiter *self)
+{
+  g_mutex_clear (&self->mutex);
+  PyTypeObject *type = Py_TYPE (self);
+  type->tp_free ((PyObject *)self);
+  // Instances of heap types own a reference to their type
+  Py_DECREF (type);
+}
+
+static PyMethodDef Limiter_methods[]
+    = { { "stats", (PyCFunction)Limiter_stats_impl, METH_NOARGS,
+          Limiter_stats_doc },
+        { NULL } };
+
+static PyGetSetDef Limiter_getsetters[]
+    = { { "bandwidth", (getter)Limiter_get_bandwidth,
+          (setter)Limiter_set_bandwidth, Limiter_bandwidth_doc, NULL },
+        { "iops", (getter)Limiter_get_iops, (setter)Limiter_set_iops,
+          Limiter_iops_doc, NULL },
+        { "burst", (getter)Limiter_get_burst, (setter)Limiter_set_burst,
+          Limiter_burst_doc, NULL },
+        { NULL } };
+
+static PyType_Slot Limiter_slots[]
+    = { { Py_tp_doc, (void *)Limiter_doc },
+        { Py_tp_new, (void *)Limiter_new },
+        { Py_tp_init, (void *)Limiter_init },
+        { Py_tp_dealloc, (void *)Limiter_dealloc },
+        { Py_tp_methods, (void *)Limiter_methods },
+        { Py_tp_getset, (void *)Limiter_getsetters },
+        { 0, NULL } };
+
+static PyType_Spec Limiter_spec = { .name = "gio_pyio.Limiter",
+                                    .basicsize = sizeof (Limiter),
+                                    .itemsize = 0,
+                                    .flags = Py_TPFLAGS_DEFAULT,
+                                    .slots = Limiter_slots };
+
+PyObject *
+PyLimiterType_Create (PyObject *module)
+{
+  return PyType_FromModuleAndSpec (module, &Limiter_spec, NULL);
+}
@@ -0,0 +1,16 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <Python.h>
+#include <gio/gio.h>
+
+PyObject *PyLimiterType_Create (PyObject *module);
+
+/* Called without the GIL around the transfers of wrappers sharing a
+ * limiter, see the definitions. */
+gboolean limiter_acquire (PyObject *limiter, GCancellable *cancellable,
+                          GError **error);
+void limiter_consume (PyObject *limiter, gsize bytes);
+gsize limiter_max_chunk (PyObject *limiter);
+
+#endif
@@ -0,0 +1,23 @@
+#include "memtrack.h"
+#include <Python.h>
+#include <stdint.h>
+
+/*
+ * Both calls are no-ops returning -2 while tracemalloc is not tracing, which
+ * is the common case, so failures are deliberately ignored. They acquire the
+ * GIL themselves and are thus safe to call from any thread.
+ */
+
+void
+memtrack_track (gconstpointer ptr, gsize size)
+{
+  if (ptr)
+    PyTraceMalloc_Track (GIO_PYIO_TRACEMALLOC_DOMAIN, (uintptr_t)ptr, size);
+}
+
+void
+memtrack_untrack (gconstpointer ptr)
+{
+  if (ptr)
+    PyTraceMalloc_Untrack (GIO_PYIO_TRACEMALLOC_DOMAIN, (uintptr_t)ptr);
+}
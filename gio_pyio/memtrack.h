@@ -0,0 +1,14 @@
+#ifndef MEMTRACK_H
+#define MEMTRACK_H
+
+#include <Python.h>
+#include <glib.h>
+
+/* tracemalloc domain for memory allocated by GLib on behalf of a wrapper.
+ * The value spells "GIO" in ASCII. */
+#define GIO_PYIO_TRACEMALLOC_DOMAIN 0x47494f
+
+void memtrack_track (gconstpointer ptr, gsize size);
+void memtrack_untrack (gconstpointer ptr);
+
+#endif
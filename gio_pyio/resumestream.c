@@ -0,0 +1,377 @@
+#include "resumestream.h"
+#include <string.h>
+
+/*
+ * Reads a file through a stream opened from it, reopening the file and
+ * continuing where it left off when a read fails with an error that a
+ * dropped connection would cause. The position is counted here, below any
+ * buffering, so it is exactly what has been handed on and nothing is read
+ * twice or skipped. The file is only resumed if its etag, or failing that
+ * its modification time, is unchanged. Attempts back off exponentially and
+ * come out of a budget shared by the whole lifetime of the stream.
+ */
+struct _ResumeInputStream
+{
+  GInputStream parent_instance;
+  GFile *file;
+  // NULL after a failed reopen, reopened by the next read
+  GInputStream *base;
+  goffset position;
+  guint retries_left;
+  // Version of the file when it was first opened
+  gchar *etag;
+  guint64 mtime;
+  gboolean has_mtime;
+};
+
+static void resume_input_stream_seekable_iface_init (GSeekableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (
+    ResumeInputStream, resume_input_stream, G_TYPE_INPUT_STREAM,
+    G_IMPLEMENT_INTERFACE (G_TYPE_SEEKABLE,
+                           resume_input_stream_seekable_iface_init))
+
+#define VERSION_ATTRIBUTES                                                    \
+  G_FILE_ATTRIBUTE_ETAG_VALUE "," G_FILE_ATTRIBUTE_TIME_MODIFIED              \
+                              "," G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC
+
+#define BACKOFF_INITIAL_USEC (G_USEC_PER_SEC / 10)
+#define BACKOFF_MAX_USEC (10 * G_USEC_PER_SEC)
+
+static gboolean
+is_transient (const GError *error)
+{
+  if (error->domain != G_IO_ERROR)
+    return FALSE;
+
+  switch (error->code)
+    {
+    case G_IO_ERROR_BROKEN_PIPE:
+    case G_IO_ERROR_TIMED_OUT:
+    case G_IO_ERROR_BUSY:
+    case G_IO_ERROR_HOST_NOT_FOUND:
+    case G_IO_ERROR_HOST_UNREACHABLE:
+    case G_IO_ERROR_NETWORK_UNREACHABLE:
+    case G_IO_ERROR_CONNECTION_REFUSED:
+    case G_IO_ERROR_NOT_CONNECTED:
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+static GFileInfo *
+query_version (GFile *file, GInputStream *stream, GCancellable *cancellable,
+               GError **error)
+{
+  GError *local = NULL;
+
+  // The open stream describes the file actually being read
+  if (G_IS_FILE_INPUT_STREAM (stream))
+    {
+      GFileInfo *info = g_file_input_stream_query_info (
+          G_FILE_INPUT_STREAM (stream), VERSION_ATTRIBUTES, cancellable,
+          &local);
+      if (info)
+        return info;
+      if (!g_error_matches (local, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+        {
+          g_propagate_error (error, local);
+          return NULL;
+        }
+      g_clear_error (&local);
+    }
+
+  return g_file_query_info (file, VERSION_ATTRIBUTES, G_FILE_QUERY_INFO_NONE,
+                            cancellable, error);
+}
+
+static guint64
+get_mtime (GFileInfo *info)
+{
+  return g_file_info_get_attribute_uint64 (info,
+                                           G_FILE_ATTRIBUTE_TIME_MODIFIED)
+             * G_USEC_PER_SEC
+         + g_file_info_get_attribute_uint32 (
+             info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+}
+
+static gboolean
+check_version (ResumeInputStream *self, GInputStream *stream,
+               GCancellable *cancellable, GError **error)
+{
+  GFileInfo *info = query_version (self->file, stream, cancellable, error);
+  if (!info)
+    return FALSE;
+
+  const char *etag = g_file_info_get_etag (info);
+  gboolean has_mtime
+      = g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+  gboolean unchanged;
+  if (self->etag && etag)
+    unchanged = strcmp (self->etag, etag) == 0;
+  else if (self->has_mtime && has_mtime)
+    unchanged = self->mtime == get_mtime (info);
+  else
+    unchanged = FALSE;
+  g_object_unref (info);
+
+  if (!unchanged)
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WRONG_ETAG,
+                         "File changed or can't be verified, not resuming");
+  return unchanged;
+}
+
+static gboolean
+skip_to (GInputStream *stream, goffset offset, GCancellable *cancellable,
+         GError **error)
+{
+  while (offset > 0)
+    {
+      gssize n = g_input_stream_skip (stream, MIN (offset, G_MAXSSIZE),
+                                      cancellable, error);
+      if (n < 0)
+        return FALSE;
+      if (n == 0)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WRONG_ETAG,
+                               "File shrank, not resuming");
+          return FALSE;
+        }
+      offset -= n;
+    }
+  return TRUE;
+}
+
+static gboolean
+reopen (ResumeInputStream *self, GCancellable *cancellable, GError **error)
+{
+  if (self->base)
+    {
+      g_input_stream_close (self->base, NULL, NULL);
+      g_clear_object (&self->base);
+    }
+
+  GInputStream *stream
+      = G_INPUT_STREAM (g_file_read (self->file, cancellable, error));
+  if (!stream)
+    return FALSE;
+
+  gboolean positioned;
+  if (!check_version (self, stream, cancellable, error))
+    positioned = FALSE;
+  else if (G_IS_SEEKABLE (stream)
+           && g_seekable_can_seek (G_SEEKABLE (stream)))
+    positioned = g_seekable_seek (G_SEEKABLE (stream), self->position,
+                                  G_SEEK_SET, cancellable, error);
+  else
+    positioned = skip_to (stream, self->position, cancellable, error);
+
+  if (!positioned)
+    {
+      g_object_unref (stream);
+      return FALSE;
+    }
+
+  self->base = stream;
+  return TRUE;
+}
+
+// Sleep before attempt number *attempt*, returning early if cancelled
+static gboolean
+back_off (guint attempt, GCancellable *cancellable, GError **error)
+{
+  gint64 delay = BACKOFF_INITIAL_USEC << MIN (attempt, 10);
+  delay = MIN (delay, BACKOFF_MAX_USEC);
+
+  GPollFD pollfd;
+  if (g_cancellable_make_pollfd (cancellable, &pollfd))
+    {
+      g_poll (&pollfd, 1, delay / 1000);
+      g_cancellable_release_fd (cancellable);
+    }
+  else
+    g_usleep (delay);
+
+  return !g_cancellable_set_error_if_cancelled (cancellable, error);
+}
+
+static gssize
+resume_input_stream_read (GInputStream *stream, void *buffer, gsize count,
+                          GCancellable *cancellable, GError **error)
+{
+  ResumeInputStream *self = RESUME_INPUT_STREAM (stream);
+  GError *local = NULL;
+
+  for (guint attempt = 0;; attempt++)
+    {
+      gssize n = -1;
+      if ((attempt == 0 && self->base) || reopen (self, cancellable, &local))
+        n = g_input_stream_read (self->base, buffer, count, cancellable,
+                                 &local);
+      if (n >= 0)
+        {
+          self->position += n;
+          return n;
+        }
+
+      if (!is_transient (local) || self->retries_left == 0)
+        {
+          g_propagate_error (error, local);
+          return -1;
+        }
+      g_clear_error (&local);
+      self->retries_left--;
+
+      if (!back_off (attempt, cancellable, error))
+        return -1;
+    }
+}
+
+static gboolean
+resume_input_stream_close (GInputStream *stream, GCancellable *cancellable,
+                           GError **error)
+{
+  ResumeInputStream *self = RESUME_INPUT_STREAM (stream);
+
+  if (!self->base)
+    return TRUE;
+  return g_input_stream_close (self->base, cancellable, error);
+}
+
+static goffset
+resume_input_stream_tell (GSeekable *seekable)
+{
+  return RESUME_INPUT_STREAM (seekable)->position;
+}
+
+static gboolean
+resume_input_stream_can_seek (GSeekable *seekable)
+{
+  ResumeInputStream *self = RESUME_INPUT_STREAM (seekable);
+
+  return !self->base
+         || (G_IS_SEEKABLE (self->base)
+             && g_seekable_can_seek (G_SEEKABLE (self->base)));
+}
+
+static gboolean
+resume_input_stream_seek (GSeekable *seekable, goffset offset, GSeekType type,
+                          GCancellable *cancellable, GError **error)
+{
+  ResumeInputStream *self = RESUME_INPUT_STREAM (seekable);
+
+  // Without a stream the target is where the next read reopens at
+  if (!self->base && type != G_SEEK_END)
+    {
+      goffset target = type == G_SEEK_SET ? offset : self->position + offset;
+      if (target < 0)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                               "Invalid seek request");
+          return FALSE;
+        }
+      self->position = target;
+      return TRUE;
+    }
+
+  if (!self->base && !reopen (self, cancellable, error))
+    return FALSE;
+
+  if (!G_IS_SEEKABLE (self->base))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "Seek not supported on stream");
+      return FALSE;
+    }
+
+  GSeekable *base = G_SEEKABLE (self->base);
+  if (!g_seekable_seek (base, offset, type, cancellable, error))
+    return FALSE;
+  self->position = g_seekable_tell (base);
+  return TRUE;
+}
+
+static gboolean
+resume_input_stream_can_truncate (GSeekable *seekable)
+{
+  return FALSE;
+}
+
+static gboolean
+resume_input_stream_truncate (GSeekable *seekable, goffset offset,
+                              GCancellable *cancellable, GError **error)
+{
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Truncate not supported on stream");
+  return FALSE;
+}
+
+static void
+resume_input_stream_seekable_iface_init (GSeekableIface *iface)
+{
+  iface->tell = resume_input_stream_tell;
+  iface->can_seek = resume_input_stream_can_seek;
+  iface->seek = resume_input_stream_seek;
+  iface->can_truncate = resume_input_stream_can_truncate;
+  iface->truncate_fn = resume_input_stream_truncate;
+}
+
+static void
+resume_input_stream_finalize (GObject *object)
+{
+  ResumeInputStream *self = RESUME_INPUT_STREAM (object);
+
+  g_clear_object (&self->base);
+  g_clear_object (&self->file);
+  g_free (self->etag);
+
+  G_OBJECT_CLASS (resume_input_stream_parent_class)->finalize (object);
+}
+
+static void
+resume_input_stream_class_init (ResumeInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = resume_input_stream_finalize;
+  stream_class->read_fn = resume_input_stream_read;
+  stream_class->close_fn = resume_input_stream_close;
+}
+
+static void
+resume_input_stream_init (ResumeInputStream *self)
+{
+}
+
+/*
+ * Create a stream reading *base*, which was opened from *file*, and reopening
+ * *file* up to *retries* times. Blocks while the version of the file is
+ * queried.
+ */
+GInputStream *
+resume_input_stream_new (GFile *file, GInputStream *base, guint retries,
+                         GCancellable *cancellable, GError **error)
+{
+  GFileInfo *info = query_version (file, base, cancellable, error);
+  if (!info)
+    return NULL;
+
+  ResumeInputStream *self = g_object_new (RESUME_TYPE_INPUT_STREAM, NULL);
+  self->file = g_object_ref (file);
+  self->base = g_object_ref (base);
+  self->retries_left = retries;
+  self->etag = g_strdup (g_file_info_get_etag (info));
+  self->has_mtime
+      = g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+  if (self->has_mtime)
+    self->mtime = get_mtime (info);
+  g_object_unref (info);
+
+  // Resume from wherever base was handed over at
+  if (G_IS_SEEKABLE (base))
+    self->position = g_seekable_tell (G_SEEKABLE (base));
+
+  return G_INPUT_STREAM (self);
+}
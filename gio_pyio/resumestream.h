@@ -0,0 +1,19 @@
+#ifndef RESUMESTREAM_H
+#define RESUMESTREAM_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define RESUME_TYPE_INPUT_STREAM (resume_input_stream_get_type ())
+G_DECLARE_FINAL_TYPE (ResumeInputStream, resume_input_stream, RESUME,
+                      INPUT_STREAM, GInputStream)
+
+GInputStream *resume_input_stream_new (GFile *file, GInputStream *base,
+                                       guint retries,
+                                       GCancellable *cancellable,
+                                       GError **error);
+
+G_END_DECLS
+
+#endif
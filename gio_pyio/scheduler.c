@@ -0,0 +1,355 @@
+#define PY_SSIZE_T_CLEAN
+#include "scheduler.h"
+
+/*
+ * Start-time fair queueing of transfers, each at most a quantum in size, over
+ * a fixed number of slots. A request is tagged with the virtual time it may
+ * start at, the later of the scheduler's virtual time and the end of the
+ * tenant's previous request, which ends its size divided by the tenant's
+ * weight later. Waiting requests go by priority first and start tag second,
+ * so a tenant with many large transfers queued gets its weight's share of
+ * the slots but can't hold back the others' small requests for longer than
+ * a quantum per slot.
+ */
+struct _SchedulerTenant
+{
+  double weight;
+  // Virtual time the tenant's last request ends at
+  double finish;
+  // Statistics, see stats()
+  guint64 total_bytes;
+  guint64 total_ops;
+  gint64 wait_time;
+};
+
+typedef struct
+{
+  int priority;
+  double start;
+  guint64 seq;
+} Request;
+
+typedef struct
+{
+  PyObject_HEAD GMutex mutex;
+  GCond changed;
+  guint slots;
+  gsize quantum;
+  guint active;
+  double vtime;
+  guint64 seq;
+  // Waiting requests, in the order they are served
+  GQueue pending;
+  // Names to tenants, which live as long as the scheduler
+  GHashTable *tenants;
+} Scheduler;
+
+static gint
+compare_requests (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const Request *request_a = a, *request_b = b;
+
+  if (request_a->priority != request_b->priority)
+    return request_a->priority < request_b->priority ? -1 : 1;
+  if (request_a->start != request_b->start)
+    return request_a->start < request_b->start ? -1 : 1;
+  return request_a->seq < request_b->seq ? -1 : 1;
+}
+
+/*
+ * Return the tenant called *name*, created with weight 1 on first use.
+ */
+SchedulerTenant *
+scheduler_tenant (PyObject *scheduler, const char *name)
+{
+  Scheduler *self = (Scheduler *)scheduler;
+
+  g_mutex_lock (&self->mutex);
+  SchedulerTenant *tenant = g_hash_table_lookup (self->tenants, name);
+  if (!tenant)
+    {
+      tenant = g_new0 (SchedulerTenant, 1);
+      tenant->weight = 1;
+      tenant->finish = self->vtime;
+      g_hash_table_insert (self->tenants, g_strdup (name), tenant);
+    }
+  g_mutex_unlock (&self->mutex);
+  return tenant;
+}
+
+static void
+wake_waiters (GCancellable *cancellable, gpointer data)
+{
+  Scheduler *self = data;
+
+  g_mutex_lock (&self->mutex);
+  g_cond_broadcast (&self->changed);
+  g_mutex_unlock (&self->mutex);
+}
+
+/*
+ * Wait, without the GIL, for the scheduler to start a transfer of *bytes*
+ * for *tenant*. Fails if *cancellable* is cancelled first.
+ */
+gboolean
+scheduler_acquire (PyObject *scheduler, SchedulerTenant *tenant, int priority,
+                   gsize bytes, GCancellable *cancellable, GError **error)
+{
+  Scheduler *self = (Scheduler *)scheduler;
+  gint64 queued = g_get_monotonic_time ();
+  Request request = { .priority = priority };
+
+  g_mutex_lock (&self->mutex);
+  request.start = MAX (self->vtime, tenant->finish);
+  request.seq = self->seq++;
+  double cost = (double)bytes / tenant->weight;
+  tenant->finish = request.start + cost;
+
+  gboolean admitted
+      = g_queue_is_empty (&self->pending) && self->active < self->slots;
+  if (!admitted)
+    {
+      g_queue_insert_sorted (&self->pending, &request, compare_requests,
+                             NULL);
+      g_mutex_unlock (&self->mutex);
+      // Not under the mutex, runs the handler right away if cancelled
+      gulong handler = g_cancellable_connect (
+          cancellable, G_CALLBACK (wake_waiters), self, NULL);
+      g_mutex_lock (&self->mutex);
+
+      while (!g_cancellable_is_cancelled (cancellable))
+        {
+          if (g_queue_peek_head (&self->pending) == &request
+              && self->active < self->slots)
+            {
+              admitted = TRUE;
+              break;
+            }
+          g_cond_wait (&self->changed, &self->mutex);
+        }
+      g_queue_remove (&self->pending, &request);
+      // The next in line may be first now
+      g_cond_broadcast (&self->changed);
+
+      g_mutex_unlock (&self->mutex);
+      g_cancellable_disconnect (cancellable, handler);
+      g_mutex_lock (&self->mutex);
+    }
+
+  if (admitted)
+    {
+      self->active++;
+      self->vtime = MAX (self->vtime, request.start);
+      tenant->total_ops++;
+    }
+  else
+    {
+      // Give back the virtual time of the transfer that never ran
+      tenant->finish -= cost;
+    }
+  tenant->wait_time += g_get_monotonic_time () - queued;
+  g_mutex_unlock (&self->mutex);
+
+  if (!admitted)
+    g_cancellable_set_error_if_cancelled (cancellable, error);
+  return admitted;
+}
+
+/*
+ * End a transfer started by scheduler_acquire(), which moved *bytes*.
+ */
+void
+scheduler_release (PyObject *scheduler, SchedulerTenant *tenant, gsize bytes)
+{
+  Scheduler *self = (Scheduler *)scheduler;
+
+  g_mutex_lock (&self->mutex);
+  self->active--;
+  tenant->total_bytes += bytes;
+  if (!g_queue_is_empty (&self->pending))
+    g_cond_broadcast (&self->changed);
+  g_mutex_unlock (&self->mutex);
+}
+
+/*
+ * Largest transfer a single request may make.
+ */
+gsize
+scheduler_quantum (PyObject *scheduler)
+{
+  return ((Scheduler *)scheduler)->quantum;
+}
+
+PyDoc_STRVAR (
+    Scheduler_doc,
+    "Share transfers fairly between the tenants of the wrappers using it.\n"
+    "\n"
+    "Pass it as *scheduler*, along with a *tenant* name, to any number of\n"
+    ":class:`StreamWrapper` objects or :func:`open` calls. Their reads and\n"
+    "writes are then split into quanta, which run at most *slots* at a\n"
+    "time. Waiting quanta are served by the :attr:`StreamWrapper.priority`\n"
+    "of their wrapper and, within a priority, by weighted fair queueing\n"
+    "between tenants. A tenant moving large amounts of data thus gets its\n"
+    "weight's share of the slots while small requests of other tenants\n"
+    "wait for no more than a quantum per slot.\n"
+    "\n"
+    ":param int slots:\n"
+    "   Number of quanta transferred at once.\n"
+    ":param int quantum:\n"
+    "   Largest number of bytes a read or write is served in one go.\n"
+    ":raises ValueError:\n"
+    "   Invalid slots or quantum.");
+static PyObject *
+Scheduler_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  Scheduler *self = (Scheduler *)PyType_GenericNew (type, args, kwds);
+  if (!self)
+    return NULL;
+
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->changed);
+  g_queue_init (&self->pending);
+  self->tenants = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         g_free);
+  self->slots = 1;
+  self->quantum = 64 * 1024;
+  return (PyObject *)self;
+}
+
+static int
+Scheduler_init (Scheduler *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = { "slots", "quantum", NULL };
+  unsigned int slots = 1;
+  Py_ssize_t quantum = 64 * 1024;
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|In", kwlist, &slots,
+                                    &quantum))
+    return -1;
+
+  if (slots == 0 || quantum <= 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "invalid slots or quantum");
+      return -1;
+    }
+
+  g_mutex_lock (&self->mutex);
+  self->slots = slots;
+  self->quantum = (gsize)quantum;
+  g_mutex_unlock (&self->mutex);
+  return 0;
+}
+
+PyDoc_STRVAR (Scheduler_set_weight_doc,
+              "Set the share of *tenant* relative to the other tenants.\n"
+              "\n"
+              "Tenants start out with a weight of 1.\n"
+              "\n"
+              ":param str tenant:\n"
+              "   Name of the tenant.\n"
+              ":param float weight:\n"
+              "   Positive weight, twice the weight getting twice the\n"
+              "   bandwidth when both tenants have transfers waiting.\n"
+              ":raises ValueError:\n"
+              "   Invalid weight.");
+static PyObject *
+Scheduler_set_weight_impl (Scheduler *self, PyObject *args)
+{
+  const char *name;
+  double weight;
+
+  if (!PyArg_ParseTuple (args, "sd", &name, &weight))
+    return NULL;
+
+  if (!(weight > 0) || weight == HUGE_VAL)
+    {
+      PyErr_SetString (PyExc_ValueError, "invalid weight");
+      return NULL;
+    }
+
+  SchedulerTenant *tenant = scheduler_tenant ((PyObject *)self, name);
+  g_mutex_lock (&self->mutex);
+  tenant->weight = weight;
+  g_mutex_unlock (&self->mutex);
+
+  Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR (Scheduler_stats_doc,
+              "Report what each tenant transferred so far.\n"
+              "\n"
+              ":rtype: dict\n"
+              ":returns:\n"
+              "   A mapping of tenant names to mappings of ``weight``,\n"
+              "   ``bytes`` and ``operations`` (quanta transferred) and\n"
+              "   ``wait_time`` (seconds spent queueing, summed over all\n"
+              "   threads).");
+static PyObject *
+Scheduler_stats_impl (Scheduler *self, PyObject *Py_UNUSED (ignored))
+{
+  PyObject *result = PyDict_New ();
+  if (!result)
+    return NULL;
+
+  g_mutex_lock (&self->mutex);
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init (&iter, self->tenants);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      SchedulerTenant *tenant = value;
+      PyObject *stats = Py_BuildValue (
+          "{s:d,s:K,s:K,s:d}", "weight", tenant->weight, "bytes",
+          (unsigned long long)tenant->total_bytes, "operations",
+          (unsigned long long)tenant->total_ops, "wait_time",
+          (double)tenant->wait_time / G_USEC_PER_SEC);
+      if (!stats || PyDict_SetItemString (result, key, stats) < 0)
+        {
+          Py_XDECREF (stats);
+          Py_CLEAR (result);
+          break;
+        }
+      Py_DECREF (stats);
+    }
+  g_mutex_unlock (&self->mutex);
+  return result;
+}
+
+static void
+Scheduler_dealloc (Scheduler *self)
+{
+  g_hash_table_unref (self->tenants);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->changed);
+  PyTypeObject *type = Py_TYPE (self);
+  type->tp_free ((PyObject *)self);
+  // Instances of heap types own a reference to their type
+  Py_DECREF (type);
+}
+
+static PyMethodDef Scheduler_methods[]
+    = { { "set_weight", (PyCFunction)Scheduler_set_weight_impl, METH_VARARGS,
+          Scheduler_set_weight_doc },
+        { "stats", (PyCFunction)Scheduler_stats_impl, METH_NOARGS,
+          Scheduler_stats_doc },
+        { NULL } };
+
+static PyType_Slot Scheduler_slots[]
+    = { { Py_tp_doc, (void *)Scheduler_doc },
+        { Py_tp_new, (void *)Scheduler_new },
+        { Py_tp_init, (void *)Scheduler_init },
+        { Py_tp_dealloc, (void *)Scheduler_dealloc },
+        { Py_tp_methods, (void *)Scheduler_methods },
+        { 0, NULL } };
+
+static PyType_Spec Scheduler_spec = { .name = "gio_pyio.Scheduler",
+                                      .basicsize = sizeof (Scheduler),
+                                      .itemsize = 0,
+                                      .flags = Py_TPFLAGS_DEFAULT,
+                                      .slots = Scheduler_slots };
+
+PyObject *
+PySchedulerType_Create (PyObject *module)
+{
+  return PyType_FromModuleAndSpec (module, &Scheduler_spec, NULL);
+}
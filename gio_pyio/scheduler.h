@@ -0,0 +1,21 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Python.h>
+#include <gio/gio.h>
+
+typedef struct _SchedulerTenant SchedulerTenant;
+
+PyObject *PySchedulerType_Create (PyObject *module);
+
+/* Called without the GIL around the transfers of wrappers sharing a
+ * scheduler, see the definitions. */
+SchedulerTenant *scheduler_tenant (PyObject *scheduler, const char *name);
+gboolean scheduler_acquire (PyObject *scheduler, SchedulerTenant *tenant,
+                            int priority, gsize bytes,
+                            GCancellable *cancellable, GError **error);
+void scheduler_release (PyObject *scheduler, SchedulerTenant *tenant,
+                        gsize bytes);
+gsize scheduler_quantum (PyObject *scheduler);
+
+#endif
@@ -0,0 +1,254 @@
+#include "spoolstream.h"
+
+/*
+ * Collects what is written to it in memory, and moves it to a temporary file
+ * once it would grow past max_memory. The position carries over, so writers
+ * and seeks carry on in the file as if nothing happened. The file is deleted
+ * when the stream is finalized. Once closed, the contents are either the
+ * bytes of the memory stream, stolen without copying, or the file.
+ */
+struct _SpoolOutputStream
+{
+  GOutputStream parent_instance;
+  gsize max_memory;
+  // Exactly one of memory and file is set
+  GMemoryOutputStream *memory;
+  GFile *file;
+  GFileIOStream *file_io;
+  // Taken from memory on close
+  GBytes *bytes;
+};
+
+static void spool_output_stream_seekable_iface_init (GSeekableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (
+    SpoolOutputStream, spool_output_stream, G_TYPE_OUTPUT_STREAM,
+    G_IMPLEMENT_INTERFACE (G_TYPE_SEEKABLE,
+                           spool_output_stream_seekable_iface_init))
+
+static GOutputStream *
+current (SpoolOutputStream *self)
+{
+  if (self->memory)
+    return G_OUTPUT_STREAM (self->memory);
+  return g_io_stream_get_output_stream (G_IO_STREAM (self->file_io));
+}
+
+// Move the contents to a temporary file, keeping the position
+static gboolean
+spill (SpoolOutputStream *self, GCancellable *cancellable, GError **error)
+{
+  GFileIOStream *file_io;
+  GFile *file = g_file_new_tmp ("gio-pyio-spool-XXXXXX", &file_io, error);
+  if (!file)
+    return FALSE;
+
+  GOutputStream *output
+      = g_io_stream_get_output_stream (G_IO_STREAM (file_io));
+  goffset position = g_seekable_tell (G_SEEKABLE (self->memory));
+  if (!g_output_stream_write_all (
+          output, g_memory_output_stream_get_data (self->memory),
+          g_memory_output_stream_get_data_size (self->memory), NULL,
+          cancellable, error)
+      || !g_seekable_seek (G_SEEKABLE (output), position, G_SEEK_SET,
+                           cancellable, error))
+    {
+      g_io_stream_close (G_IO_STREAM (file_io), NULL, NULL);
+      g_object_unref (file_io);
+      g_file_delete (file, NULL, NULL);
+      g_object_unref (file);
+      return FALSE;
+    }
+
+  g_clear_object (&self->memory);
+  self->file = file;
+  self->file_io = file_io;
+  return TRUE;
+}
+
+// Spill unless the memory stream can grow to *size* bytes
+static gboolean
+reserve (SpoolOutputStream *self, goffset size, GCancellable *cancellable,
+         GError **error)
+{
+  if (!self->memory || size <= (goffset)self->max_memory)
+    return TRUE;
+  return spill (self, cancellable, error);
+}
+
+static gssize
+spool_output_stream_write (GOutputStream *stream, const void *buffer,
+                           gsize count, GCancellable *cancellable,
+                           GError **error)
+{
+  SpoolOutputStream *self = SPOOL_OUTPUT_STREAM (stream);
+
+  if (self->memory
+      && !reserve (self,
+                   g_seekable_tell (G_SEEKABLE (self->memory)) + count,
+                   cancellable, error))
+    return -1;
+
+  return g_output_stream_write (current (self), buffer, count, cancellable,
+                                error);
+}
+
+static gboolean
+spool_output_stream_flush (GOutputStream *stream, GCancellable *cancellable,
+                           GError **error)
+{
+  return g_output_stream_flush (current (SPOOL_OUTPUT_STREAM (stream)),
+                                cancellable, error);
+}
+
+static gboolean
+spool_output_stream_close (GOutputStream *stream, GCancellable *cancellable,
+                           GError **error)
+{
+  SpoolOutputStream *self = SPOOL_OUTPUT_STREAM (stream);
+
+  if (self->file_io)
+    return g_io_stream_close (G_IO_STREAM (self->file_io), cancellable,
+                              error);
+
+  if (!g_output_stream_close (G_OUTPUT_STREAM (self->memory), cancellable,
+                              error))
+    return FALSE;
+  self->bytes = g_memory_output_stream_steal_as_bytes (self->memory);
+  return TRUE;
+}
+
+static goffset
+spool_output_stream_tell (GSeekable *seekable)
+{
+  return g_seekable_tell (
+      G_SEEKABLE (current (SPOOL_OUTPUT_STREAM (seekable))));
+}
+
+static gboolean
+spool_output_stream_can_seek (GSeekable *seekable)
+{
+  return TRUE;
+}
+
+static gboolean
+spool_output_stream_seek (GSeekable *seekable, goffset offset,
+                          GSeekType type, GCancellable *cancellable,
+                          GError **error)
+{
+  return g_seekable_seek (
+      G_SEEKABLE (current (SPOOL_OUTPUT_STREAM (seekable))), offset, type,
+      cancellable, error);
+}
+
+static gboolean
+spool_output_stream_can_truncate (GSeekable *seekable)
+{
+  return TRUE;
+}
+
+static gboolean
+spool_output_stream_truncate (GSeekable *seekable, goffset offset,
+                              GCancellable *cancellable, GError **error)
+{
+  SpoolOutputStream *self = SPOOL_OUTPUT_STREAM (seekable);
+
+  if (!reserve (self, offset, cancellable, error))
+    return FALSE;
+  return g_seekable_truncate (G_SEEKABLE (current (self)), offset,
+                              cancellable, error);
+}
+
+static void
+spool_output_stream_seekable_iface_init (GSeekableIface *iface)
+{
+  iface->tell = spool_output_stream_tell;
+  iface->can_seek = spool_output_stream_can_seek;
+  iface->seek = spool_output_stream_seek;
+  iface->can_truncate = spool_output_stream_can_truncate;
+  iface->truncate_fn = spool_output_stream_truncate;
+}
+
+static void
+spool_output_stream_finalize (GObject *object)
+{
+  SpoolOutputStream *self = SPOOL_OUTPUT_STREAM (object);
+
+  g_clear_object (&self->memory);
+  g_clear_pointer (&self->bytes, g_bytes_unref);
+  g_clear_object (&self->file_io);
+  if (self->file)
+    {
+      // Streams opened on it keep reading the unlinked file
+      g_file_delete (self->file, NULL, NULL);
+      g_object_unref (self->file);
+    }
+
+  G_OBJECT_CLASS (spool_output_stream_parent_class)->finalize (object);
+}
+
+static void
+spool_output_stream_class_init (SpoolOutputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = spool_output_stream_finalize;
+  stream_class->write_fn = spool_output_stream_write;
+  stream_class->flush = spool_output_stream_flush;
+  stream_class->close_fn = spool_output_stream_close;
+}
+
+static void
+spool_output_stream_init (SpoolOutputStream *self)
+{
+  self->memory
+      = G_MEMORY_OUTPUT_STREAM (g_memory_output_stream_new_resizable ());
+}
+
+/*
+ * Create a stream holding up to *max_memory* bytes in memory.
+ */
+GOutputStream *
+spool_output_stream_new (gsize max_memory)
+{
+  SpoolOutputStream *self = g_object_new (SPOOL_TYPE_OUTPUT_STREAM, NULL);
+
+  self->max_memory = max_memory;
+  return G_OUTPUT_STREAM (self);
+}
+
+gboolean
+spool_output_stream_is_spilled (SpoolOutputStream *self)
+{
+  return self->file != NULL;
+}
+
+/*
+ * Return a new reference to the contents of a closed stream that was not
+ * spilled, or NULL.
+ */
+GBytes *
+spool_output_stream_get_bytes (SpoolOutputStream *self)
+{
+  return self->bytes ? g_bytes_ref (self->bytes) : NULL;
+}
+
+/*
+ * Open the contents of a closed stream for reading from the start. Blocks
+ * while the temporary file is opened.
+ */
+GInputStream *
+spool_output_stream_open (SpoolOutputStream *self, GCancellable *cancellable,
+                          GError **error)
+{
+  if (self->bytes)
+    return g_memory_input_stream_new_from_bytes (self->bytes);
+  if (!self->file)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PENDING,
+                           "Stream is still being written");
+      return NULL;
+    }
+  return G_INPUT_STREAM (g_file_read (self->file, cancellable, error));
+}
@@ -0,0 +1,21 @@
+#ifndef SPOOLSTREAM_H
+#define SPOOLSTREAM_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define SPOOL_TYPE_OUTPUT_STREAM (spool_output_stream_get_type ())
+G_DECLARE_FINAL_TYPE (SpoolOutputStream, spool_output_stream, SPOOL,
+                      OUTPUT_STREAM, GOutputStream)
+
+GOutputStream *spool_output_stream_new (gsize max_memory);
+gboolean spool_output_stream_is_spilled (SpoolOutputStream *self);
+GBytes *spool_output_stream_get_bytes (SpoolOutputStream *self);
+GInputStream *spool_output_stream_open (SpoolOutputStream *self,
+                                        GCancellable *cancellable,
+                                        GError **error);
+
+G_END_DECLS
+
+#endif
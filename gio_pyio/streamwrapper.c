@@ -1,18 +1,90 @@
 #define PY_SSIZE_T_CLEAN
 #define DEFAULT_BUF_SIZE 4096
 #include "streamwrapper.h"
+#include "backendgate.h"
+#include "bytesview.h"
+#include "concatstream.h"
+#include "deadline.h"
+#include "fdio.h"
 #include "gio_pyio.h"
+#include "iopriority.h"
+#include "limiter.h"
+#include "memtrack.h"
+#include "resumestream.h"
+#include "scheduler.h"
+#include "spoolstream.h"
+#include "teestream.h"
+#include "windowstream.h"
 #include <gio/gfiledescriptorbased.h>
 #include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
 #include <pygobject.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pythread.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+typedef enum
+{
+  LOCK_INPUT = 1 << 0,
+  LOCK_OUTPUT = 1 << 1,
+  LOCK_ALL = LOCK_INPUT | LOCK_OUTPUT,
+} LockDirection;
+
+typedef struct
+{
+  PyThread_type_lock lock;
+  // Thread identifier of the holder, read without holding the lock
+  gpointer owner;
+  // Passed to the GIO calls made under the lock, see wrapper_lock()
+  GCancellable *cancellable;
+  Deadline deadline;
+  // Thread I/O priority to restore on unlock, -1 if unchanged
+  int saved_ioprio;
+} DirectionLock;
+
 typedef struct
 {
   PyObject_HEAD GInputStream *input;
   GDataInputStream *data_input;
   GOutputStream *output;
   GIOStream *io;
+  // Descriptors of the streams used directly, -1 if GIO is used, see
+  // setup_fds()
+  int input_fd;
+  int output_fd;
+  // Whether seek() and tell() use the descriptor
+  gboolean fd_seekable;
+  // File the streams were opened from, if known, see handle()
+  GFile *file;
+  // Byte range the wrapper is restricted to, see setup_bounds(). Bounded
+  // wrappers track their absolute position themselves.
+  gboolean bounded;
+  goffset bound_start;
+  goffset bound_end;
+  goffset position;
+  // Wrapper a window() reads from, kept alive for the lock it shares
+  PyObject *parent;
+  // Memory held outside of Python objects, see memory_usage()
+  gsize buffer_bytes;
+  gsize scratch_bytes;
+  gsize peak_scratch_bytes;
+  // Serialise operations per direction, see wrapper_lock()
+  DirectionLock input_lock;
+  DirectionLock output_lock;
+  // Per operation timeout in microseconds, -1 for none
+  gint64 timeout;
+  // GLib priority of the operations, see wrapper_lock()
+  int priority;
+  // Limiter shared with other wrappers, set up front and never replaced
+  PyObject *limiter;
+  // Concurrency cap of the backend of *file*, see transfer_begin()
+  BackendGate *gate;
+  // Scheduler shared with other wrappers and the wrapper's tenant of it
+  PyObject *scheduler;
+  SchedulerTenant *tenant;
 } StreamWrapper;
 
 PyDoc_STRVAR (
@@ -21,38 +93,123 @@ PyDoc_STRVAR (
     "\n"
     "See :func:`open` for a convenience method to open a file as a\n"
     "`file object`_. Note, that this is only seekable if the stream\n"
-    "supports it."
+    "supports it.\n"
+    "\n"
+    "Streams of regular files that are based on a file descriptor, as\n"
+    "local files opened by Gio are, are read, written and seeked with\n"
+    "system calls on the descriptor directly, as fast as\n"
+    ":class:`io.FileIO`.\n"
     "\n"
     ":param stream stream:\n"
     "   A stream to be wrapped.\n"
+    ":param Gio.File file:\n"
+    "   The file *stream* was opened from, used by :meth:`handle` and to\n"
+    "   apply the cap set by :func:`set_backend_concurrency`.\n"
+    ":param int offset:\n"
+    "   Start of a byte range to restrict a readable stream to. Positions\n"
+    "   are relative to it and reads stop at its end. Streams that can't\n"
+    "   seek must already be positioned at *offset*.\n"
+    ":param int length:\n"
+    "   Length of the range, -1 for everything after *offset*.\n"
+    ":param float timeout:\n"
+    "   Initial value of :attr:`timeout`.\n"
+    ":param int priority:\n"
+    "   Initial value of :attr:`priority`.\n"
+    ":param Limiter limiter:\n"
+    "   Limiter the reads and writes of the wrapper, and of windows of it,\n"
+    "   have to pass.\n"
+    ":param Scheduler scheduler:\n"
+    "   Scheduler the reads and writes of the wrapper, and of windows of\n"
+    "   it, are queued in.\n"
+    ":param str tenant:\n"
+    "   Name of the tenant of *scheduler* the wrapper transfers for.\n"
+    ":param int retries:\n"
+    "   How often *stream*, an input stream opened from *file*, may be\n"
+    "   reopened when a read fails with an error a dropped connection\n"
+    "   causes. Reading then resumes where it failed if the file is\n"
+    "   unchanged, after an exponentially growing delay.\n"
     ":raises TypeError:\n"
     "   Invalid argument.\n"
     "\n"
     ".. _file object: "
     "https://docs.python.org/3/glossary.html#term-file-object");
 
-static int
-StreamWrapper_init (StreamWrapper *self, PyObject *args, PyObject *kwds)
+static PyObject *
+StreamWrapper_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-  PyObject *py_stream = NULL;
-  if (!PyArg_ParseTuple (args, "O", &py_stream))
-    return -1;
+  StreamWrapper *self = (StreamWrapper *)PyType_GenericNew (type, args, kwds);
+  if (!self)
+    return NULL;
 
-  int is_instance = PyObject_IsInstance (py_stream, PyGObjectClass);
-  if (is_instance < 0)
-    // Error during isinstance check
-    return -1;
-  if (!is_instance)
-    goto typeerr;
+  self->input_lock.lock = PyThread_allocate_lock ();
+  self->output_lock.lock = PyThread_allocate_lock ();
+  if (!self->input_lock.lock || !self->output_lock.lock)
+    {
+      Py_DECREF (self);
+      return PyErr_NoMemory ();
+    }
+  self->input_lock.cancellable = g_cancellable_new ();
+  self->output_lock.cancellable = g_cancellable_new ();
+  self->input_lock.saved_ioprio = -1;
+  self->output_lock.saved_ioprio = -1;
+  self->timeout = -1;
+  self->priority = G_PRIORITY_DEFAULT;
+  self->input_fd = -1;
+  self->output_fd = -1;
 
-  PyGObject *pygobj = (PyGObject *)py_stream;
-  if (!pygobj->obj)
+  return (PyObject *)self;
+}
+
+static gboolean
+can_seek (gpointer stream)
+{
+  return G_IS_SEEKABLE (stream) && g_seekable_can_seek (G_SEEKABLE (stream));
+}
+
+/*
+ * Regular files behind GIO's local file and Unix streams are read, written
+ * and seeked with system calls on their descriptor, which is all those
+ * streams do underneath. Reads only take this path while the buffer of
+ * data_input is empty, and seeks drop the buffer, so GIO's view of the
+ * position stays that of the descriptor. Pipes, sockets and the like keep
+ * going through GIO, whose reads on them can be cancelled while blocked.
+ */
+static void
+setup_fds (StreamWrapper *self)
+{
+  if (self->input && G_IS_FILE_DESCRIPTOR_BASED (self->input))
     {
-      PyErr_SetString (PyExc_ValueError, "Invalid GObject pointer");
-      return -1;
+      int fd = g_file_descriptor_based_get_fd (
+          G_FILE_DESCRIPTOR_BASED (self->input));
+      if (fd_is_regular (fd))
+        self->input_fd = fd;
     }
-  GObject *gobj = pygobj->obj;
+  if (self->output && G_IS_FILE_DESCRIPTOR_BASED (self->output))
+    {
+      int fd = g_file_descriptor_based_get_fd (
+          G_FILE_DESCRIPTOR_BASED (self->output));
+      if (fd_is_regular (fd))
+        self->output_fd = fd;
+    }
+
+  // Both directions have to share the one position, and streams that
+  // couldn't seek before don't start to
+  self->fd_seekable
+      = (self->input_fd >= 0 || self->output_fd >= 0)
+        && (!self->input || (self->input_fd >= 0 && can_seek (self->input)))
+        && (!self->output
+            || (self->output_fd >= 0 && can_seek (self->output)))
+        && (!self->input || !self->output
+            || self->input_fd == self->output_fd);
+}
 
+/*
+ * Take references to the streams making up *gobj*. Shared by the constructor
+ * and the from_* class methods, which get the object without PyGObject.
+ */
+static int
+setup_stream (StreamWrapper *self, GObject *gobj)
+{
   // Determine stream type and take refs
   if (G_IS_INPUT_STREAM (gobj))
     {
@@ -74,42 +231,802 @@ StreamWrapper_init (StreamWrapper *self, PyObject *args, PyObject *kwds)
       g_object_ref (self->output);
     }
   else
-    goto typeerr;
+    {
+      PyErr_SetString (PyExc_TypeError, "expected a GIO stream object");
+      return -1;
+    }
 
   if (self->input)
     {
+      // Dealloc drops input and data_input separately, so both need a ref
       if (G_IS_DATA_INPUT_STREAM (self->input))
-        self->data_input = G_DATA_INPUT_STREAM (self->input);
+        self->data_input = g_object_ref (G_DATA_INPUT_STREAM (self->input));
       else
-        {
-          self->data_input = g_data_input_stream_new (self->input);
-          if (!self->data_input)
-            {
-              PyErr_SetString (PyExc_RuntimeError,
-                               "Failed to create GDataInputStream");
-              g_object_unref (self->input);
-              if (self->output)
-                g_object_unref (self->output);
-              if (self->io)
-                g_object_unref (self->io);
-            }
-        }
+        self->data_input = g_data_input_stream_new (self->input);
 
       g_data_input_stream_set_newline_type (self->data_input,
                                             G_DATA_STREAM_NEWLINE_TYPE_LF);
+
+      self->buffer_bytes = g_buffered_input_stream_get_buffer_size (
+          G_BUFFERED_INPUT_STREAM (self->data_input));
+      // Keyed by wrapper, wrappers may share a GDataInputStream
+      memtrack_track (&self->buffer_bytes, self->buffer_bytes);
+    }
+
+  setup_fds (self);
+  return 0;
+}
+
+static PyObject *err_gerror (StreamWrapper *self, GError **error,
+                             const char *fallback);
+
+/*
+ * Restrict a freshly set up wrapper to *length* bytes from *offset* of its
+ * input, -1 meaning up to EOF. Seekable inputs are moved to *offset*, others
+ * must already be positioned there.
+ */
+static int
+setup_bounds (StreamWrapper *self, long long offset, long long length)
+{
+  if (offset == 0 && length == -1)
+    return 0;
+
+  if (offset < 0 || length < -1)
+    {
+      PyErr_SetString (PyExc_ValueError, "invalid range");
+      return -1;
+    }
+
+  if (!self->input)
+    {
+      PyErr_SetString (PyExc_ValueError,
+                       "only readable streams can be bounded");
+      return -1;
+    }
+
+  if (g_seekable_can_seek (G_SEEKABLE (self->data_input)))
+    {
+      GError *error = NULL;
+      gboolean seeked;
+
+      Py_BEGIN_ALLOW_THREADS
+      seeked = g_seekable_seek (G_SEEKABLE (self->data_input), offset,
+                                G_SEEK_SET, NULL, &error);
+      Py_END_ALLOW_THREADS
+      if (!seeked)
+        {
+          err_gerror (self, &error, NULL);
+          return -1;
+        }
+    }
+
+  self->bounded = TRUE;
+  self->bound_start = offset;
+  self->bound_end = length < 0 ? -1 : offset + length;
+  self->position = offset;
+  return 0;
+}
+
+PyDoc_STRVAR (
+    StreamWrapper_timeout_doc,
+    "Timeout in seconds for each blocking operation, ``None`` for none.\n"
+    "\n"
+    "Operations still running when it expires are cancelled as if by\n"
+    ":meth:`cancel` and raise :exc:`TimeoutError`. Waiting for another\n"
+    "thread's operation on the wrapper to finish does not count.");
+static PyObject *
+StreamWrapper_get_timeout (StreamWrapper *self, void *closure)
+{
+  gint64 timeout = self->timeout;
+  if (timeout < 0)
+    Py_RETURN_NONE;
+  return PyFloat_FromDouble ((double)timeout / G_USEC_PER_SEC);
+}
+
+static int
+StreamWrapper_set_timeout (StreamWrapper *self, PyObject *value,
+                           void *closure)
+{
+  if (!value || value == Py_None)
+    {
+      self->timeout = -1;
+      return 0;
+    }
+
+  double seconds = PyFloat_AsDouble (value);
+  if (seconds == -1.0 && PyErr_Occurred ())
+    return -1;
+  if (!(seconds >= 0) || seconds * G_USEC_PER_SEC > G_MAXINT64)
+    {
+      PyErr_SetString (PyExc_ValueError, "invalid timeout");
+      return -1;
+    }
+
+  self->timeout = (gint64)(seconds * G_USEC_PER_SEC);
+  return 0;
+}
+
+PyDoc_STRVAR (
+    StreamWrapper_priority_doc,
+    "I/O priority of blocking operations, one of the ``GLib.PRIORITY_*``\n"
+    "values or any integer, lower being more urgent.\n"
+    "\n"
+    "On Linux the disk I/O done by the calling thread during an operation\n"
+    "is classed accordingly: ``GLib.PRIORITY_HIGH`` gets the highest\n"
+    "best-effort level, ``GLib.PRIORITY_DEFAULT`` leaves the thread alone\n"
+    "and ``GLib.PRIORITY_DEFAULT_IDLE`` and lower only get the disk when\n"
+    "nothing else wants it. Work the operation hands to I/O pool threads,\n"
+    "like the prefetch of :func:`concat` or the writes of :func:`tee`,\n"
+    "runs with it too. Only I/O schedulers honouring ioprio, like BFQ, act\n"
+    "on it.");
+static PyObject *
+StreamWrapper_get_priority (StreamWrapper *self, void *closure)
+{
+  return PyLong_FromLong (self->priority);
+}
+
+static int
+StreamWrapper_set_priority (StreamWrapper *self, PyObject *value,
+                            void *closure)
+{
+  if (!value)
+    {
+      self->priority = G_PRIORITY_DEFAULT;
+      return 0;
+    }
+
+  int overflow;
+  long priority = PyLong_AsLongAndOverflow (value, &overflow);
+  if (priority == -1 && PyErr_Occurred ())
+    return -1;
+  if (overflow || priority < G_MININT || priority > G_MAXINT)
+    {
+      PyErr_SetString (PyExc_OverflowError, "priority out of range");
+      return -1;
+    }
+
+  self->priority = (int)priority;
+  return 0;
+}
+
+PyDoc_STRVAR (StreamWrapper_limiter_doc,
+              "The :class:`Limiter` passed to the constructor, or ``None``.");
+static PyObject *
+StreamWrapper_get_limiter (StreamWrapper *self, void *closure)
+{
+  PyObject *limiter = self->limiter ? self->limiter : Py_None;
+  Py_INCREF (limiter);
+  return limiter;
+}
+
+static int
+StreamWrapper_init (StreamWrapper *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[]
+      = { "stream",  "file",      "offset", "length",  "timeout", "priority",
+          "limiter", "scheduler", "tenant", "retries", NULL };
+  PyObject *py_stream = NULL;
+  PyObject *py_file = Py_None;
+  long long offset = 0;
+  long long length = -1;
+  PyObject *py_timeout = Py_None;
+  int priority = G_PRIORITY_DEFAULT;
+  PyObject *py_limiter = Py_None;
+  PyObject *py_scheduler = Py_None;
+  const char *tenant = NULL;
+  unsigned int retries = 0;
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "O|$OLLOiOOzI", kwlist,
+                                    &py_stream, &py_file, &offset, &length,
+                                    &py_timeout, &priority, &py_limiter,
+                                    &py_scheduler, &tenant, &retries))
+    return -1;
+
+  if (self->input || self->output)
+    {
+      PyErr_SetString (PyExc_RuntimeError, "StreamWrapper already set up");
+      return -1;
+    }
+
+  ModuleState *state = get_module_state (Py_TYPE (self));
+  if (!state)
+    return -1;
+
+  if (py_limiter != Py_None
+      && !PyObject_TypeCheck (py_limiter,
+                              (PyTypeObject *)state->limiter_type))
+    {
+      PyErr_SetString (PyExc_TypeError, "expected a Limiter");
+      return -1;
+    }
+
+  if (py_scheduler != Py_None
+      && !PyObject_TypeCheck (py_scheduler,
+                              (PyTypeObject *)state->scheduler_type))
+    {
+      PyErr_SetString (PyExc_TypeError, "expected a Scheduler");
+      return -1;
+    }
+  if (tenant && py_scheduler == Py_None)
+    {
+      PyErr_SetString (PyExc_ValueError, "tenant needs a scheduler");
+      return -1;
+    }
+
+  PyObject *gobject_class = get_gobject_class (state);
+  if (!gobject_class)
+    return -1;
+
+  int is_instance = PyObject_IsInstance (py_stream, gobject_class);
+  if (is_instance < 0)
+    // Error during isinstance check
+    return -1;
+  if (!is_instance)
+    {
+      PyErr_SetString (PyExc_TypeError, "expected a GIO stream object");
+      return -1;
+    }
+
+  PyGObject *pygobj = (PyGObject *)py_stream;
+  if (!pygobj->obj)
+    {
+      PyErr_SetString (PyExc_ValueError, "Invalid GObject pointer");
+      return -1;
+    }
+
+  if (py_file != Py_None)
+    {
+      is_instance = PyObject_IsInstance (py_file, gobject_class);
+      if (is_instance < 0)
+        return -1;
+      if (!is_instance || !G_IS_FILE (((PyGObject *)py_file)->obj))
+        {
+          PyErr_SetString (PyExc_TypeError, "expected a Gio.File");
+          return -1;
+        }
+    }
+
+  GObject *gobj = g_object_ref (pygobj->obj);
+  if (retries > 0)
+    {
+      if (py_file == Py_None || !G_IS_INPUT_STREAM (gobj))
+        {
+          g_object_unref (gobj);
+          PyErr_SetString (PyExc_ValueError,
+                           "retries need an input stream and its file");
+          return -1;
+        }
+
+      GError *error = NULL;
+      GInputStream *resumable;
+      Py_BEGIN_ALLOW_THREADS
+      resumable = resume_input_stream_new (
+          G_FILE (((PyGObject *)py_file)->obj), G_INPUT_STREAM (gobj),
+          retries, NULL, &error);
+      Py_END_ALLOW_THREADS
+      g_object_unref (gobj);
+      if (!resumable)
+        {
+          err_gerror (self, &error, NULL);
+          return -1;
+        }
+      gobj = G_OBJECT (resumable);
+    }
+
+  int set_up = setup_stream (self, gobj);
+  g_object_unref (gobj);
+  if (set_up < 0)
+    return -1;
+
+  if (py_file != Py_None)
+    {
+      self->file = g_object_ref (G_FILE (((PyGObject *)py_file)->obj));
+      self->gate = backend_gate_for_file (self->file);
+    }
+
+  if (StreamWrapper_set_timeout (self, py_timeout, NULL) < 0)
+    return -1;
+  self->priority = priority;
+  if (py_limiter != Py_None)
+    {
+      Py_INCREF (py_limiter);
+      self->limiter = py_limiter;
+    }
+  if (py_scheduler != Py_None)
+    {
+      Py_INCREF (py_scheduler);
+      self->scheduler = py_scheduler;
+      self->tenant = scheduler_tenant (py_scheduler, tenant ? tenant : "");
+    }
+
+  return setup_bounds (self, offset, length);
+}
+
+/*
+ * Create a wrapper of type *cls* around *gobj* without going through
+ * __init__. Steals the caller's reference to *gobj*.
+ */
+static PyObject *
+wrapper_from_gobject (PyTypeObject *cls, GObject *gobj)
+{
+  // Only the constructor of SpooledStreamWrapper sets up a spool, the
+  // classmethods it inherits make plain wrappers
+  ModuleState *state = get_module_state (cls);
+  if (!state)
+    {
+      g_object_unref (gobj);
+      return NULL;
+    }
+  if (PyType_IsSubtype (cls,
+                        (PyTypeObject *)state->spooledstreamwrapper_type))
+    cls = (PyTypeObject *)state->streamwrapper_type;
+
+  StreamWrapper *self = (StreamWrapper *)StreamWrapper_new (cls, NULL, NULL);
+  if (self && setup_stream (self, gobj) < 0)
+    Py_CLEAR (self);
+
+  g_object_unref (gobj);
+  return (PyObject *)self;
+}
+
+PyDoc_STRVAR (
+    StreamWrapper_from_fd_doc,
+    "Wrap a file descriptor without going through PyGObject.\n"
+    "\n"
+    "The descriptor is read and written as a ``GUnixInputStream`` or\n"
+    "``GUnixOutputStream``, so it does not need to be seekable.\n"
+    "\n"
+    ":param int fd:\n"
+    "   The file descriptor to wrap.\n"
+    ":param str mode:\n"
+    "   One of 'r', 'w', 'a' or 'x', optionally followed by '+' to read\n"
+    "   and write. 'b' is accepted and ignored. Appending depends on the\n"
+    "   descriptor having been opened with ``O_APPEND``.\n"
+    ":param bool close_fd:\n"
+    "   Whether closing the wrapper closes *fd*. *fd* is left open if this\n"
+    "   raises.\n"
+    ":param int offset:\n"
+    "   Start of the byte range to restrict a readable wrapper to. *fd*\n"
+    "   is moved there first.\n"
+    ":param int length:\n"
+    "   Length of the range, -1 for everything after *offset*.\n"
+    ":rtype: StreamWrapper\n"
+    ":returns:\n"
+    "   A new wrapper around *fd*.\n"
+    ":raises ValueError:\n"
+    "   Invalid mode or range.\n"
+    ":raises OSError:\n"
+    "   *fd* is not an open file descriptor.");
+static PyObject *
+StreamWrapper_from_fd_impl (PyTypeObject *cls, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[]
+      = { "fd", "mode", "close_fd", "offset", "length", NULL };
+  int fd;
+  const char *mode = "r";
+  int close_fd = 1;
+  long long offset = 0;
+  long long length = -1;
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "i|sp$LL", kwlist, &fd,
+                                    &mode, &close_fd, &offset, &length))
+    return NULL;
+
+  gboolean reading = FALSE, writing = FALSE, updating = FALSE;
+  for (const char *c = mode; *c; c++)
+    {
+      switch (*c)
+        {
+        case 'r':
+          if (reading || writing)
+            goto invalid_mode;
+          reading = TRUE;
+          break;
+        case 'w':
+        case 'a':
+        case 'x':
+          if (reading || writing)
+            goto invalid_mode;
+          writing = TRUE;
+          break;
+        case '+':
+          if (updating)
+            goto invalid_mode;
+          updating = TRUE;
+          break;
+        case 'b':
+          break;
+        default:
+          goto invalid_mode;
+        }
+    }
+  if (!reading && !writing)
+    goto invalid_mode;
+
+  if (fd < 0 || fcntl (fd, F_GETFD) < 0)
+    {
+      errno = fd < 0 ? EBADF : errno;
+      return PyErr_SetFromErrno (PyExc_OSError);
+    }
+
+  // Checked up front, failures must leave the descriptor to the caller
+  gboolean bounded = offset != 0 || length != -1;
+  if (bounded && (offset < 0 || length < -1))
+    {
+      PyErr_SetString (PyExc_ValueError, "invalid range");
+      return NULL;
+    }
+  if (bounded && !reading && !updating)
+    {
+      PyErr_SetString (PyExc_ValueError,
+                       "only readable streams can be bounded");
+      return NULL;
+    }
+
+  // GUnix streams can't seek, position the descriptor for setup_bounds()
+  if (bounded && lseek (fd, offset, SEEK_SET) < 0)
+    return PyErr_SetFromErrno (PyExc_OSError);
+
+  // The streams only take the descriptor over once the wrapper is set up
+  GInputStream *input = NULL;
+  GOutputStream *output = NULL;
+  if (reading || updating)
+    input = g_unix_input_stream_new (fd, FALSE);
+  if (writing || updating)
+    output = g_unix_output_stream_new (fd, FALSE);
+
+  GObject *gobj;
+  if (input && output)
+    gobj = G_OBJECT (g_simple_io_stream_new (input, output));
+  else
+    gobj = g_object_ref (input ? G_OBJECT (input) : G_OBJECT (output));
+
+  PyObject *self = wrapper_from_gobject (cls, gobj);
+  if (self && setup_bounds ((StreamWrapper *)self, offset, length) < 0)
+    Py_CLEAR (self);
+
+  // Only the input stream owns the descriptor where there are both, as
+  // GIOStream closes the output stream first
+  if (self && close_fd && input)
+    g_unix_input_stream_set_close_fd (G_UNIX_INPUT_STREAM (input), TRUE);
+  else if (self && close_fd)
+    g_unix_output_stream_set_close_fd (G_UNIX_OUTPUT_STREAM (output), TRUE);
+  g_clear_object (&input);
+  g_clear_object (&output);
+  return self;
+
+invalid_mode:
+  PyErr_Format (PyExc_ValueError, "invalid mode: '%s'", mode);
+  return NULL;
+}
+
+PyDoc_STRVAR (
+    StreamWrapper_from_capsule_doc,
+    "Wrap a stream handed over by another C extension.\n"
+    "\n"
+    "This skips PyGObject entirely.\n"
+    "\n"
+    ":param capsule:\n"
+    "   A :c:type:`PyCapsule` holding a ``GInputStream*``,\n"
+    "   ``GOutputStream*`` or ``GIOStream*``, either unnamed like the\n"
+    "   ``__gpointer__`` of PyGObject objects or named\n"
+    "   ``\"gio_pyio.stream\"``. The wrapper takes its own reference.\n"
+    ":rtype: StreamWrapper\n"
+    ":returns:\n"
+    "   A new wrapper around the stream.\n"
+    ":raises TypeError:\n"
+    "   The capsule has another name or does not hold a GIO stream.");
+static PyObject *
+StreamWrapper_from_capsule_impl (PyTypeObject *cls, PyObject *capsule)
+{
+  if (!PyCapsule_CheckExact (capsule))
+    {
+      PyErr_SetString (PyExc_TypeError, "expected a capsule");
+      return NULL;
+    }
+
+  // Any other capsule may hold something G_IS_OBJECT() can't look into
+  const char *name = PyCapsule_GetName (capsule);
+  if (name && strcmp (name, "gio_pyio.stream") != 0)
+    {
+      PyErr_Format (PyExc_TypeError, "unexpected capsule name '%s'", name);
+      return NULL;
+    }
+
+  gpointer pointer = PyCapsule_GetPointer (capsule, name);
+  if (!pointer)
+    return NULL;
+
+  if (!G_IS_OBJECT (pointer))
+    {
+      PyErr_SetString (PyExc_TypeError, "expected a GIO stream object");
+      return NULL;
     }
 
+  return wrapper_from_gobject (cls, g_object_ref (G_OBJECT (pointer)));
+}
+
+PyDoc_STRVAR (
+    StreamWrapper_concat_doc,
+    "Read several files or streams one after another as a single stream.\n"
+    "\n"
+    "The result is a read-only :class:`StreamWrapper` that can seek across\n"
+    "segments. Sizes are queried up front and kept in an index mapping\n"
+    "offsets to segments. Files are only opened when they are first read,\n"
+    "and the next file is opened in the background while the current one\n"
+    "is read, see :func:`set_io_pool`. At most one file is open at a time,\n"
+    "streams passed in stay open until the wrapper is closed.\n"
+    "\n"
+    ":param segments:\n"
+    "   Sequence of :class:`Gio.File` and :class:`Gio.InputStream`\n"
+    "   objects. Streams are read from their current position. Seeking is\n"
+    "   limited to the segments before a stream that can't seek or a file\n"
+    "   whose size is unknown, until it has been read to the end.\n"
+    ":rtype: StreamWrapper\n"
+    ":returns:\n"
+    "   A new wrapper over the concatenation.\n"
+    ":raises TypeError:\n"
+    "   A segment is neither a file nor an input stream.\n"
+    ":raises OSError:\n"
+    "   The size of a segment could not be queried.");
+static PyObject *
+StreamWrapper_concat_impl (PyTypeObject *cls, PyObject *py_segments)
+{
+  ModuleState *state = get_module_state (cls);
+  if (!state)
+    return NULL;
+
+  PyObject *gobject_class = get_gobject_class (state);
+  if (!gobject_class)
+    return NULL;
+
+  PyObject *seq = PySequence_Fast (py_segments, "expected a sequence");
+  if (!seq)
+    return NULL;
+
+  Py_ssize_t n_segments = PySequence_Fast_GET_SIZE (seq);
+  GObject **segments = g_new0 (GObject *, MAX (n_segments, 1));
+  for (Py_ssize_t i = 0; i < n_segments; i++)
+    {
+      PyObject *item = PySequence_Fast_GET_ITEM (seq, i);
+      int is_instance = PyObject_IsInstance (item, gobject_class);
+      if (is_instance < 0)
+        goto error;
+
+      GObject *gobj = is_instance ? ((PyGObject *)item)->obj : NULL;
+      if (!gobj || !(G_IS_FILE (gobj) || G_IS_INPUT_STREAM (gobj)))
+        {
+          PyErr_Format (PyExc_TypeError,
+                        "segment %zd is neither a Gio.File nor a "
+                        "Gio.InputStream",
+                        i);
+          goto error;
+        }
+      segments[i] = gobj;
+    }
+
+  GError *error = NULL;
+  GInputStream *stream;
+
+  // Querying the sizes may go over the network
+  Py_BEGIN_ALLOW_THREADS
+  stream = concat_input_stream_new (segments, n_segments, NULL, &error);
+  Py_END_ALLOW_THREADS
+  g_free (segments);
+  Py_DECREF (seq);
+  if (!stream)
+    return err_gerror (NULL, &error, NULL);
+
+  return wrapper_from_gobject (cls, G_OBJECT (stream));
+
+error:
+  g_free (segments);
+  Py_DECREF (seq);
+  return NULL;
+}
+
+PyDoc_STRVAR (
+    StreamWrapper_tee_doc,
+    "Write to several streams at once.\n"
+    "\n"
+    "The result is a write-only :class:`StreamWrapper`. Every buffer\n"
+    "written to it is passed to all destinations without copying and\n"
+    "written to them in parallel on the default I/O pool, see\n"
+    ":func:`set_io_pool`. Writes return once every destination has taken\n"
+    "the whole buffer, so the slowest destination sets the pace. Closing\n"
+    "the wrapper closes all destinations.\n"
+    "\n"
+    ":param outputs:\n"
+    "   Sequence of :class:`Gio.OutputStream` objects, or\n"
+    "   :class:`Gio.IOStream` objects to write to their output stream.\n"
+    ":rtype: StreamWrapper\n"
+    ":returns:\n"
+    "   A new wrapper writing to all of *outputs*.\n"
+    ":raises TypeError:\n"
+    "   An item of *outputs* is not an output stream.");
+static PyObject *
+StreamWrapper_tee_impl (PyTypeObject *cls, PyObject *py_outputs)
+{
+  ModuleState *state = get_module_state (cls);
+  if (!state)
+    return NULL;
+
+  PyObject *gobject_class = get_gobject_class (state);
+  if (!gobject_class)
+    return NULL;
+
+  PyObject *seq = PySequence_Fast (py_outputs, "expected a sequence");
+  if (!seq)
+    return NULL;
+
+  Py_ssize_t n_outputs = PySequence_Fast_GET_SIZE (seq);
+  GOutputStream **outputs = g_new0 (GOutputStream *, MAX (n_outputs, 1));
+  for (Py_ssize_t i = 0; i < n_outputs; i++)
+    {
+      PyObject *item = PySequence_Fast_GET_ITEM (seq, i);
+      int is_instance = PyObject_IsInstance (item, gobject_class);
+      if (is_instance < 0)
+        goto error;
+
+      GObject *gobj = is_instance ? ((PyGObject *)item)->obj : NULL;
+      if (gobj && G_IS_IO_STREAM (gobj))
+        outputs[i] = g_io_stream_get_output_stream (G_IO_STREAM (gobj));
+      else if (gobj && G_IS_OUTPUT_STREAM (gobj))
+        outputs[i] = G_OUTPUT_STREAM (gobj);
+      else
+        {
+          PyErr_Format (PyExc_TypeError,
+                        "output %zd is not a Gio.OutputStream", i);
+          goto error;
+        }
+    }
+
+  GOutputStream *stream = tee_output_stream_new (outputs, n_outputs);
+  g_free (outputs);
+  Py_DECREF (seq);
+
+  return wrapper_from_gobject (cls, G_OBJECT (stream));
+
+error:
+  g_free (outputs);
+  Py_DECREF (seq);
+  return NULL;
+}
+
+/*
+ * The GIL is released around blocking GIO calls, and free-threaded builds
+ * have no GIL at all, so operations on a wrapper are serialised by its own
+ * locks instead. Reads and writes only take the lock of their direction, so
+ * both can run at once on a GIOStream. Operations touching the shared
+ * position or the stream's lifetime take both, input first. A thread already
+ * holding either lock is refused, as waiting for the other could deadlock
+ * against an operation taking both.
+ *
+ * An uncontended lock is taken without releasing the GIL. Otherwise it is
+ * waited for with the GIL released, as its holder may need the GIL to finish.
+ *
+ * GIO calls made under a lock are passed its cancellable, operations taking
+ * both use the input's. The operation's deadline is armed on the same lock
+ * once it is held. A cancellation outlives neither: the cancellable is reset
+ * on unlock, so cancel() affects the operation in progress, or the next one
+ * if the wrapper is idle.
+ */
+static void
+direction_lock (DirectionLock *lock, gpointer thread)
+{
+  if (!PyThread_acquire_lock (lock->lock, NOWAIT_LOCK))
+    {
+      Py_BEGIN_ALLOW_THREADS
+      PyThread_acquire_lock (lock->lock, WAIT_LOCK);
+      Py_END_ALLOW_THREADS
+    }
+  g_atomic_pointer_set (&lock->owner, thread);
+}
+
+static void
+direction_unlock (DirectionLock *lock)
+{
+  deadline_disarm (&lock->deadline);
+  io_priority_pop (lock->saved_ioprio);
+  lock->saved_ioprio = -1;
+  if (g_cancellable_is_cancelled (lock->cancellable))
+    g_cancellable_reset (lock->cancellable);
+  g_atomic_pointer_set (&lock->owner, NULL);
+  PyThread_release_lock (lock->lock);
+}
+
+static int
+wrapper_lock (StreamWrapper *self, LockDirection direction)
+{
+  gpointer thread = (gpointer)(guintptr)PyThread_get_thread_ident ();
+
+  // Check both before blocking on either
+  if (g_atomic_pointer_get (&self->input_lock.owner) == thread
+      || g_atomic_pointer_get (&self->output_lock.owner) == thread)
+    {
+      PyErr_Format (PyExc_RuntimeError, "reentrant call inside %R", self);
+      return -1;
+    }
+
+  if (direction & LOCK_INPUT)
+    direction_lock (&self->input_lock, thread);
+  if (direction & LOCK_OUTPUT)
+    direction_lock (&self->output_lock, thread);
+
+  // The operation's settings go on one of the locks, undone with it
+  DirectionLock *lock
+      = (direction & LOCK_INPUT) ? &self->input_lock : &self->output_lock;
+  gint64 timeout = self->timeout;
+  if (timeout >= 0)
+    deadline_arm (&lock->deadline, lock->cancellable, timeout);
+  // Spare the syscalls in the common case
+  int priority = self->priority;
+  if (priority != G_PRIORITY_DEFAULT)
+    lock->saved_ioprio = io_priority_push (priority);
   return 0;
+}
+
+static void
+wrapper_unlock (StreamWrapper *self, LockDirection direction)
+{
+  if (direction & LOCK_OUTPUT)
+    direction_unlock (&self->output_lock);
+  if (direction & LOCK_INPUT)
+    direction_unlock (&self->input_lock);
+}
+
+static void
+scratch_acquire (StreamWrapper *self, gsize size)
+{
+  self->scratch_bytes += size;
+  if (self->scratch_bytes > self->peak_scratch_bytes)
+    self->peak_scratch_bytes = self->scratch_bytes;
+}
+
+static void
+scratch_release (StreamWrapper *self, gsize size)
+{
+  self->scratch_bytes -= size;
+}
 
-typeerr:
-  PyErr_SetString (PyExc_TypeError, "expected a GIO stream object");
-  return -1;
+static PyObject *
+err_unsupported (StreamWrapper *self, const char *message)
+{
+  ModuleState *state = get_module_state (Py_TYPE (self));
+  if (state)
+    PyErr_SetString (state->unsupported_operation, message);
+  return NULL;
 }
 
+/*
+ * Raise *error* and clear it. Cancelled operations raise TimeoutError if
+ * their deadline expired and InterruptedError otherwise. *self* is NULL for
+ * operations not bound to a wrapper, which have no deadline.
+ */
 static PyObject *
-err_unsupported (char *method)
+err_gerror (StreamWrapper *self, GError **error, const char *fallback)
 {
-  PyErr_SetString (UnsupportedOperation, method);
+  PyObject *type = PyExc_IOError;
+
+  if (g_error_matches (*error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT))
+    type = PyExc_TimeoutError;
+  else if (g_error_matches (*error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      type = PyExc_InterruptedError;
+      if (self)
+        {
+          // The lock held by this thread, whose deadline the operation used
+          gpointer thread = (gpointer)(guintptr)PyThread_get_thread_ident ();
+          DirectionLock *lock
+              = g_atomic_pointer_get (&self->input_lock.owner) == thread
+                    ? &self->input_lock
+                    : &self->output_lock;
+          if (deadline_fired (&lock->deadline))
+            type = PyExc_TimeoutError;
+        }
+    }
+
+  PyErr_SetString (type, *error ? (*error)->message : fallback);
+  g_clear_error (error);
   return NULL;
 }
 
@@ -128,10 +1045,9 @@ is_closed (StreamWrapper *self)
 }
 
 static PyObject *
-err_closed (void)
+err_closed (StreamWrapper *self)
 {
-  PyErr_SetString (UnsupportedOperation, "I/O operation on closed file");
-  return NULL;
+  return err_unsupported (self, "I/O operation on closed file");
 }
 
 PyDoc_STRVAR (StreamWrapper_get_closed_doc,
@@ -149,13 +1065,17 @@ static gboolean
 close_wrapper (StreamWrapper *self)
 {
   GError *error = NULL;
+  gboolean closed;
 
   if (self->io)
     {
-      if (!g_io_stream_close (self->io, NULL, &error))
+      Py_BEGIN_ALLOW_THREADS
+      closed = g_io_stream_close (self->io, self->input_lock.cancellable,
+                                  &error);
+      Py_END_ALLOW_THREADS
+      if (!closed)
         {
-          PyErr_SetString (PyExc_IOError, error->message);
-          g_error_free (error);
+          err_gerror (self, &error, NULL);
           return FALSE;
         }
       return TRUE;
@@ -163,20 +1083,26 @@ close_wrapper (StreamWrapper *self)
 
   if (self->input)
     {
-      if (!g_input_stream_close (self->input, NULL, &error))
+      Py_BEGIN_ALLOW_THREADS
+      closed = g_input_stream_close (self->input, self->input_lock.cancellable,
+                                     &error);
+      Py_END_ALLOW_THREADS
+      if (!closed)
         {
-          PyErr_SetString (PyExc_IOError, error->message);
-          g_error_free (error);
+          err_gerror (self, &error, NULL);
           return FALSE;
         }
     }
 
   if (self->output)
     {
-      if (!g_output_stream_close (self->output, NULL, &error))
+      Py_BEGIN_ALLOW_THREADS
+      closed = g_output_stream_close (self->output,
+                                      self->input_lock.cancellable, &error);
+      Py_END_ALLOW_THREADS
+      if (!closed)
         {
-          PyErr_SetString (PyExc_IOError, error->message);
-          g_error_free (error);
+          err_gerror (self, &error, NULL);
           return FALSE;
         }
     }
@@ -196,15 +1122,34 @@ PyDoc_STRVAR (
 static PyObject *
 StreamWrapper_close_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
 {
-  if (is_closed (self))
-    Py_RETURN_NONE;
+  if (wrapper_lock (self, LOCK_ALL) < 0)
+    return NULL;
 
-  if (!close_wrapper (self))
+  gboolean closed = is_closed (self) || close_wrapper (self);
+  wrapper_unlock (self, LOCK_ALL);
+  if (!closed)
     return NULL;
 
   Py_RETURN_NONE;
 }
 
+PyDoc_STRVAR (
+    StreamWrapper_cancel_doc,
+    "Cancel the blocking operations in progress.\n"
+    "\n"
+    "Cancelled operations raise :exc:`InterruptedError`. If none is in\n"
+    "progress, the next operation is cancelled instead. Unlike all other\n"
+    "methods this does not wait for running operations, so it can be\n"
+    "called from another thread, or from a signal handler while the\n"
+    "operation runs in another thread.");
+static PyObject *
+StreamWrapper_cancel_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
+{
+  g_cancellable_cancel (self->input_lock.cancellable);
+  g_cancellable_cancel (self->output_lock.cancellable);
+  Py_RETURN_NONE;
+}
+
 static gboolean
 is_readable (StreamWrapper *self)
 {
@@ -212,10 +1157,9 @@ is_readable (StreamWrapper *self)
 }
 
 static PyObject *
-err_not_readable (void)
+err_not_readable (StreamWrapper *self)
 {
-  PyErr_SetString (UnsupportedOperation, "Stream is not readable");
-  return NULL;
+  return err_unsupported (self, "Stream is not readable");
 }
 
 PyDoc_STRVAR (StreamWrapper_readable_doc,
@@ -234,32 +1178,204 @@ StreamWrapper_readable_impl (StreamWrapper *self,
     Py_RETURN_FALSE;
 }
 
+static gsize
+bound_remaining (StreamWrapper *self)
+{
+  if (!self->bounded || self->bound_end < 0)
+    return G_MAXSIZE;
+  return self->bound_end > self->position
+             ? (gsize)(self->bound_end - self->position)
+             : 0;
+}
+
+/*
+ * Largest transfer the wrapper's limiter and scheduler allow at once.
+ */
+static gsize
+transfer_max_chunk (StreamWrapper *self)
+{
+  gsize max_chunk = G_MAXSIZE;
+
+  if (self->limiter)
+    max_chunk = limiter_max_chunk (self->limiter);
+  if (self->scheduler)
+    max_chunk = MIN (max_chunk, scheduler_quantum (self->scheduler));
+  return max_chunk;
+}
+
+/*
+ * Wait, without the GIL, for the wrapper's scheduler and limiter to let a
+ * transfer of up to *count* bytes start, then for a slot of its backend.
+ * The slot is only held for the transfer itself, never while Python code
+ * runs, which could wait on another wrapper queued for the same slot. Each
+ * successful call must be followed by transfer_end().
+ */
+static gboolean
+transfer_begin (StreamWrapper *self, gsize count, GCancellable *cancellable,
+                GError **error)
+{
+  if (self->scheduler
+      && !scheduler_acquire (self->scheduler, self->tenant, self->priority,
+                             count, cancellable, error))
+    return FALSE;
+
+  if ((self->limiter && !limiter_acquire (self->limiter, cancellable, error))
+      || (self->gate && !backend_gate_try_enter (self->gate)
+          && !backend_gate_enter (self->gate, cancellable, error)))
+    {
+      if (self->scheduler)
+        scheduler_release (self->scheduler, self->tenant, 0);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static void
+transfer_end (StreamWrapper *self, gsize transferred)
+{
+  if (self->limiter)
+    limiter_consume (self->limiter, transferred);
+  if (self->gate)
+    {
+      backend_gate_consume (self->gate, transferred);
+      backend_gate_leave (self->gate);
+    }
+  if (self->scheduler)
+    scheduler_release (self->scheduler, self->tenant, transferred);
+}
+
+// Bytes read ahead into the buffer of data_input
+static gsize
+buffered (StreamWrapper *self)
+{
+  return g_buffered_input_stream_get_available (
+      G_BUFFERED_INPUT_STREAM (self->data_input));
+}
+
+/*
+ * Read from the input with the GIL released, without crossing the end of the
+ * wrapper's range.
+ */
+static gssize
+read_raw (StreamWrapper *self, void *buffer, gsize count, GError **error)
+{
+  count = MIN (count, bound_remaining (self));
+  if (count == 0)
+    return 0;
+
+  count = MIN (count, transfer_max_chunk (self));
+
+  gssize n = -1;
+  Py_BEGIN_ALLOW_THREADS
+  if (transfer_begin (self, count, self->input_lock.cancellable, error))
+    {
+      if (self->input_fd >= 0 && buffered (self) == 0)
+        n = fd_read (self->input_fd, buffer, count,
+                     self->input_lock.cancellable, error);
+      else
+        n = g_input_stream_read (G_INPUT_STREAM (self->data_input), buffer,
+                                 count, self->input_lock.cancellable, error);
+      transfer_end (self, MAX (n, 0));
+    }
+  Py_END_ALLOW_THREADS
+  if (n > 0 && self->bounded)
+    self->position += n;
+  return n;
+}
+
+/*
+ * Read until EOF into a growing buffer, for streams whose size can't be
+ * found by seeking to their end, like pipes.
+ */
+static PyObject *
+read_chunks_until_eof (StreamWrapper *self)
+{
+  Py_ssize_t capacity = DEFAULT_BUF_SIZE;
+  PyObject *bytearray = PyByteArray_FromStringAndSize (NULL, capacity);
+  if (!bytearray)
+    return NULL;
+  scratch_acquire (self, capacity);
+
+  Py_ssize_t total = 0;
+  for (;;)
+    {
+      if (total == capacity)
+        {
+          Py_ssize_t new_capacity = capacity * 2;
+          if (PyByteArray_Resize (bytearray, new_capacity) < 0)
+            {
+              scratch_release (self, capacity);
+              Py_DECREF (bytearray);
+              return NULL;
+            }
+          scratch_acquire (self, new_capacity - capacity);
+          capacity = new_capacity;
+        }
+
+      GError *error = NULL;
+      gssize n = read_raw (self, PyByteArray_AS_STRING (bytearray) + total,
+                           capacity - total, &error);
+      if (n < 0)
+        {
+          err_gerror (self, &error, "Read error");
+          scratch_release (self, capacity);
+          Py_DECREF (bytearray);
+          return NULL;
+        }
+      if (n == 0)
+        break;
+      total += n;
+    }
+
+  PyObject *result
+      = PyBytes_FromStringAndSize (PyByteArray_AS_STRING (bytearray), total);
+  scratch_release (self, capacity);
+  Py_DECREF (bytearray);
+  return result;
+}
+
 static PyObject *
 read_until_eof (StreamWrapper *self)
 {
   GError *error = NULL;
+  gboolean seeked;
+  goffset size;
+
+  if (self->bounded && self->bound_end >= 0)
+    {
+      size = bound_remaining (self);
+      goto allocate;
+    }
+
+  if (!can_seek (self->input))
+    return read_chunks_until_eof (self);
 
   /* get current and end position */
   goffset pos = g_seekable_tell (G_SEEKABLE (self->data_input));
-  if (!g_seekable_seek (G_SEEKABLE (self->data_input), 0, G_SEEK_END, NULL,
-                        &error))
+  Py_BEGIN_ALLOW_THREADS
+  seeked = g_seekable_seek (G_SEEKABLE (self->data_input), 0, G_SEEK_END,
+                            self->input_lock.cancellable, &error);
+  Py_END_ALLOW_THREADS
+  if (!seeked)
     {
-      PyErr_SetString (PyExc_IOError, error ? error->message : "Seek error");
-      g_clear_error (&error);
+      err_gerror (self, &error, "Seek error");
       return NULL;
     }
 
   goffset end = g_seekable_tell (G_SEEKABLE (self->data_input));
-  goffset size = end - pos;
+  size = end - pos;
 
-  if (!g_seekable_seek (G_SEEKABLE (self->data_input), pos, G_SEEK_SET, NULL,
-                        &error))
+  Py_BEGIN_ALLOW_THREADS
+  seeked = g_seekable_seek (G_SEEKABLE (self->data_input), pos, G_SEEK_SET,
+                            self->input_lock.cancellable, &error);
+  Py_END_ALLOW_THREADS
+  if (!seeked)
     {
-      PyErr_SetString (PyExc_IOError, error ? error->message : "Seek error");
-      g_clear_error (&error);
+      err_gerror (self, &error, "Seek error");
       return NULL;
     }
 
+allocate:
   if (size == 0)
     return PyBytes_FromStringAndSize ("", 0);
 
@@ -279,62 +1395,35 @@ read_until_eof (StreamWrapper *self)
 
   while (total < size)
     {
-      gssize n
-          = g_input_stream_read (G_INPUT_STREAM (self->data_input),
-                                 dest + total, size - total, NULL, &error);
+      gssize n = read_raw (self, dest + total, size - total, &error);
       if (n < 0)
-        {
-          PyErr_SetString (PyExc_IOError,
-                           error ? error->message : "Read error");
-          g_clear_error (&error);
-          Py_DECREF (result);
-          return NULL;
-        }
-      if (n == 0)
-        break; /* EOF before expected */
-      total += n;
-    }
-
-  if (total == size)
-    return result;
-
-  /* EOF before expected */
-  PyObject *trimmed = PyBytes_FromStringAndSize (dest, total);
-  Py_DECREF (result);
-  return trimmed;
-}
-
-PyDoc_STRVAR (
-    StreamWrapper_read_doc,
-    "Read up to *size* bytes from the underlying stream and return them.\n"
-    "\n"
-    "As a convenience if *size* is unspecified or -1, all bytes until EOF\n"
-    "are returned. The result may be fewer bytes than requested, if EOF is\n"
-    "reached.\n"
-    "\n"
-    ":param int size:\n"
-    "   The amount of bytes to read from the underlying stream."
-    ":rtype: bytes\n"
-    ":returns:\n"
-    "   Bytes read from the underlying stream.\n"
-    ":raises ValueError:\n"
-    "   If the underlying stream is closed.\n"
-    ":raises io.UnsupportedOperationException:\n"
-    "   If the underlying stream is not readable.");
-static PyObject *
-StreamWrapper_read_impl (StreamWrapper *self, PyObject *args, PyObject *kwds)
-{
-  static char *kwlist[] = { "size", NULL };
-  Py_ssize_t size = -1;
+        {
+          err_gerror (self, &error, "Read error");
+          Py_DECREF (result);
+          return NULL;
+        }
+      if (n == 0)
+        break; /* EOF before expected */
+      total += n;
+    }
 
-  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|n", kwlist, &size))
-    return NULL;
+  if (total == size)
+    return result;
+
+  /* EOF before expected */
+  PyObject *trimmed = PyBytes_FromStringAndSize (dest, total);
+  Py_DECREF (result);
+  return trimmed;
+}
 
+static PyObject *
+read_locked (StreamWrapper *self, Py_ssize_t size)
+{
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_readable (self))
-    return err_not_readable ();
+    return err_not_readable (self);
 
   if (size == 0)
     return PyBytes_FromStringAndSize ("", 0);
@@ -348,6 +1437,7 @@ StreamWrapper_read_impl (StreamWrapper *self, PyObject *args, PyObject *kwds)
   PyObject *bytearray = PyByteArray_FromStringAndSize (NULL, capacity);
   if (!bytearray)
     return NULL;
+  scratch_acquire (self, capacity);
 
   char *buffer = PyByteArray_AS_STRING (bytearray);
   Py_ssize_t total_read = 0;
@@ -359,10 +1449,12 @@ StreamWrapper_read_impl (StreamWrapper *self, PyObject *args, PyObject *kwds)
           Py_ssize_t new_capacity = capacity * 2;
           if (PyByteArray_Resize (bytearray, new_capacity) < 0)
             {
+              scratch_release (self, capacity);
               Py_DECREF (bytearray);
               return NULL;
             }
           buffer = PyByteArray_AS_STRING (bytearray);
+          scratch_acquire (self, new_capacity - capacity);
           capacity = new_capacity;
         }
 
@@ -370,12 +1462,12 @@ StreamWrapper_read_impl (StreamWrapper *self, PyObject *args, PyObject *kwds)
       if (to_read > (size - total_read))
         to_read = size - total_read;
 
-      gssize n
-          = g_input_stream_read (G_INPUT_STREAM (self->data_input),
-                                 buffer + total_read, to_read, NULL, NULL);
+      GError *error = NULL;
+      gssize n = read_raw (self, buffer + total_read, to_read, &error);
       if (n < 0)
         {
-          PyErr_SetString (PyExc_IOError, "Read error");
+          err_gerror (self, &error, "Read error");
+          scratch_release (self, capacity);
           Py_DECREF (bytearray);
           return NULL;
         }
@@ -390,6 +1482,7 @@ StreamWrapper_read_impl (StreamWrapper *self, PyObject *args, PyObject *kwds)
     {
       if (PyByteArray_Resize (bytearray, total_read) < 0)
         {
+          scratch_release (self, capacity);
           Py_DECREF (bytearray);
           return NULL;
         }
@@ -398,10 +1491,57 @@ StreamWrapper_read_impl (StreamWrapper *self, PyObject *args, PyObject *kwds)
   // Convert to immutable bytes object
   PyObject *result = PyBytes_FromStringAndSize (
       PyByteArray_AS_STRING (bytearray), total_read);
+  scratch_release (self, capacity);
   Py_DECREF (bytearray);
   return result;
 }
 
+PyDoc_STRVAR (
+    StreamWrapper_read_doc,
+    "Read up to *size* bytes from the underlying stream and return them.\n"
+    "\n"
+    "As a convenience if *size* is unspecified or -1, all bytes until EOF\n"
+    "are returned. The result may be fewer bytes than requested, if EOF is\n"
+    "reached.\n"
+    "\n"
+    ":param int size:\n"
+    "   The amount of bytes to read from the underlying stream."
+    ":rtype: bytes\n"
+    ":returns:\n"
+    "   Bytes read from the underlying stream.\n"
+    ":raises ValueError:\n"
+    "   If the underlying stream is closed.\n"
+    ":raises io.UnsupportedOperationException:\n"
+    "   If the underlying stream is not readable.");
+static PyObject *
+StreamWrapper_read_impl (StreamWrapper *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = { "size", NULL };
+  Py_ssize_t size = -1;
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|n", kwlist, &size))
+    return NULL;
+
+  if (wrapper_lock (self, LOCK_INPUT) < 0)
+    return NULL;
+
+  PyObject *result = read_locked (self, size);
+  wrapper_unlock (self, LOCK_INPUT);
+  return result;
+}
+
+static PyObject *
+readall_locked (StreamWrapper *self)
+{
+  if (is_closed (self))
+    return err_closed (self);
+
+  if (!is_readable (self))
+    return err_not_readable (self);
+
+  return read_until_eof (self);
+}
+
 PyDoc_STRVAR (StreamWrapper_readall_doc,
               "Read and return all the bytes from the stream until EOF\n"
               "\n"
@@ -414,14 +1554,41 @@ PyDoc_STRVAR (StreamWrapper_readall_doc,
               "   If the underlying stream is not readable.");
 static PyObject *
 StreamWrapper_readall_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
+{
+  if (wrapper_lock (self, LOCK_INPUT) < 0)
+    return NULL;
+
+  PyObject *result = readall_locked (self);
+  wrapper_unlock (self, LOCK_INPUT);
+  return result;
+}
+
+static PyObject *
+readinto_locked (StreamWrapper *self, PyObject *buffer_obj)
 {
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_readable (self))
-    return err_not_readable ();
+    return err_not_readable (self);
 
-  return read_until_eof (self);
+  Py_buffer view;
+  if (PyObject_GetBuffer (buffer_obj, &view, PyBUF_WRITABLE) == -1)
+    return NULL; // not writable
+
+  GError *error = NULL;
+  gssize n_read = read_raw (self, view.buf, (gsize)view.len, &error);
+
+  if (n_read < 0)
+    {
+      PyBuffer_Release (&view);
+      err_gerror (self, &error, "Read error");
+      return NULL;
+    }
+
+  PyBuffer_Release (&view);
+
+  return PyLong_FromSsize_t (n_read);
 }
 
 PyDoc_STRVAR (
@@ -448,57 +1615,387 @@ StreamWrapper_readinto_impl (StreamWrapper *self, PyObject *args)
   if (!PyArg_ParseTuple (args, "O", &buffer_obj))
     return NULL;
 
+  if (wrapper_lock (self, LOCK_INPUT) < 0)
+    return NULL;
+
+  PyObject *result = readinto_locked (self, buffer_obj);
+  wrapper_unlock (self, LOCK_INPUT);
+  return result;
+}
+
+static PyObject *err_not_seekable (StreamWrapper *self);
+
+/*
+ * Drop the first *count* bytes from the vectors at *iov*, skipping those
+ * filled completely.
+ */
+static void
+iov_advance (struct iovec **iov, int *n_iov, gsize count)
+{
+  while (*n_iov > 0 && count >= (*iov)->iov_len)
+    {
+      count -= (*iov)->iov_len;
+      (*iov)++;
+      (*n_iov)--;
+    }
+  if (*n_iov > 0)
+    {
+      (*iov)->iov_base = (char *)(*iov)->iov_base + count;
+      (*iov)->iov_len -= count;
+    }
+}
+
+// Read into the vectors one by one, stopping at the first short read
+static gssize
+read_vectors (StreamWrapper *self, const struct iovec *iov, int n_iov,
+              GError **error)
+{
+  gssize total = 0;
+
+  for (int i = 0; i < n_iov; i++)
+    {
+      gssize n = g_input_stream_read (G_INPUT_STREAM (self->data_input),
+                                      iov[i].iov_base, iov[i].iov_len,
+                                      self->input_lock.cancellable, error);
+      if (n < 0)
+        {
+          // Report what was read, the error comes again on the next read
+          if (total > 0)
+            g_clear_error (error);
+          return total > 0 ? total : -1;
+        }
+      total += n;
+      if ((gsize)n < iov[i].iov_len)
+        break;
+    }
+  return total;
+}
+
+/*
+ * Read into the vectors at *iov* with the GIL released, like read_raw().
+ * Positional reads start at the absolute offset *at* without moving the
+ * stream where it is based on a descriptor, otherwise the caller has to
+ * position the stream first.
+ */
+static gssize
+read_vectors_raw (StreamWrapper *self, struct iovec *iov, int n_iov,
+                  gboolean positional, goffset at, GError **error)
+{
+  gsize count = 0;
+  for (int i = 0; i < n_iov; i++)
+    count += iov[i].iov_len;
+
+  if (positional)
+    {
+      if (self->bounded && self->bound_end >= 0)
+        count = at < self->bound_end
+                    ? MIN (count, (gsize)(self->bound_end - at))
+                    : 0;
+    }
+  else
+    count = MIN (count, bound_remaining (self));
+  count = MIN (count, transfer_max_chunk (self));
+  if (count == 0)
+    return 0;
+
+  // Cut the vectors down to count bytes, restored below
+  int n_used = 0;
+  gsize used = 0;
+  while (used + iov[n_used].iov_len < count)
+    used += iov[n_used++].iov_len;
+  gsize saved_len = iov[n_used].iov_len;
+  iov[n_used++].iov_len = count - used;
+
+  gssize n = -1;
+  Py_BEGIN_ALLOW_THREADS
+  if (transfer_begin (self, count, self->input_lock.cancellable, error))
+    {
+      if (self->input_fd >= 0 && positional)
+        n = fd_preadv (self->input_fd, iov, n_used, at,
+                       self->input_lock.cancellable, error);
+      else if (self->input_fd >= 0 && buffered (self) == 0)
+        n = fd_readv (self->input_fd, iov, n_used,
+                      self->input_lock.cancellable, error);
+      else
+        n = read_vectors (self, iov, n_used, error);
+      transfer_end (self, MAX (n, 0));
+    }
+  Py_END_ALLOW_THREADS
+
+  iov[n_used - 1].iov_len = saved_len;
+  if (n > 0 && self->bounded && !positional)
+    self->position += n;
+  return n;
+}
+
+static void
+release_views (Py_buffer *views, Py_ssize_t n_views)
+{
+  for (Py_ssize_t i = 0; i < n_views; i++)
+    PyBuffer_Release (&views[i]);
+  g_free (views);
+}
+
+/*
+ * Fill the buffers of the sequence *py_buffers* in order, until all are
+ * full or EOF. Positional reads start at *offset* and leave the position
+ * alone.
+ */
+static PyObject *
+readinto_many_locked (StreamWrapper *self, PyObject *py_buffers,
+                      gboolean positional, goffset offset)
+{
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_readable (self))
-    return err_not_readable ();
+    return err_not_readable (self);
 
-  Py_buffer view;
-  if (PyObject_GetBuffer (buffer_obj, &view, PyBUF_WRITABLE) == -1)
-    return NULL; // not writable
+  goffset at = 0;
+  goffset saved = 0;
+  // Without a descriptor positional reads seek the stream and back
+  gboolean seeks = positional && self->input_fd < 0;
+  if (positional)
+    {
+      if (offset < 0)
+        {
+          PyErr_SetString (PyExc_ValueError, "negative offset");
+          return NULL;
+        }
+      at = self->bounded ? self->bound_start + offset : offset;
+      if (seeks && !can_seek (self->data_input))
+        return err_not_seekable (self);
+    }
 
-  GError *error = NULL;
-  gssize n_read
-      = g_input_stream_read (G_INPUT_STREAM (self->data_input),
-                             (void *)view.buf, (gsize)view.len, NULL, &error);
+  PyObject *seq = PySequence_Fast (py_buffers, "expected a sequence");
+  if (!seq)
+    return NULL;
 
-  if (n_read < 0)
+  Py_ssize_t n_views = PySequence_Fast_GET_SIZE (seq);
+  if (n_views > G_MAXINT)
     {
-      PyBuffer_Release (&view);
-      PyErr_SetString (PyExc_IOError, error ? error->message : "Read error");
-      g_clear_error (&error);
+      Py_DECREF (seq);
+      PyErr_SetString (PyExc_ValueError, "too many buffers");
       return NULL;
     }
 
-  PyBuffer_Release (&view);
+  Py_buffer *views = g_new0 (Py_buffer, MAX (n_views, 1));
+  struct iovec *vectors = g_new0 (struct iovec, MAX (n_views, 1));
+  for (Py_ssize_t i = 0; i < n_views; i++)
+    {
+      if (PyObject_GetBuffer (PySequence_Fast_GET_ITEM (seq, i), &views[i],
+                              PyBUF_WRITABLE)
+          < 0)
+        {
+          release_views (views, i);
+          g_free (vectors);
+          Py_DECREF (seq);
+          return NULL;
+        }
+      vectors[i].iov_base = views[i].buf;
+      vectors[i].iov_len = views[i].len;
+    }
+  Py_DECREF (seq);
 
-  return PyLong_FromSsize_t (n_read);
+  GSeekable *seekable = G_SEEKABLE (self->data_input);
+  GError *error = NULL;
+  gboolean seeked = TRUE;
+  if (seeks)
+    {
+      saved = g_seekable_tell (seekable);
+      Py_BEGIN_ALLOW_THREADS
+      seeked = g_seekable_seek (seekable, at, G_SEEK_SET,
+                                self->input_lock.cancellable, &error);
+      Py_END_ALLOW_THREADS
+    }
+
+  struct iovec *iov = vectors;
+  int n_iov = (int)n_views;
+  gsize total = 0;
+  gboolean failed = !seeked;
+  iov_advance (&iov, &n_iov, 0);
+  while (!failed && n_iov > 0)
+    {
+      gssize n = read_vectors_raw (self, iov, n_iov, positional, at + total,
+                                   &error);
+      if (n < 0)
+        failed = TRUE;
+      if (n <= 0)
+        break;
+      total += n;
+      iov_advance (&iov, &n_iov, n);
+    }
+
+  if (seeks && seeked)
+    {
+      gboolean restored;
+      Py_BEGIN_ALLOW_THREADS
+      restored = g_seekable_seek (seekable, saved, G_SEEK_SET, NULL,
+                                  failed ? NULL : &error);
+      Py_END_ALLOW_THREADS
+      failed = failed || !restored;
+    }
+
+  release_views (views, n_views);
+  g_free (vectors);
+  if (failed)
+    return err_gerror (self, &error, "Read error");
+  return PyLong_FromSize_t (total);
 }
 
-PyDoc_STRVAR (StreamWrapper_readline_doc,
-              "Read and return one line from the stream. "
-              "If size is specified, at most size bytes will be read.\n"
-              "\n"
-              ":rtype: bytes\n"
-              ":returns:\n"
-              "   Line read from the underlying stream.\n"
-              ":raises ValueError:\n"
-              "   If the underlying stream is closed.\n"
-              ":raises io.UnsupportedOperationException:\n"
-              "   If the underlying stream is not readable.");
+PyDoc_STRVAR (
+    StreamWrapper_readinto_many_doc,
+    "Read bytes into several pre-allocated, writable buffers in order.\n"
+    "\n"
+    "Each buffer is filled completely before the next one, until all of\n"
+    "them are full or EOF is reached, for example to read the header and\n"
+    "the payload of a record into separate buffers at once. Streams of\n"
+    "regular files based on a file descriptor are read with ``readv()``,\n"
+    "filling all buffers with a single system call where possible.\n"
+    "\n"
+    ":param buffers:\n"
+    "   Sequence of writable `bytes-like objects <bytes-like object_>`_.\n"
+    ":rtype: int\n"
+    ":returns:\n"
+    "   Total number of bytes read, less than the total size of\n"
+    "   *buffers* only at EOF.\n"
+    ":raises ValueError:\n"
+    "   If the underlying stream is closed.\n"
+    ":raises io.UnsupportedOperationException:\n"
+    "   If the underlying stream is not readable.\n"
+    "\n"
+    ".. _bytes-like object: "
+    "https://docs.python.org/3/glossary.html#term-bytes-like-object");
 static PyObject *
-StreamWrapper_readline_impl (StreamWrapper *self, PyObject *args)
+StreamWrapper_readinto_many_impl (StreamWrapper *self, PyObject *py_buffers)
 {
-  Py_ssize_t size = -1;
-  if (!PyArg_ParseTuple (args, "|n", &size))
+  if (wrapper_lock (self, LOCK_INPUT) < 0)
+    return NULL;
+
+  PyObject *result = readinto_many_locked (self, py_buffers, FALSE, 0);
+  wrapper_unlock (self, LOCK_INPUT);
+  return result;
+}
+
+PyDoc_STRVAR (
+    StreamWrapper_readinto_many_at_doc,
+    "Like :meth:`readinto_many`, but read from *offset*.\n"
+    "\n"
+    "The position of the stream is not changed. Streams of regular files\n"
+    "based on a file descriptor are read with ``preadv()``, other streams\n"
+    "must be seekable and are moved back after reading.\n"
+    "\n"
+    ":param int offset:\n"
+    "   Where to start reading, relative to the start of the range of a\n"
+    "   bounded wrapper.\n"
+    ":param buffers:\n"
+    "   Sequence of writable bytes-like objects.\n"
+    ":rtype: int\n"
+    ":returns:\n"
+    "   Total number of bytes read.\n"
+    ":raises ValueError:\n"
+    "   If the underlying stream is closed or *offset* is negative.\n"
+    ":raises io.UnsupportedOperationException:\n"
+    "   If the underlying stream is not readable or can't be read at an\n"
+    "   offset.");
+static PyObject *
+StreamWrapper_readinto_many_at_impl (StreamWrapper *self, PyObject *args)
+{
+  long long offset;
+  PyObject *py_buffers;
+
+  if (!PyArg_ParseTuple (args, "LO", &offset, &py_buffers))
     return NULL;
 
+  // Seeking moves the output too where both share the position
+  LockDirection direction = self->input_fd >= 0 ? LOCK_INPUT : LOCK_ALL;
+  if (wrapper_lock (self, direction) < 0)
+    return NULL;
+
+  PyObject *result = readinto_many_locked (self, py_buffers, TRUE, offset);
+  wrapper_unlock (self, direction);
+  return result;
+}
+
+/*
+ * Look for the newline in the stream's buffer, refilling it as needed.
+ * Unlike g_data_input_stream_read_line(), this never reads past the end of
+ * a range, and each refill is a transfer the limiter, scheduler and backend
+ * gate see.
+ */
+static gchar *
+read_line (StreamWrapper *self, gsize *length, GError **error)
+{
+  GBufferedInputStream *buffered = G_BUFFERED_INPUT_STREAM (self->data_input);
+  GByteArray *line = g_byte_array_new ();
+  gboolean found = FALSE;
+  gsize remaining;
+
+  while (!found && (remaining = bound_remaining (self)) > 0)
+    {
+      gsize available;
+      const guint8 *data
+          = g_buffered_input_stream_peek_buffer (buffered, &available);
+      if (available == 0)
+        {
+          gsize count = g_buffered_input_stream_get_buffer_size (buffered);
+          count = MIN (count, MIN (transfer_max_chunk (self), remaining));
+          gssize filled = -1;
+          Py_BEGIN_ALLOW_THREADS
+          if (transfer_begin (self, count, self->input_lock.cancellable,
+                              error))
+            {
+              filled = g_buffered_input_stream_fill (
+                  buffered, count, self->input_lock.cancellable, error);
+              transfer_end (self, MAX (filled, 0));
+            }
+          Py_END_ALLOW_THREADS
+          if (filled < 0)
+            {
+              g_byte_array_free (line, TRUE);
+              *length = 0;
+              return NULL;
+            }
+          if (filled == 0)
+            break;
+          continue;
+        }
+
+      gsize count = MIN (available, remaining);
+      const guint8 *newline = memchr (data, '\n', count);
+      if (newline)
+        {
+          count = newline - data + 1;
+          found = TRUE;
+        }
+      g_byte_array_append (line, data, found ? count - 1 : count);
+      // Only consumes buffered data, no I/O happens here
+      g_input_stream_skip (G_INPUT_STREAM (buffered), count, NULL, NULL);
+      if (self->bounded)
+        self->position += count;
+    }
+
+  *length = line->len;
+  if (!found && line->len == 0)
+    {
+      g_byte_array_free (line, TRUE);
+      return NULL;
+    }
+
+  g_byte_array_append (line, (const guint8 *)"", 1);
+  gchar *result = (gchar *)g_byte_array_free (line, FALSE);
+  memtrack_track (result, *length + 1);
+  return result;
+}
+
+static PyObject *
+readline_locked (StreamWrapper *self, Py_ssize_t size)
+{
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_readable (self))
-    return err_not_readable ();
+    return err_not_readable (self);
 
   if (size == 0)
     return PyBytes_FromStringAndSize ("", 0);
@@ -507,14 +2004,12 @@ StreamWrapper_readline_impl (StreamWrapper *self, PyObject *args)
   GError *error = NULL;
   gchar *line = NULL;
 
-  line = g_data_input_stream_read_line (self->data_input, &length, NULL,
-                                        &error);
+  line = read_line (self, &length, &error);
   if (!line)
     {
       if (error)
         {
-          PyErr_SetString (PyExc_IOError, error->message);
-          g_clear_error (&error);
+          err_gerror (self, &error, NULL);
           return NULL;
         }
       else
@@ -528,41 +2023,46 @@ StreamWrapper_readline_impl (StreamWrapper *self, PyObject *args)
   PyObject *result = PyBytes_FromStringAndSize (NULL, length + 1);
   char *buf = PyBytes_AS_STRING (result);
   memcpy (buf, line, length);
+  memtrack_untrack (line);
   g_free (line);
   buf[length] = '\n';
   return result;
 }
 
-PyDoc_STRVAR (
-    StreamWrapper_readlines_doc,
-    "Read and return a list of lines from the stream. "
-    "hint can be specified to control the number of lines read:\n"
-    "no more lines will be read if the total size \n"
-    "(in bytes/characters) of all lines so far exceeds hint.\n"
-    "\n"
-    "hint values of 0 or less, as well as None, are treated as no hint.\n"
-    "\n"
-    ":rtype: list\n"
-    ":returns:\n"
-    "   List of lines read from the underlying stream.\n"
-    ":raises ValueError:\n"
-    "   If the underlying stream is closed.\n"
-    ":raises io.UnsupportedOperationException:\n"
-    "   If the underlying stream is not readable.");
+PyDoc_STRVAR (StreamWrapper_readline_doc,
+              "Read and return one line from the stream. "
+              "If size is specified, at most size bytes will be read.\n"
+              "\n"
+              ":rtype: bytes\n"
+              ":returns:\n"
+              "   Line read from the underlying stream.\n"
+              ":raises ValueError:\n"
+              "   If the underlying stream is closed.\n"
+              ":raises io.UnsupportedOperationException:\n"
+              "   If the underlying stream is not readable.");
 static PyObject *
-StreamWrapper_readlines_impl (StreamWrapper *self, PyObject *args,
-                              PyObject *kwds)
+StreamWrapper_readline_impl (StreamWrapper *self, PyObject *args)
 {
-  static char *kwlist[] = { "hint", NULL };
-  Py_ssize_t hint = 0;
-  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|n", kwlist, &hint))
+  Py_ssize_t size = -1;
+  if (!PyArg_ParseTuple (args, "|n", &size))
     return NULL;
 
+  if (wrapper_lock (self, LOCK_INPUT) < 0)
+    return NULL;
+
+  PyObject *result = readline_locked (self, size);
+  wrapper_unlock (self, LOCK_INPUT);
+  return result;
+}
+
+static PyObject *
+readlines_locked (StreamWrapper *self, Py_ssize_t hint)
+{
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_readable (self))
-    return err_not_readable ();
+    return err_not_readable (self);
 
   GError *error = NULL;
   GPtrArray *lines_array = g_ptr_array_new_with_free_func (g_free);
@@ -570,17 +2070,19 @@ StreamWrapper_readlines_impl (StreamWrapper *self, PyObject *args,
     return PyErr_NoMemory ();
 
   Py_ssize_t total_bytes = 0;
+  // Bytes held by lines_array, reported as a single block
+  gsize held = 0;
 
   while (1)
     {
       gsize length = 0;
-      gchar *line_buf = g_data_input_stream_read_line (self->data_input,
-                                                       &length, NULL, &error);
+      gchar *line_buf = read_line (self, &length, &error);
 
       if (error)
         {
-          PyErr_SetString (PyExc_IOError, error->message);
-          g_error_free (error);
+          err_gerror (self, &error, NULL);
+          memtrack_untrack (lines_array);
+          scratch_release (self, held);
           g_ptr_array_free (lines_array, TRUE);
           return NULL;
         }
@@ -593,11 +2095,15 @@ StreamWrapper_readlines_impl (StreamWrapper *self, PyObject *args,
       memcpy (line, line_buf, length);
       line[length] = '\n';
       line[length + 1] = '\0';
+      memtrack_untrack (line_buf);
       g_free (line_buf);
       length += 1;
 
       g_ptr_array_add (lines_array, line);
       total_bytes += length;
+      held += length + 1 + sizeof (gpointer);
+      scratch_acquire (self, length + 1 + sizeof (gpointer));
+      memtrack_track (lines_array, held);
 
       if (hint > 0 && total_bytes >= hint)
         break;
@@ -606,6 +2112,8 @@ StreamWrapper_readlines_impl (StreamWrapper *self, PyObject *args,
   PyObject *py_lines = PyList_New (lines_array->len);
   if (!py_lines)
     {
+      memtrack_untrack (lines_array);
+      scratch_release (self, held);
       g_ptr_array_free (lines_array, TRUE);
       return NULL;
     }
@@ -617,27 +2125,64 @@ StreamWrapper_readlines_impl (StreamWrapper *self, PyObject *args,
       if (!py_line)
         {
           Py_DECREF (py_lines);
+          memtrack_untrack (lines_array);
+          scratch_release (self, held);
           g_ptr_array_free (lines_array, TRUE);
           return NULL;
         }
       PyList_SET_ITEM (py_lines, i, py_line);
     }
 
+  memtrack_untrack (lines_array);
+  scratch_release (self, held);
   g_ptr_array_free (lines_array, TRUE);
   return py_lines;
 }
 
+PyDoc_STRVAR (
+    StreamWrapper_readlines_doc,
+    "Read and return a list of lines from the stream. "
+    "hint can be specified to control the number of lines read:\n"
+    "no more lines will be read if the total size \n"
+    "(in bytes/characters) of all lines so far exceeds hint.\n"
+    "\n"
+    "hint values of 0 or less, as well as None, are treated as no hint.\n"
+    "\n"
+    ":rtype: list\n"
+    ":returns:\n"
+    "   List of lines read from the underlying stream.\n"
+    ":raises ValueError:\n"
+    "   If the underlying stream is closed.\n"
+    ":raises io.UnsupportedOperationException:\n"
+    "   If the underlying stream is not readable.");
+static PyObject *
+StreamWrapper_readlines_impl (StreamWrapper *self, PyObject *args,
+                              PyObject *kwds)
+{
+  static char *kwlist[] = { "hint", NULL };
+  Py_ssize_t hint = 0;
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|n", kwlist, &hint))
+    return NULL;
+
+  if (wrapper_lock (self, LOCK_INPUT) < 0)
+    return NULL;
+
+  PyObject *result = readlines_locked (self, hint);
+  wrapper_unlock (self, LOCK_INPUT);
+  return result;
+}
+
 static gboolean
 is_writable (StreamWrapper *self)
 {
-  return self->output != NULL;
+  // Ranges are read-only views
+  return self->output != NULL && !self->bounded;
 }
 
 static PyObject *
-err_not_writable (void)
+err_not_writable (StreamWrapper *self)
 {
-  PyErr_SetString (UnsupportedOperation, "Stream is not writable");
-  return NULL;
+  return err_unsupported (self, "Stream is not writable");
 }
 
 PyDoc_STRVAR (StreamWrapper_writable_doc,
@@ -656,6 +2201,68 @@ StreamWrapper_writable_impl (StreamWrapper *self,
     Py_RETURN_FALSE;
 }
 
+/*
+ * Write all of *buffer* with the GIL released, in chunks the wrapper's
+ * limiter and scheduler admit one at a time.
+ */
+static gboolean
+write_raw (StreamWrapper *self, const char *buffer, gsize count,
+           gsize *written, GError **error)
+{
+  gsize max_chunk = transfer_max_chunk (self);
+  gboolean success = TRUE;
+
+  *written = 0;
+  Py_BEGIN_ALLOW_THREADS
+  while (success && *written < count)
+    {
+      gsize chunk = MIN (count - *written, max_chunk);
+      gsize chunk_written = 0;
+      success = transfer_begin (self, chunk, self->output_lock.cancellable,
+                                error);
+      if (success)
+        {
+          if (self->output_fd >= 0)
+            success = fd_write_all (self->output_fd, buffer + *written,
+                                    chunk, &chunk_written,
+                                    self->output_lock.cancellable, error);
+          else
+            success = g_output_stream_write_all (
+                self->output, buffer + *written, chunk, &chunk_written,
+                self->output_lock.cancellable, error);
+          transfer_end (self, chunk_written);
+        }
+      *written += chunk_written;
+    }
+  Py_END_ALLOW_THREADS
+  return success;
+}
+
+static PyObject *
+write_locked (StreamWrapper *self, Py_buffer *view)
+{
+  if (is_closed (self))
+    return err_closed (self);
+
+  if (!is_writable (self))
+    return err_not_writable (self);
+
+  if (view->len == 0)
+    // Nothing to write
+    return PyLong_FromLong (0);
+
+  // Write all bytes from view->buf of length view->len
+  GError *error = NULL;
+  gsize bytes_written;
+  if (!write_raw (self, view->buf, view->len, &bytes_written, &error))
+    {
+      err_gerror (self, &error, "Write failed");
+      return NULL;
+    }
+
+  return PyLong_FromSize_t (bytes_written);
+}
+
 PyDoc_STRVAR (StreamWrapper_write_doc,
               "Write *b* to the underlying stream.\n"
               "\n"
@@ -676,68 +2283,34 @@ StreamWrapper_write_impl (StreamWrapper *self, PyObject *args)
   if (!PyArg_ParseTuple (args, "y*", &view))
     return NULL;
 
-  if (is_closed (self))
-    return err_closed ();
-
-  if (!is_writable (self))
-    return err_not_writable ();
-
-  if (view.len == 0)
+  PyObject *result = NULL;
+  if (wrapper_lock (self, LOCK_OUTPUT) == 0)
     {
-      // Nothing to write, release buffer and return 0
-      PyBuffer_Release (&view);
-      return PyLong_FromLong (0);
+      result = write_locked (self, &view);
+      wrapper_unlock (self, LOCK_OUTPUT);
     }
 
-  // Write all bytes from view.buf of length view.len
-  GError *error = NULL;
-  gssize bytes_written;
-  gboolean success = g_output_stream_write_all (
-      self->output, view.buf, view.len, &bytes_written, NULL, &error);
-
   PyBuffer_Release (&view);
+  return result;
+}
 
-  if (!success)
-    {
-      PyErr_SetString (PyExc_IOError, error ? error->message : "Write failed");
-      g_clear_error (&error);
-      return NULL;
-    }
+static gboolean
+write_all (StreamWrapper *self, const char *buffer, gsize count,
+           GError **error)
+{
+  gsize written = 0;
 
-  return PyLong_FromSsize_t (bytes_written);
+  return write_raw (self, buffer, count, &written, error);
 }
 
-PyDoc_STRVAR (StreamWrapper_writelines_doc,
-              "Write a list of lines to the stream.\n"
-              "\n"
-              "Line separators are not added, so it is usual for each\n"
-              "of the lines provided to have a line separator at the end.\n"
-              "\n"
-              ":param iterable lines:\n"
-              "   List of lines to be written to the underlying stream.\n"
-              ":raises ValueError:\n"
-              "   If the underlying stream is closed.\n"
-              ":raises io.UnsupportedOperationException:\n"
-              "   If the underlying stream can not be written to.");
 static PyObject *
-StreamWrapper_writelines_impl (StreamWrapper *self, PyObject *args)
+writelines_locked (StreamWrapper *self, PyObject *iterator)
 {
-  PyObject *iterable;
-  if (!PyArg_ParseTuple (args, "O", &iterable))
-    return NULL;
-
-  PyObject *iterator = PyObject_GetIter (iterable);
-  if (!iterator)
-    {
-      PyErr_SetString (PyExc_TypeError, "Argument must be iterable");
-      return NULL;
-    }
-
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_writable (self))
-    return err_not_writable ();
+    return err_not_writable (self);
 
   gssize bufsize;
   if (G_IS_BUFFERED_OUTPUT_STREAM (self->output))
@@ -759,7 +2332,6 @@ StreamWrapper_writelines_impl (StreamWrapper *self, PyObject *args)
               PyExc_TypeError,
               "writelines() argument must be an iterable of bytes");
           Py_DECREF (item);
-          Py_DECREF (iterator);
           return NULL;
         }
 
@@ -783,17 +2355,10 @@ StreamWrapper_writelines_impl (StreamWrapper *self, PyObject *args)
           memcpy (buffer + buf_pos, data, space_left);
           buf_pos += space_left;
 
-          gsize written = 0;
-          if (!g_output_stream_write_all (G_OUTPUT_STREAM (self->output),
-                                          buffer, buf_pos, &written, NULL,
-                                          &error))
+          if (!write_all (self, buffer, buf_pos, &error))
             {
-              PyErr_SetString (PyExc_IOError,
-                               error ? error->message : "Write failed");
-              if (error)
-                g_clear_error (&error);
+              err_gerror (self, &error, "Write failed");
               Py_DECREF (item);
-              Py_DECREF (iterator);
               return NULL;
             }
           buf_pos = 0;
@@ -808,52 +2373,77 @@ StreamWrapper_writelines_impl (StreamWrapper *self, PyObject *args)
   /* Final flush of remaining data in buffer */
   if (buf_pos > 0)
     {
-      gsize written = 0;
-      if (!g_output_stream_write_all (G_OUTPUT_STREAM (self->output), buffer,
-                                      buf_pos, &written, NULL, &error))
+      if (!write_all (self, buffer, buf_pos, &error))
         {
-          PyErr_SetString (PyExc_IOError,
-                           error ? error->message : "Write failed");
-          if (error)
-            g_clear_error (&error);
-          Py_DECREF (iterator);
+          err_gerror (self, &error, "Write failed");
           return NULL;
         }
     }
 
-  Py_DECREF (iterator);
-
   if (PyErr_Occurred ())
     return NULL;
 
   Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR (
-    StreamWrapper_flush_doc,
-    "Flush the write buffers of the underlying stream if applicable.\n"
-    "\n"
-    "This does nothing for read-only streams.\n"
-    "\n"
-    ":raises ValueError:\n"
-    "   If the underlying stream is closed.\n");
+PyDoc_STRVAR (StreamWrapper_writelines_doc,
+              "Write a list of lines to the stream.\n"
+              "\n"
+              "Line separators are not added, so it is usual for each\n"
+              "of the lines provided to have a line separator at the end.\n"
+              "\n"
+              ":param iterable lines:\n"
+              "   List of lines to be written to the underlying stream.\n"
+              ":raises ValueError:\n"
+              "   If the underlying stream is closed.\n"
+              ":raises io.UnsupportedOperationException:\n"
+              "   If the underlying stream can not be written to.");
 static PyObject *
-StreamWrapper_flush_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
+StreamWrapper_writelines_impl (StreamWrapper *self, PyObject *args)
+{
+  PyObject *iterable;
+  if (!PyArg_ParseTuple (args, "O", &iterable))
+    return NULL;
+
+  PyObject *iterator = PyObject_GetIter (iterable);
+  if (!iterator)
+    {
+      PyErr_SetString (PyExc_TypeError, "Argument must be iterable");
+      return NULL;
+    }
+
+  PyObject *result = NULL;
+  if (wrapper_lock (self, LOCK_OUTPUT) == 0)
+    {
+      result = writelines_locked (self, iterator);
+      wrapper_unlock (self, LOCK_OUTPUT);
+    }
+
+  Py_DECREF (iterator);
+  return result;
+}
+
+static PyObject *
+flush_locked (StreamWrapper *self)
 {
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_writable (self))
     Py_RETURN_NONE;
 
   GError *error = NULL;
-  if (!g_output_stream_flush (self->output, NULL, &error))
+  gboolean flushed;
+  Py_BEGIN_ALLOW_THREADS
+  flushed = g_output_stream_flush (self->output, self->output_lock.cancellable,
+                                   &error);
+  Py_END_ALLOW_THREADS
+  if (!flushed)
     {
       // Implementing flush is not required, causing error to not be set
       if (error)
         {
-          PyErr_SetString (PyExc_IOError, error->message);
-          g_clear_error (&error);
+          err_gerror (self, &error, NULL);
           return NULL;
         }
     }
@@ -861,6 +2451,25 @@ StreamWrapper_flush_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
   Py_RETURN_NONE;
 }
 
+PyDoc_STRVAR (
+    StreamWrapper_flush_doc,
+    "Flush the write buffers of the underlying stream if applicable.\n"
+    "\n"
+    "This does nothing for read-only streams.\n"
+    "\n"
+    ":raises ValueError:\n"
+    "   If the underlying stream is closed.\n");
+static PyObject *
+StreamWrapper_flush_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
+{
+  if (wrapper_lock (self, LOCK_OUTPUT) < 0)
+    return NULL;
+
+  PyObject *result = flush_locked (self);
+  wrapper_unlock (self, LOCK_OUTPUT);
+  return result;
+}
+
 static gboolean
 is_seekable (StreamWrapper *self)
 {
@@ -877,10 +2486,9 @@ is_seekable (StreamWrapper *self)
 }
 
 static PyObject *
-err_not_seekable (void)
+err_not_seekable (StreamWrapper *self)
 {
-  PyErr_SetString (UnsupportedOperation, "Underlying stream is not seekable");
-  return NULL;
+  return err_unsupported (self, "Underlying stream is not seekable");
 }
 
 PyDoc_STRVAR (StreamWrapper_seekable_doc,
@@ -898,7 +2506,7 @@ StreamWrapper_seekable_impl (StreamWrapper *self,
                              PyObject *Py_UNUSED (ignored))
 {
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (is_seekable (self))
     Py_RETURN_TRUE;
@@ -909,6 +2517,17 @@ StreamWrapper_seekable_impl (StreamWrapper *self,
 static goffset
 tell (StreamWrapper *self)
 {
+  if (self->bounded)
+    return self->position - self->bound_start;
+
+  if (self->fd_seekable)
+    {
+      int fd = self->input_fd >= 0 ? self->input_fd : self->output_fd;
+      goffset pos = lseek (fd, 0, SEEK_CUR);
+      // Both directions share the descriptor, minus what was read ahead
+      return self->input && pos >= 0 ? pos - (goffset)buffered (self) : pos;
+    }
+
   goffset pos;
   if (self->input)
     pos = g_seekable_tell (G_SEEKABLE (self->data_input));
@@ -917,6 +2536,21 @@ tell (StreamWrapper *self)
   return pos;
 }
 
+static PyObject *
+tell_locked (StreamWrapper *self)
+{
+  if (is_closed (self))
+    return err_closed (self);
+
+  // Bounded wrappers know their position even if they can't seek
+  if (!self->bounded && !is_seekable (self))
+    return err_not_seekable (self);
+
+  goffset pos = tell (self);
+
+  return PyLong_FromLongLong (pos);
+}
+
 PyDoc_STRVAR (StreamWrapper_tell_doc,
               "Tell the current stream position.\n"
               "\n"
@@ -928,13 +2562,132 @@ PyDoc_STRVAR (StreamWrapper_tell_doc,
               ":raises io.UnsupportedOperationException:\n"
               "   If the underlying stream is not seekable.");
 static PyObject *
-StreamWrapper_tell_impl (StreamWrapper *self, PyObject Py_UNUSED (ignored))
+StreamWrapper_tell_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
+{
+  if (wrapper_lock (self, LOCK_ALL) < 0)
+    return NULL;
+
+  PyObject *result = tell_locked (self);
+  wrapper_unlock (self, LOCK_ALL);
+  return result;
+}
+
+static PyObject *
+seek_bounded (StreamWrapper *self, goffset offset, GSeekType seek_type)
+{
+  GSeekable *seekable = G_SEEKABLE (self->data_input);
+  GError *error = NULL;
+  gboolean seeked = TRUE;
+  goffset target;
+
+  switch (seek_type)
+    {
+    case G_SEEK_SET:
+      target = self->bound_start + offset;
+      break;
+    case G_SEEK_CUR:
+      target = self->position + offset;
+      break;
+    default:
+      if (self->bound_end >= 0)
+        target = self->bound_end + offset;
+      else
+        {
+          Py_BEGIN_ALLOW_THREADS
+          seeked = g_seekable_seek (seekable, 0, G_SEEK_END,
+                                    self->input_lock.cancellable, &error);
+          Py_END_ALLOW_THREADS
+          target = g_seekable_tell (seekable) + offset;
+        }
+    }
+
+  if (seeked && target < self->bound_start)
+    {
+      PyErr_SetString (PyExc_ValueError, "negative seek position");
+      return NULL;
+    }
+
+  if (seeked)
+    {
+      Py_BEGIN_ALLOW_THREADS
+      seeked = g_seekable_seek (seekable, target, G_SEEK_SET,
+                                self->input_lock.cancellable, &error);
+      Py_END_ALLOW_THREADS
+    }
+  if (!seeked)
+    {
+      err_gerror (self, &error, NULL);
+      return NULL;
+    }
+
+  self->position = target;
+  return PyLong_FromLongLong (target - self->bound_start);
+}
+
+static PyObject *
+seek_locked (StreamWrapper *self, goffset offset, GSeekType seek_type)
 {
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_seekable (self))
-    return err_not_seekable ();
+    return err_not_seekable (self);
+
+  if (self->bounded)
+    return seek_bounded (self, offset, seek_type);
+
+  GError *error = NULL;
+  gboolean seeked;
+
+  if (self->fd_seekable)
+    {
+      int fd = self->input_fd >= 0 ? self->input_fd : self->output_fd;
+      if (seek_type == G_SEEK_CUR)
+        {
+          offset += tell (self);
+          seek_type = G_SEEK_SET;
+        }
+      // Drop what was read ahead, only consumes the buffer
+      gsize available = self->input ? buffered (self) : 0;
+      if (available > 0)
+        g_input_stream_skip (G_INPUT_STREAM (self->data_input), available,
+                             NULL, NULL);
+
+      goffset pos = fd_seek (fd, offset, seek_type, &error);
+      if (pos < 0)
+        {
+          err_gerror (self, &error, NULL);
+          return NULL;
+        }
+      return PyLong_FromLongLong (pos);
+    }
+
+  if (is_readable (self))
+    {
+      Py_BEGIN_ALLOW_THREADS
+      seeked = g_seekable_seek (G_SEEKABLE (self->data_input), offset,
+                                seek_type, self->input_lock.cancellable,
+                                &error);
+      Py_END_ALLOW_THREADS
+      if (!seeked)
+        {
+          err_gerror (self, &error, NULL);
+          return NULL;
+        }
+    }
+
+  if (is_writable (self))
+    {
+      Py_BEGIN_ALLOW_THREADS
+      seeked = g_seekable_seek (G_SEEKABLE (self->output), offset, seek_type,
+                                self->input_lock.cancellable, &error);
+      Py_END_ALLOW_THREADS
+      if (!seeked)
+        {
+          err_gerror (self, &error, NULL);
+          return NULL;
+        }
+    }
 
   goffset pos = tell (self);
 
@@ -972,12 +2725,6 @@ StreamWrapper_seek_impl (StreamWrapper *self, PyObject *args, PyObject *kwargs)
                                     &whence))
     return NULL;
 
-  if (is_closed (self))
-    return err_closed ();
-
-  if (!is_seekable (self))
-    return err_not_seekable ();
-
   GSeekType seek_type;
   switch (whence)
     {
@@ -995,33 +2742,45 @@ StreamWrapper_seek_impl (StreamWrapper *self, PyObject *args, PyObject *kwargs)
       return NULL;
     }
 
-  GError *error = NULL;
+  if (wrapper_lock (self, LOCK_ALL) < 0)
+    return NULL;
+
+  PyObject *result = seek_locked (self, offset, seek_type);
+  wrapper_unlock (self, LOCK_ALL);
+  return result;
+}
+
+static PyObject *
+truncate_locked (StreamWrapper *self, gboolean has_size, goffset size)
+{
+  if (is_closed (self))
+    return err_closed (self);
+
+  if (!is_seekable (self))
+    return err_not_seekable (self);
+
+  if (!is_writable (self)
+      || !g_seekable_can_truncate (G_SEEKABLE (self->output)))
+    return err_unsupported (self, "truncate");
 
-  if (is_readable (self))
-    {
-      if (!g_seekable_seek (G_SEEKABLE (self->data_input), offset, seek_type,
-                            NULL, &error))
-        {
-          PyErr_SetString (PyExc_IOError, error->message);
-          g_error_free (error);
-          return NULL;
-        }
-    }
+  // If no size provided, use current position
+  if (!has_size)
+    size = g_seekable_tell (G_SEEKABLE (self->output));
 
-  if (is_writable (self))
+  GError *error = NULL;
+  gboolean truncated;
+  Py_BEGIN_ALLOW_THREADS
+  truncated = g_seekable_truncate (G_SEEKABLE (self->output), size,
+                                   self->input_lock.cancellable, &error);
+  Py_END_ALLOW_THREADS
+  if (!truncated)
     {
-      if (!g_seekable_seek (G_SEEKABLE (self->output), offset, seek_type, NULL,
-                            &error))
-        {
-          PyErr_SetString (PyExc_IOError, error->message);
-          g_error_free (error);
-          return NULL;
-        }
+      PyErr_SetString (PyExc_IOError, "Failed to truncate");
+      g_clear_error (&error);
+      return NULL;
     }
 
-  goffset pos = tell (self);
-
-  return PyLong_FromLongLong (pos);
+  return PyLong_FromLong (size);
 }
 
 PyDoc_STRVAR (
@@ -1046,28 +2805,12 @@ StreamWrapper_truncate_impl (StreamWrapper *self, PyObject *args)
   if (!PyArg_ParseTuple (args, "|L", &size))
     return NULL;
 
-  if (is_closed (self))
-    return err_closed ();
-
-  if (!is_seekable (self))
-    return err_not_seekable ();
-
-  if (!g_seekable_can_truncate (G_SEEKABLE (self->output)))
-    return err_unsupported ("truncate");
-
-  // If no size provided, use current position
-  if (PyTuple_Size (args) == 0)
-    size = g_seekable_tell (G_SEEKABLE (self->output));
-
-  GError *error = NULL;
-  if (!g_seekable_truncate (G_SEEKABLE (self->output), size, NULL, &error))
-    {
-      PyErr_SetString (PyExc_IOError, "Failed to truncate");
-      g_clear_error (&error);
-      return NULL;
-    }
+  if (wrapper_lock (self, LOCK_ALL) < 0)
+    return NULL;
 
-  return PyLong_FromLong (size);
+  PyObject *result = truncate_locked (self, PyTuple_Size (args) > 0, size);
+  wrapper_unlock (self, LOCK_ALL);
+  return result;
 }
 
 static gboolean
@@ -1111,10 +2854,10 @@ static PyObject *
 StreamWrapper_fileno_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
 {
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_fd_based (self))
-    return err_unsupported ("fileno");
+    return err_unsupported (self, "fileno");
 
   int fd = get_fd (self);
 
@@ -1133,7 +2876,7 @@ static PyObject *
 StreamWrapper_isatty_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
 {
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_fd_based (self))
     Py_RETURN_FALSE;
@@ -1149,7 +2892,7 @@ static PyObject *
 StreamWrapper_enter_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
 {
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   Py_INCREF (self);
   return (PyObject *)self;
@@ -1159,50 +2902,43 @@ PyDoc_STRVAR (StreamWrapper_exit_doc, "Exit the runtime context.");
 static PyObject *
 StreamWrapper_exit_impl (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
 {
-  if (is_closed (self))
-    Py_RETURN_NONE;
-
-  if (!close_wrapper (self))
-    return NULL;
-
-  Py_RETURN_NONE;
+  return StreamWrapper_close_impl (self, NULL);
 }
 
 static PyObject *
 StreamWrapper_iter (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
 {
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   Py_INCREF (self);
   return (PyObject *)self;
 }
 
 static PyObject *
-StreamWrapper_iternext (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
+iternext_locked (StreamWrapper *self)
 {
   if (is_closed (self))
-    return err_closed ();
+    return err_closed (self);
 
   if (!is_readable (self))
-    return err_not_readable ();
+    return err_not_readable (self);
 
   gsize length = 0;
   GError *error = NULL;
   gchar *line = NULL;
 
-  line = g_data_input_stream_read_line (self->data_input, &length, NULL,
-                                        &error);
+  line = read_line (self, &length, &error);
   if (!line && error)
     {
-      PyErr_SetString (PyExc_IOError, error->message);
-      g_clear_error (&error);
+      err_gerror (self, &error, NULL);
       return NULL;
     }
 
   if (length == 0)
     {
       /* End of iteration */
+      memtrack_untrack (line);
       g_free (line);
       PyErr_SetNone (PyExc_StopIteration);
       return NULL;
@@ -1211,11 +2947,351 @@ StreamWrapper_iternext (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
   PyObject *result = PyBytes_FromStringAndSize (NULL, length + 1);
   char *buf = PyBytes_AS_STRING (result);
   memcpy (buf, line, length);
+  memtrack_untrack (line);
   g_free (line);
   buf[length] = '\n';
   return result;
 }
 
+static PyObject *
+StreamWrapper_iternext (StreamWrapper *self, PyObject *Py_UNUSED (ignored))
+{
+  if (wrapper_lock (self, LOCK_INPUT) < 0)
+    return NULL;
+
+  PyObject *result = iternext_locked (self);
+  wrapper_unlock (self, LOCK_INPUT);
+  return result;
+}
+
+PyDoc_STRVAR (
+    StreamWrapper_memory_usage_doc,
+    "Report memory held by the wrapper outside of Python objects.\n"
+    "\n"
+    "The same allocations are reported to :mod:`tracemalloc` under the\n"
+    "domain :data:`TRACEMALLOC_DOMAIN` while tracing is active.\n"
+    "\n"
+    ":rtype: dict\n"
+    ":returns:\n"
+    "   A mapping of ``buffer`` (read buffer of the underlying stream),\n"
+    "   ``scratch`` (temporary buffers of reads in progress),\n"
+    "   ``peak_scratch`` (high-water mark of ``scratch``) and ``total``\n"
+    "   (``buffer`` and ``scratch`` combined) to sizes in bytes.");
+static PyObject *
+StreamWrapper_memory_usage_impl (StreamWrapper *self,
+                                 PyObject *Py_UNUSED (ignored))
+{
+  return Py_BuildValue ("{s:n,s:n,s:n,s:n}", "buffer",
+                        (Py_ssize_t)self->buffer_bytes, "scratch",
+                        (Py_ssize_t)self->scratch_bytes, "peak_scratch",
+                        (Py_ssize_t)self->peak_scratch_bytes, "total",
+                        (Py_ssize_t)(self->buffer_bytes + self->scratch_bytes));
+}
+
+/*
+ * Query the etag of the file backing the wrapper, preferring the open stream
+ * over the path, which may have been replaced since. Sets *etag to NULL if
+ * the backend has none.
+ */
+static gboolean
+query_etag (StreamWrapper *self, char **etag, GError **error)
+{
+  GFileInfo *info = NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  if (G_IS_FILE_INPUT_STREAM (self->input))
+    info = g_file_input_stream_query_info (G_FILE_INPUT_STREAM (self->input),
+                                           G_FILE_ATTRIBUTE_ETAG_VALUE,
+                                           self->input_lock.cancellable,
+                                           error);
+  else if (G_IS_FILE_IO_STREAM (self->io))
+    info = g_file_io_stream_query_info (G_FILE_IO_STREAM (self->io),
+                                        G_FILE_ATTRIBUTE_ETAG_VALUE,
+                                        self->input_lock.cancellable, error);
+  else if (self->file)
+    info = g_file_query_info (self->file, G_FILE_ATTRIBUTE_ETAG_VALUE,
+                              G_FILE_QUERY_INFO_NONE,
+                              self->input_lock.cancellable, error);
+  Py_END_ALLOW_THREADS
+
+  *etag = NULL;
+  if (!info)
+    return *error == NULL;
+
+  *etag = g_strdup (g_file_info_get_etag (info));
+  g_object_unref (info);
+  return TRUE;
+}
+
+PyDoc_STRVAR (
+    StreamWrapper_handle_doc,
+    "Describe a byte range of the wrapped file for another process.\n"
+    "\n"
+    "Unlike the wrapper itself, the returned :class:`StreamHandle` can be\n"
+    "pickled. It owns a duplicate of the wrapper's file descriptor where\n"
+    "there is one, which outlives the wrapper. Sent to a\n"
+    ":mod:`multiprocessing` worker it carries the descriptor along, so the\n"
+    "worker can reopen the range without resolving the URI again.\n"
+    "\n"
+    ":param int offset:\n"
+    "   Start of the range.\n"
+    ":param int length:\n"
+    "   Length of the range, -1 for everything after *offset*.\n"
+    ":rtype: StreamHandle\n"
+    ":returns:\n"
+    "   A handle for the range.\n"
+    ":raises ValueError:\n"
+    "   If the underlying stream is closed or the range is invalid.\n"
+    ":raises io.UnsupportedOperationException:\n"
+    "   If the wrapper is not readable, or was neither opened from a file\n"
+    "   nor is based on a file descriptor.");
+static PyObject *
+StreamWrapper_handle_impl (StreamWrapper *self, PyObject *args,
+                           PyObject *kwds)
+{
+  static char *kwlist[] = { "offset", "length", NULL };
+  long long offset = 0;
+  long long length = -1;
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|LL", kwlist, &offset,
+                                    &length))
+    return NULL;
+
+  if (offset < 0 || length < -1)
+    {
+      PyErr_SetString (PyExc_ValueError, "invalid range");
+      return NULL;
+    }
+
+  // Handles of a range are relative to the file, not the range
+  if (self->bounded)
+    {
+      offset += self->bound_start;
+      if (self->bound_end >= 0)
+        {
+          goffset available = MAX (self->bound_end - offset, 0);
+          length = length < 0 ? available : MIN (length, available);
+        }
+    }
+
+  if (wrapper_lock (self, LOCK_INPUT) < 0)
+    return NULL;
+
+  if (is_closed (self))
+    {
+      wrapper_unlock (self, LOCK_INPUT);
+      return err_closed (self);
+    }
+
+  if (!is_readable (self))
+    {
+      wrapper_unlock (self, LOCK_INPUT);
+      return err_not_readable (self);
+    }
+
+  int fd = is_fd_based (self) ? get_fd (self) : -1;
+  if (!self->file && fd < 0)
+    {
+      wrapper_unlock (self, LOCK_INPUT);
+      return err_unsupported (self, "handle");
+    }
+
+  char *etag;
+  GError *error = NULL;
+  if (!query_etag (self, &etag, &error))
+    {
+      err_gerror (self, &error, NULL);
+      wrapper_unlock (self, LOCK_INPUT);
+      return NULL;
+    }
+
+  // The handle owns its descriptor, the wrapper may close its own first
+  if (fd >= 0 && (fd = dup (fd)) < 0)
+    {
+      PyErr_SetFromErrno (PyExc_OSError);
+      wrapper_unlock (self, LOCK_INPUT);
+      g_free (etag);
+      return NULL;
+    }
+  wrapper_unlock (self, LOCK_INPUT);
+
+  PyObject *py_fd = Py_None;
+  if (fd < 0)
+    Py_INCREF (py_fd);
+  else if (!(py_fd = PyLong_FromLong (fd)))
+    {
+      close (fd);
+      g_free (etag);
+      return NULL;
+    }
+
+  // StreamHandle is implemented in Python, next to the pickling support
+  char *uri = self->file ? g_file_get_uri (self->file) : NULL;
+  PyObject *result = NULL;
+  PyObject *module = PyImport_ImportModule ("gio_pyio");
+  if (module)
+    {
+      result = PyObject_CallMethod (module, "StreamHandle", "zsLLzN", uri,
+                                    is_writable (self) ? "r+b" : "rb",
+                                    offset, length, etag, py_fd);
+      Py_DECREF (module);
+    }
+  else
+    {
+      if (fd >= 0)
+        close (fd);
+      Py_DECREF (py_fd);
+    }
+
+  g_free (uri);
+  g_free (etag);
+  return result;
+}
+
+/*
+ * Size of the readable stream, for windows up to EOF. The input lock must be
+ * held.
+ */
+static gboolean
+query_size (StreamWrapper *self, int fd, goffset *size, GError **error)
+{
+  if (fd >= 0)
+    {
+      struct stat st;
+      if (fstat (fd, &st) < 0)
+        {
+          int errsv = errno;
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                       "Error querying file size: %s", g_strerror (errsv));
+          return FALSE;
+        }
+      *size = st.st_size;
+      return TRUE;
+    }
+
+  GSeekable *seekable = G_SEEKABLE (self->data_input);
+  gboolean seeked;
+
+  Py_BEGIN_ALLOW_THREADS
+  goffset saved = g_seekable_tell (seekable);
+  seeked = g_seekable_seek (seekable, 0, G_SEEK_END,
+                            self->input_lock.cancellable, error);
+  if (seeked)
+    {
+      *size = g_seekable_tell (seekable);
+      seeked = g_seekable_seek (seekable, saved, G_SEEK_SET,
+                                self->input_lock.cancellable, error);
+    }
+  Py_END_ALLOW_THREADS
+  return seeked;
+}
+
+PyDoc_STRVAR (
+    StreamWrapper_window_doc,
+    "Return a read-only view of a byte range of the stream.\n"
+    "\n"
+    "The view is a seekable :class:`StreamWrapper` whose positions are\n"
+    "relative to *offset*. It has its own position and reads the range\n"
+    "positionally from this wrapper's stream, without reopening the file\n"
+    "or copying data. Any number of windows can be read concurrently.\n"
+    "Streams based on a file descriptor are read with ``pread()``, others\n"
+    "must be seekable and are shared under this wrapper's lock, leaving\n"
+    "its position untouched.\n"
+    "\n"
+    ":param int offset:\n"
+    "   Start of the range, relative to the range of this wrapper if it\n"
+    "   is restricted to one.\n"
+    ":param int length:\n"
+    "   Length of the range, -1 for everything after *offset*.\n"
+    ":rtype: StreamWrapper\n"
+    ":returns:\n"
+    "   A new wrapper over the range.\n"
+    ":raises ValueError:\n"
+    "   If the underlying stream is closed or the range is invalid.\n"
+    ":raises io.UnsupportedOperationException:\n"
+    "   If the underlying stream is not readable.");
+static PyObject *
+StreamWrapper_window_impl (StreamWrapper *self, PyObject *args,
+                           PyObject *kwds)
+{
+  static char *kwlist[] = { "offset", "length", NULL };
+  long long offset;
+  long long length = -1;
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "L|L", kwlist, &offset,
+                                    &length))
+    return NULL;
+
+  if (offset < 0 || length < -1)
+    {
+      PyErr_SetString (PyExc_ValueError, "invalid range");
+      return NULL;
+    }
+
+  goffset start = offset;
+  goffset end = length < 0 ? -1 : offset + length;
+  if (self->bounded)
+    {
+      start += self->bound_start;
+      end = end < 0 ? self->bound_end : end + self->bound_start;
+      if (self->bound_end >= 0)
+        end = MIN (end, self->bound_end);
+    }
+
+  if (wrapper_lock (self, LOCK_INPUT) < 0)
+    return NULL;
+
+  if (is_closed (self))
+    {
+      wrapper_unlock (self, LOCK_INPUT);
+      return err_closed (self);
+    }
+
+  if (!is_readable (self))
+    {
+      wrapper_unlock (self, LOCK_INPUT);
+      return err_not_readable (self);
+    }
+
+  // A private duplicate, the window may outlive this wrapper's descriptor
+  int fd = -1;
+  if (is_fd_based (self) && (fd = dup (get_fd (self))) < 0)
+    {
+      wrapper_unlock (self, LOCK_INPUT);
+      return PyErr_SetFromErrno (PyExc_OSError);
+    }
+
+  GError *error = NULL;
+  if (end < 0 && !query_size (self, fd, &end, &error))
+    {
+      err_gerror (self, &error, NULL);
+      wrapper_unlock (self, LOCK_INPUT);
+      if (fd >= 0)
+        close (fd);
+      return NULL;
+    }
+
+  GInputStream *window = window_input_stream_new (
+      G_INPUT_STREAM (self->data_input), self->input_lock.lock, fd, start,
+      MAX (start, end));
+  wrapper_unlock (self, LOCK_INPUT);
+
+  StreamWrapper *result = (StreamWrapper *)wrapper_from_gobject (
+      Py_TYPE (self), G_OBJECT (window));
+  if (result)
+    {
+      Py_INCREF (self);
+      result->parent = (PyObject *)self;
+      Py_XINCREF (self->limiter);
+      result->limiter = self->limiter;
+      result->gate = self->gate;
+      Py_XINCREF (self->scheduler);
+      result->scheduler = self->scheduler;
+      result->tenant = self->tenant;
+    }
+  return (PyObject *)result;
+}
+
 PyObject *
 StreamWrapper_pickle_unsupported (StreamWrapper *self,
                                   PyObject *Py_UNUSED (ignored))
@@ -1229,6 +3305,7 @@ StreamWrapper_dealloc (StreamWrapper *self)
 {
   if (self->input)
     {
+      memtrack_untrack (&self->buffer_bytes);
       g_object_unref (self->input);
       g_object_unref (self->data_input);
     }
@@ -1236,12 +3313,28 @@ StreamWrapper_dealloc (StreamWrapper *self)
     g_object_unref (self->output);
   if (self->io)
     g_object_unref (self->io);
-  Py_TYPE (self)->tp_free ((PyObject *)self);
+  if (self->file)
+    g_object_unref (self->file);
+  Py_XDECREF (self->parent);
+  Py_XDECREF (self->limiter);
+  Py_XDECREF (self->scheduler);
+  if (self->input_lock.lock)
+    PyThread_free_lock (self->input_lock.lock);
+  if (self->output_lock.lock)
+    PyThread_free_lock (self->output_lock.lock);
+  g_clear_object (&self->input_lock.cancellable);
+  g_clear_object (&self->output_lock.cancellable);
+  PyTypeObject *type = Py_TYPE (self);
+  type->tp_free ((PyObject *)self);
+  // Instances of heap types own a reference to their type
+  Py_DECREF (type);
 }
 
 static PyMethodDef StreamWrapper_methods[]
     = { { "close", (PyCFunction)StreamWrapper_close_impl, METH_NOARGS,
           StreamWrapper_close_doc },
+        { "cancel", (PyCFunction)StreamWrapper_cancel_impl, METH_NOARGS,
+          StreamWrapper_cancel_doc },
         { "readable", (PyCFunction)StreamWrapper_readable_impl, METH_NOARGS,
           StreamWrapper_readable_doc },
         { "read", (PyCFunction)StreamWrapper_read_impl,
@@ -1254,6 +3347,11 @@ static PyMethodDef StreamWrapper_methods[]
           StreamWrapper_readinto_doc },
         { "readinto1", (PyCFunction)StreamWrapper_readinto_impl, METH_VARARGS,
           StreamWrapper_readinto_doc },
+        { "readinto_many", (PyCFunction)StreamWrapper_readinto_many_impl,
+          METH_O, StreamWrapper_readinto_many_doc },
+        { "readinto_many_at",
+          (PyCFunction)StreamWrapper_readinto_many_at_impl, METH_VARARGS,
+          StreamWrapper_readinto_many_at_doc },
         { "readline", (PyCFunction)StreamWrapper_readline_impl, METH_VARARGS,
           StreamWrapper_readline_doc },
         { "readlines", (PyCFunction)StreamWrapper_readlines_impl,
@@ -1282,6 +3380,21 @@ static PyMethodDef StreamWrapper_methods[]
           StreamWrapper_enter_doc },
         { "__exit__", (PyCFunction)StreamWrapper_exit_impl,
           METH_VARARGS | METH_KEYWORDS, StreamWrapper_exit_doc },
+        { "memory_usage", (PyCFunction)StreamWrapper_memory_usage_impl,
+          METH_NOARGS, StreamWrapper_memory_usage_doc },
+        { "window", (PyCFunction)StreamWrapper_window_impl,
+          METH_VARARGS | METH_KEYWORDS, StreamWrapper_window_doc },
+        { "handle", (PyCFunction)StreamWrapper_handle_impl,
+          METH_VARARGS | METH_KEYWORDS, StreamWrapper_handle_doc },
+        { "from_fd", (PyCFunction)StreamWrapper_from_fd_impl,
+          METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+          StreamWrapper_from_fd_doc },
+        { "from_capsule", (PyCFunction)StreamWrapper_from_capsule_impl,
+          METH_O | METH_CLASS, StreamWrapper_from_capsule_doc },
+        { "concat", (PyCFunction)StreamWrapper_concat_impl,
+          METH_O | METH_CLASS, StreamWrapper_concat_doc },
+        { "tee", (PyCFunction)StreamWrapper_tee_impl, METH_O | METH_CLASS,
+          StreamWrapper_tee_doc },
         { "__getstate__", (PyCFunction)StreamWrapper_pickle_unsupported,
           METH_NOARGS, NULL },
         { NULL, NULL, 0, NULL } };
@@ -1289,11 +3402,19 @@ static PyMethodDef StreamWrapper_methods[]
 static PyGetSetDef StreamWrapper_getsetters[]
     = { { "closed", (getter)StreamWrapper_get_closed, NULL,
           StreamWrapper_get_closed_doc, NULL },
+        { "timeout", (getter)StreamWrapper_get_timeout,
+          (setter)StreamWrapper_set_timeout, StreamWrapper_timeout_doc,
+          NULL },
+        { "priority", (getter)StreamWrapper_get_priority,
+          (setter)StreamWrapper_set_priority, StreamWrapper_priority_doc,
+          NULL },
+        { "limiter", (getter)StreamWrapper_get_limiter, NULL,
+          StreamWrapper_limiter_doc, NULL },
         { NULL } };
 
 static PyType_Slot StreamWrapper_slots[]
     = { { Py_tp_doc, (void *)StreamWrapper_doc },
-        { Py_tp_new, (void *)PyType_GenericNew },
+        { Py_tp_new, (void *)StreamWrapper_new },
         { Py_tp_init, (void *)StreamWrapper_init },
         { Py_tp_dealloc, (void *)StreamWrapper_dealloc },
         { Py_tp_methods, (void *)StreamWrapper_methods },
@@ -1305,11 +3426,204 @@ static PyType_Slot StreamWrapper_slots[]
 static PyType_Spec StreamWrapper_spec = { .name = "gio_pyio.StreamWrapper",
                                           .basicsize = sizeof (StreamWrapper),
                                           .itemsize = 0,
-                                          .flags = Py_TPFLAGS_DEFAULT,
+                                          .flags = Py_TPFLAGS_DEFAULT
+                                                   | Py_TPFLAGS_BASETYPE,
                                           .slots = StreamWrapper_slots };
 
 PyObject *
-PyStreamWrapperType_Create (void)
+PyStreamWrapperType_Create (PyObject *module)
+{
+  return PyType_FromModuleAndSpec (module, &StreamWrapper_spec, NULL);
+}
+
+PyDoc_STRVAR (
+    SpooledStreamWrapper_doc,
+    "A writable, seekable :class:`StreamWrapper` that spills from memory\n"
+    "to a temporary file.\n"
+    "\n"
+    "Writes go to a ``Gio.MemoryOutputStream`` until the contents would\n"
+    "grow past *max_memory* bytes. Then they are moved to a file created\n"
+    "with ``Gio.File.new_tmp()`` and writing continues there at the same\n"
+    "position. The file is deleted once the wrapper, and any stream opened\n"
+    "by :meth:`contents`, is gone. This suits buffering data of unknown\n"
+    "size, which costs no disk I/O while it is small.\n"
+    "\n"
+    ":param int max_memory:\n"
+    "   Largest size of the contents kept in memory.\n"
+    ":raises ValueError:\n"
+    "   *max_memory* is negative.");
+static int
+SpooledStreamWrapper_init (StreamWrapper *self, PyObject *args,
+                           PyObject *kwds)
+{
+  static char *kwlist[] = { "max_memory", NULL };
+  Py_ssize_t max_memory;
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "n", kwlist, &max_memory))
+    return -1;
+
+  if (max_memory < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "max_memory must not be negative");
+      return -1;
+    }
+
+  if (self->input || self->output)
+    {
+      PyErr_SetString (PyExc_RuntimeError, "StreamWrapper already set up");
+      return -1;
+    }
+
+  GOutputStream *spool = spool_output_stream_new (max_memory);
+  int set_up = setup_stream (self, G_OBJECT (spool));
+  g_object_unref (spool);
+  return set_up;
+}
+
+// Whether the wrapper writes to a spool, raising ValueError if not
+static gboolean
+check_spool (StreamWrapper *self)
+{
+  if (!self->output || !SPOOL_IS_OUTPUT_STREAM (self->output))
+    {
+      PyErr_SetString (PyExc_ValueError, "SpooledStreamWrapper not set up");
+      return FALSE;
+    }
+  return TRUE;
+}
+
+PyDoc_STRVAR (SpooledStreamWrapper_spilled_doc,
+              "Whether the contents were moved to a temporary file.");
+static PyObject *
+SpooledStreamWrapper_get_spilled (StreamWrapper *self, void *closure)
+{
+  if (!check_spool (self))
+    return NULL;
+  if (spool_output_stream_is_spilled (SPOOL_OUTPUT_STREAM (self->output)))
+    Py_RETURN_TRUE;
+  Py_RETURN_FALSE;
+}
+
+// Close the wrapper unless it is already, finishing the contents
+static gboolean
+finish_spool (StreamWrapper *self)
+{
+  return check_spool (self) && (is_closed (self) || close_wrapper (self));
+}
+
+PyDoc_STRVAR (
+    SpooledStreamWrapper_contents_doc,
+    "Close the wrapper and open its contents for reading.\n"
+    "\n"
+    "Can be called any number of times, each call returns a new wrapper\n"
+    "reading from the start. Contents held in memory are read without\n"
+    "copying them.\n"
+    "\n"
+    ":rtype: StreamWrapper\n"
+    ":returns:\n"
+    "   A new read-only wrapper of the contents.\n"
+    ":raises OSError:\n"
+    "   The wrapper couldn't be closed or the temporary file couldn't be\n"
+    "   opened.");
+static PyObject *
+SpooledStreamWrapper_contents_impl (StreamWrapper *self,
+                                    PyObject *Py_UNUSED (ignored))
+{
+  ModuleState *state = get_module_state (Py_TYPE (self));
+  if (!state)
+    return NULL;
+
+  if (wrapper_lock (self, LOCK_ALL) < 0)
+    return NULL;
+
+  GInputStream *stream = NULL;
+  if (finish_spool (self))
+    {
+      GError *error = NULL;
+      Py_BEGIN_ALLOW_THREADS
+      stream = spool_output_stream_open (SPOOL_OUTPUT_STREAM (self->output),
+                                         self->input_lock.cancellable,
+                                         &error);
+      Py_END_ALLOW_THREADS
+      if (!stream)
+        err_gerror (self, &error, NULL);
+    }
+  wrapper_unlock (self, LOCK_ALL);
+  if (!stream)
+    return NULL;
+
+  return wrapper_from_gobject ((PyTypeObject *)state->streamwrapper_type,
+                               G_OBJECT (stream));
+}
+
+PyDoc_STRVAR (
+    SpooledStreamWrapper_getbuffer_doc,
+    "Close the wrapper and return its contents without copying them.\n"
+    "\n"
+    ":rtype: memoryview\n"
+    ":returns:\n"
+    "   A read-only view of the contents held in memory.\n"
+    ":raises io.UnsupportedOperation:\n"
+    "   The contents were spilled to a temporary file, see :attr:`spilled`\n"
+    "   and :meth:`contents`.\n"
+    ":raises OSError:\n"
+    "   The wrapper couldn't be closed.");
+static PyObject *
+SpooledStreamWrapper_getbuffer_impl (StreamWrapper *self,
+                                     PyObject *Py_UNUSED (ignored))
+{
+  ModuleState *state = get_module_state (Py_TYPE (self));
+  if (!state)
+    return NULL;
+
+  if (wrapper_lock (self, LOCK_ALL) < 0)
+    return NULL;
+
+  gboolean finished = finish_spool (self);
+  GBytes *bytes = finished ? spool_output_stream_get_bytes (
+                                 SPOOL_OUTPUT_STREAM (self->output))
+                           : NULL;
+  wrapper_unlock (self, LOCK_ALL);
+  if (!finished)
+    return NULL;
+  if (!bytes)
+    return err_unsupported (self, "contents were spilled to a file");
+
+  PyObject *view
+      = bytes_view_new ((PyTypeObject *)state->bytesview_type, bytes);
+  g_bytes_unref (bytes);
+  return view;
+}
+
+static PyMethodDef SpooledStreamWrapper_methods[]
+    = { { "contents", (PyCFunction)SpooledStreamWrapper_contents_impl,
+          METH_NOARGS, SpooledStreamWrapper_contents_doc },
+        { "getbuffer", (PyCFunction)SpooledStreamWrapper_getbuffer_impl,
+          METH_NOARGS, SpooledStreamWrapper_getbuffer_doc },
+        { NULL, NULL, 0, NULL } };
+
+static PyGetSetDef SpooledStreamWrapper_getsetters[]
+    = { { "spilled", (getter)SpooledStreamWrapper_get_spilled, NULL,
+          SpooledStreamWrapper_spilled_doc, NULL },
+        { NULL } };
+
+static PyType_Slot SpooledStreamWrapper_slots[]
+    = { { Py_tp_doc, (void *)SpooledStreamWrapper_doc },
+        { Py_tp_init, (void *)SpooledStreamWrapper_init },
+        { Py_tp_methods, (void *)SpooledStreamWrapper_methods },
+        { Py_tp_getset, (void *)SpooledStreamWrapper_getsetters },
+        { 0, NULL } };
+
+static PyType_Spec SpooledStreamWrapper_spec
+    = { .name = "gio_pyio.SpooledStreamWrapper",
+        .basicsize = sizeof (StreamWrapper),
+        .itemsize = 0,
+        .flags = Py_TPFLAGS_DEFAULT,
+        .slots = SpooledStreamWrapper_slots };
+
+PyObject *
+PySpooledStreamWrapperType_Create (PyObject *module, PyObject *base)
 {
-  return PyType_FromSpec (&StreamWrapper_spec);
+  return PyType_FromModuleAndSpec (module, &SpooledStreamWrapper_spec,
+                                   base);
 }
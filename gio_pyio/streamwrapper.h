@@ -3,6 +3,8 @@
 
 #include <Python.h>
 
-PyObject *PyStreamWrapperType_Create (void);
+PyObject *PyStreamWrapperType_Create (PyObject *module);
+PyObject *PySpooledStreamWrapperType_Create (PyObject *module,
+                                             PyObject *base);
 
 #endif
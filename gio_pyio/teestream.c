@@ -0,0 +1,216 @@
+#include "teestream.h"
+#include "iopool.h"
+#include "iopriority.h"
+
+/*
+ * Writes everything written to it to several output streams at once. Each
+ * buffer is handed to all destinations by reference and written to them in
+ * parallel, so a write takes as long as the slowest destination rather than
+ * the sum of all of them. A write only returns once every destination has
+ * taken the whole buffer, which bounds what is in flight per destination to
+ * the one buffer and makes slow destinations push back on the writer.
+ * Writes to all destinations but the first run on the default I/O pool,
+ * unless the writer is a worker of a pool itself, say writing to a tee of
+ * tees, which writes to the destinations one by one instead of waiting for
+ * other workers.
+ */
+struct _TeeOutputStream
+{
+  GOutputStream parent_instance;
+  GOutputStream **outputs;
+  guint n_outputs;
+  GMutex mutex;
+  GCond done;
+  guint pending;
+};
+
+G_DEFINE_TYPE (TeeOutputStream, tee_output_stream, G_TYPE_OUTPUT_STREAM)
+
+typedef enum
+{
+  TEE_WRITE,
+  TEE_FLUSH,
+  TEE_CLOSE,
+} TeeOperation;
+
+typedef struct
+{
+  TeeOutputStream *self;
+  GOutputStream *output;
+  TeeOperation operation;
+  const void *buffer;
+  gsize count;
+  GCancellable *cancellable;
+  // ioprio of the writer, pool workers write with it
+  int ioprio;
+  GError *error;
+} TeeJob;
+
+static void
+run_job (TeeJob *job)
+{
+  switch (job->operation)
+    {
+    case TEE_WRITE:
+      g_output_stream_write_all (job->output, job->buffer, job->count, NULL,
+                                 job->cancellable, &job->error);
+      break;
+    case TEE_FLUSH:
+      g_output_stream_flush (job->output, job->cancellable, &job->error);
+      break;
+    case TEE_CLOSE:
+      g_output_stream_close (job->output, job->cancellable, &job->error);
+      break;
+    }
+}
+
+static void
+pool_func (gpointer data, gpointer user_data)
+{
+  TeeJob *job = data;
+  TeeOutputStream *self = job->self;
+
+  int saved = io_priority_apply (job->ioprio);
+  run_job (job);
+  io_priority_pop (saved);
+
+  g_mutex_lock (&self->mutex);
+  if (--self->pending == 0)
+    g_cond_signal (&self->done);
+  g_mutex_unlock (&self->mutex);
+}
+
+/*
+ * Run *operation* on all outputs in parallel and wait for all of them. Fails
+ * with the error of the first destination that failed.
+ */
+static gboolean
+run_all (TeeOutputStream *self, TeeOperation operation, const void *buffer,
+         gsize count, GCancellable *cancellable, GError **error)
+{
+  if (self->n_outputs == 0)
+    return TRUE;
+
+  TeeJob *jobs = g_new0 (TeeJob, self->n_outputs);
+  int ioprio = io_priority_current ();
+  for (guint i = 0; i < self->n_outputs; i++)
+    {
+      jobs[i].self = self;
+      jobs[i].output = self->outputs[i];
+      jobs[i].operation = operation;
+      jobs[i].buffer = buffer;
+      jobs[i].count = count;
+      jobs[i].cancellable = cancellable;
+      jobs[i].ioprio = ioprio;
+    }
+
+  self->pending = self->n_outputs - 1;
+  gboolean inline_only = io_pool_in_worker ();
+  for (guint i = 1; i < self->n_outputs; i++)
+    {
+      if (inline_only)
+        pool_func (&jobs[i], NULL);
+      else
+        io_pool_push (io_pool_default (), pool_func, &jobs[i]);
+    }
+  run_job (&jobs[0]);
+
+  g_mutex_lock (&self->mutex);
+  while (self->pending > 0)
+    g_cond_wait (&self->done, &self->mutex);
+  g_mutex_unlock (&self->mutex);
+
+  gboolean success = TRUE;
+  for (guint i = 0; i < self->n_outputs; i++)
+    {
+      if (!jobs[i].error)
+        continue;
+      if (success)
+        g_propagate_prefixed_error (error, jobs[i].error,
+                                    "Destination %u: ", i);
+      else
+        g_error_free (jobs[i].error);
+      success = FALSE;
+    }
+
+  g_free (jobs);
+  return success;
+}
+
+static gssize
+tee_output_stream_write (GOutputStream *stream, const void *buffer,
+                         gsize count, GCancellable *cancellable,
+                         GError **error)
+{
+  TeeOutputStream *self = TEE_OUTPUT_STREAM (stream);
+
+  if (!run_all (self, TEE_WRITE, buffer, count, cancellable, error))
+    return -1;
+  return count;
+}
+
+static gboolean
+tee_output_stream_flush (GOutputStream *stream, GCancellable *cancellable,
+                         GError **error)
+{
+  return run_all (TEE_OUTPUT_STREAM (stream), TEE_FLUSH, NULL, 0,
+                  cancellable, error);
+}
+
+static gboolean
+tee_output_stream_close (GOutputStream *stream, GCancellable *cancellable,
+                         GError **error)
+{
+  return run_all (TEE_OUTPUT_STREAM (stream), TEE_CLOSE, NULL, 0,
+                  cancellable, error);
+}
+
+static void
+tee_output_stream_finalize (GObject *object)
+{
+  TeeOutputStream *self = TEE_OUTPUT_STREAM (object);
+
+  for (guint i = 0; i < self->n_outputs; i++)
+    g_object_unref (self->outputs[i]);
+  g_free (self->outputs);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->done);
+
+  G_OBJECT_CLASS (tee_output_stream_parent_class)->finalize (object);
+}
+
+static void
+tee_output_stream_class_init (TeeOutputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = tee_output_stream_finalize;
+  stream_class->write_fn = tee_output_stream_write;
+  stream_class->flush = tee_output_stream_flush;
+  stream_class->close_fn = tee_output_stream_close;
+}
+
+static void
+tee_output_stream_init (TeeOutputStream *self)
+{
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->done);
+}
+
+/*
+ * Create a stream writing to all of *outputs*, taking a reference to each.
+ * Closing it closes them.
+ */
+GOutputStream *
+tee_output_stream_new (GOutputStream **outputs, guint n_outputs)
+{
+  TeeOutputStream *self = g_object_new (TEE_TYPE_OUTPUT_STREAM, NULL);
+
+  self->outputs = g_new0 (GOutputStream *, MAX (n_outputs, 1));
+  for (guint i = 0; i < n_outputs; i++)
+    self->outputs[i] = g_object_ref (outputs[i]);
+  self->n_outputs = n_outputs;
+
+  return G_OUTPUT_STREAM (self);
+}
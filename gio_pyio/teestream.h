@@ -0,0 +1,17 @@
+#ifndef TEESTREAM_H
+#define TEESTREAM_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define TEE_TYPE_OUTPUT_STREAM (tee_output_stream_get_type ())
+G_DECLARE_FINAL_TYPE (TeeOutputStream, tee_output_stream, TEE, OUTPUT_STREAM,
+                      GOutputStream)
+
+GOutputStream *tee_output_stream_new (GOutputStream **outputs,
+                                      guint n_outputs);
+
+G_END_DECLS
+
+#endif
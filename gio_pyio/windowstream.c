@@ -0,0 +1,232 @@
+#include "windowstream.h"
+#include <errno.h>
+#include <unistd.h>
+
+/*
+ * A seekable view of the bytes from start to end of another stream, with its
+ * own position. Reads are positional, so any number of windows can share one
+ * stream: with pread() on a private duplicate of its descriptor where there
+ * is one, otherwise by seeking the shared stream under its owner's lock and
+ * restoring its position afterwards.
+ */
+struct _WindowInputStream
+{
+  GInputStream parent_instance;
+  GInputStream *base;
+  // Serialises use of base with its owner, held without the GIL
+  PyThread_type_lock lock;
+  // Owned duplicate of the descriptor of base, -1 if there is none
+  int fd;
+  goffset start;
+  goffset end;
+  goffset position;
+};
+
+static void window_input_stream_seekable_iface_init (GSeekableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (
+    WindowInputStream, window_input_stream, G_TYPE_INPUT_STREAM,
+    G_IMPLEMENT_INTERFACE (G_TYPE_SEEKABLE,
+                           window_input_stream_seekable_iface_init))
+
+static gssize
+read_at_fd (WindowInputStream *self, void *buffer, gsize count,
+            GError **error)
+{
+  gssize n;
+
+  do
+    n = pread (self->fd, buffer, count, self->position);
+  while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Error reading from file: %s", g_strerror (errsv));
+    }
+  return n;
+}
+
+static gssize
+read_at_base (WindowInputStream *self, void *buffer, gsize count,
+              GCancellable *cancellable, GError **error)
+{
+  GSeekable *seekable = G_SEEKABLE (self->base);
+  gssize n = -1;
+
+  PyThread_acquire_lock (self->lock, WAIT_LOCK);
+
+  goffset saved = g_seekable_tell (seekable);
+  if (g_seekable_seek (seekable, self->position, G_SEEK_SET, cancellable,
+                       error))
+    {
+      n = g_input_stream_read (self->base, buffer, count, cancellable, error);
+
+      // Leave the shared stream where its owner had it
+      if (!g_seekable_seek (seekable, saved, G_SEEK_SET, NULL,
+                            n < 0 ? NULL : error))
+        n = -1;
+    }
+
+  PyThread_release_lock (self->lock);
+  return n;
+}
+
+static gssize
+window_input_stream_read (GInputStream *stream, void *buffer, gsize count,
+                          GCancellable *cancellable, GError **error)
+{
+  WindowInputStream *self = WINDOW_INPUT_STREAM (stream);
+
+  if (g_input_stream_is_closed (self->base))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                           "Underlying stream is closed");
+      return -1;
+    }
+
+  if (self->position >= self->end)
+    return 0;
+  count = MIN (count, (guint64)(self->end - self->position));
+
+  gssize n = self->fd >= 0
+                 ? read_at_fd (self, buffer, count, error)
+                 : read_at_base (self, buffer, count, cancellable, error);
+  if (n > 0)
+    self->position += n;
+  return n;
+}
+
+static gboolean
+window_input_stream_close (GInputStream *stream, GCancellable *cancellable,
+                           GError **error)
+{
+  WindowInputStream *self = WINDOW_INPUT_STREAM (stream);
+
+  // The shared stream belongs to the owner, only drop the duplicate
+  if (self->fd >= 0)
+    {
+      close (self->fd);
+      self->fd = -1;
+    }
+  return TRUE;
+}
+
+static goffset
+window_input_stream_tell (GSeekable *seekable)
+{
+  WindowInputStream *self = WINDOW_INPUT_STREAM (seekable);
+
+  return self->position - self->start;
+}
+
+static gboolean
+window_input_stream_can_seek (GSeekable *seekable)
+{
+  return TRUE;
+}
+
+static gboolean
+window_input_stream_seek (GSeekable *seekable, goffset offset, GSeekType type,
+                          GCancellable *cancellable, GError **error)
+{
+  WindowInputStream *self = WINDOW_INPUT_STREAM (seekable);
+  goffset target;
+
+  switch (type)
+    {
+    case G_SEEK_SET:
+      target = self->start + offset;
+      break;
+    case G_SEEK_CUR:
+      target = self->position + offset;
+      break;
+    default:
+      target = self->end + offset;
+    }
+
+  if (target < self->start)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                           "Invalid seek request");
+      return FALSE;
+    }
+
+  self->position = target;
+  return TRUE;
+}
+
+static gboolean
+window_input_stream_can_truncate (GSeekable *seekable)
+{
+  return FALSE;
+}
+
+static gboolean
+window_input_stream_truncate (GSeekable *seekable, goffset offset,
+                              GCancellable *cancellable, GError **error)
+{
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Truncate not supported on stream");
+  return FALSE;
+}
+
+static void
+window_input_stream_seekable_iface_init (GSeekableIface *iface)
+{
+  iface->tell = window_input_stream_tell;
+  iface->can_seek = window_input_stream_can_seek;
+  iface->seek = window_input_stream_seek;
+  iface->can_truncate = window_input_stream_can_truncate;
+  iface->truncate_fn = window_input_stream_truncate;
+}
+
+static void
+window_input_stream_finalize (GObject *object)
+{
+  WindowInputStream *self = WINDOW_INPUT_STREAM (object);
+
+  if (self->fd >= 0)
+    close (self->fd);
+  g_clear_object (&self->base);
+
+  G_OBJECT_CLASS (window_input_stream_parent_class)->finalize (object);
+}
+
+static void
+window_input_stream_class_init (WindowInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = window_input_stream_finalize;
+  stream_class->read_fn = window_input_stream_read;
+  stream_class->close_fn = window_input_stream_close;
+}
+
+static void
+window_input_stream_init (WindowInputStream *self)
+{
+  self->fd = -1;
+}
+
+/*
+ * Create a window over *base*, which must be seekable unless *fd* is given.
+ * *lock* must outlive the window. The window takes ownership of *fd*.
+ */
+GInputStream *
+window_input_stream_new (GInputStream *base, PyThread_type_lock lock, int fd,
+                         goffset start, goffset end)
+{
+  WindowInputStream *self = g_object_new (WINDOW_TYPE_INPUT_STREAM, NULL);
+
+  self->base = g_object_ref (base);
+  self->lock = lock;
+  self->fd = fd;
+  self->start = start;
+  self->end = end;
+  self->position = start;
+
+  return G_INPUT_STREAM (self);
+}
@@ -0,0 +1,20 @@
+#ifndef WINDOWSTREAM_H
+#define WINDOWSTREAM_H
+
+#include <Python.h>
+#include <gio/gio.h>
+#include <pythread.h>
+
+G_BEGIN_DECLS
+
+#define WINDOW_TYPE_INPUT_STREAM (window_input_stream_get_type ())
+G_DECLARE_FINAL_TYPE (WindowInputStream, window_input_stream, WINDOW,
+                      INPUT_STREAM, GInputStream)
+
+GInputStream *window_input_stream_new (GInputStream *base,
+                                       PyThread_type_lock lock, int fd,
+                                       goffset start, goffset end);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,203 @@
+#define PY_SSIZE_T_CLEAN
+#include "throttledstream.h"
+#include <Python.h>
+#include <pygobject.h>
+
+static int
+parse_params (ThrottleParams *params, double latency, double jitter,
+              long long bandwidth, Py_ssize_t max_chunk, unsigned int seed)
+{
+  if (latency < 0 || jitter < 0 || bandwidth < 0 || max_chunk < 0)
+    {
+      PyErr_SetString (PyExc_ValueError,
+                       "throttle parameters must not be negative");
+      return -1;
+    }
+
+  params->latency = (gint64)(latency * G_USEC_PER_SEC);
+  params->jitter = (gint64)(jitter * G_USEC_PER_SEC);
+  params->bandwidth = (guint64)bandwidth;
+  params->max_chunk = (gsize)max_chunk;
+  params->seed = seed;
+  params->fail_after = -1;
+  return 0;
+}
+
+static PyObject *
+err_gerror (GError *error)
+{
+  PyErr_SetString (PyExc_OSError, error->message);
+  g_error_free (error);
+  return NULL;
+}
+
+static PyObject *
+wrap_stream (gpointer stream)
+{
+  // pygobject_new takes its own reference
+  PyObject *result = pygobject_new (G_OBJECT (stream));
+  g_object_unref (stream);
+  return result;
+}
+
+PyDoc_STRVAR (
+    throttled_input_doc,
+    "Open *source* as an input stream behaving like a remote backend.\n"
+    "\n"
+    "The stream is seekable if *source* is.\n"
+    "\n"
+    ":param source:\n"
+    "   Path of a local file, or a bytes-like object to read from memory.\n"
+    ":param float latency:\n"
+    "   Seconds added to every read and seek.\n"
+    ":param float jitter:\n"
+    "   Upper bound of random seconds added on top of *latency*.\n"
+    ":param int bandwidth:\n"
+    "   Bytes per second, 0 for unlimited.\n"
+    ":param int max_chunk:\n"
+    "   Upper bound of bytes returned per read, 0 for unlimited.\n"
+    ":param int seed:\n"
+    "   Seed for *jitter*.\n"
+    ":param int fail_after:\n"
+    "   Bytes read before reads fail with ``G_IO_ERROR_BROKEN_PIPE`` as if\n"
+    "   the connection dropped, -1 for never.\n"
+    ":rtype: Gio.InputStream\n"
+    ":returns:\n"
+    "   A new throttled stream.");
+static PyObject *
+throttled_input (PyObject *module, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = { "source",    "latency", "jitter",     "bandwidth",
+                            "max_chunk", "seed",    "fail_after", NULL };
+  PyObject *source;
+  double latency = 0, jitter = 0;
+  long long bandwidth = 0;
+  Py_ssize_t max_chunk = 0;
+  unsigned int seed = 0;
+  long long fail_after = -1;
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "O|$ddLnIL", kwlist, &source,
+                                    &latency, &jitter, &bandwidth,
+                                    &max_chunk, &seed, &fail_after))
+    return NULL;
+
+  ThrottleParams params;
+  if (parse_params (&params, latency, jitter, bandwidth, max_chunk, seed) < 0)
+    return NULL;
+  params.fail_after = fail_after;
+
+  GInputStream *base;
+  if (PyUnicode_Check (source) || PyObject_HasAttrString (source, "__fspath__"))
+    {
+      PyObject *path = NULL;
+      if (!PyUnicode_FSConverter (source, &path))
+        return NULL;
+
+      GError *error = NULL;
+      GFile *file = g_file_new_for_path (PyBytes_AS_STRING (path));
+      Py_DECREF (path);
+      base = G_INPUT_STREAM (g_file_read (file, NULL, &error));
+      g_object_unref (file);
+      if (!base)
+        return err_gerror (error);
+    }
+  else
+    {
+      Py_buffer view;
+      if (PyObject_GetBuffer (source, &view, PyBUF_SIMPLE) < 0)
+        return NULL;
+
+      GBytes *bytes = g_bytes_new (view.buf, view.len);
+      PyBuffer_Release (&view);
+      base = g_memory_input_stream_new_from_bytes (bytes);
+      g_bytes_unref (bytes);
+    }
+
+  GInputStream *stream = throttled_input_stream_new (base, &params);
+  g_object_unref (base);
+  return wrap_stream (stream);
+}
+
+PyDoc_STRVAR (
+    throttled_output_doc,
+    "Open *path* as an output stream behaving like a remote backend.\n"
+    "\n"
+    "Takes the same throttle parameters as :func:`throttled_input`.\n"
+    "\n"
+    ":param path:\n"
+    "   Path of a local file to replace, or ``None`` to discard the data\n"
+    "   into memory.\n"
+    ":rtype: Gio.OutputStream\n"
+    ":returns:\n"
+    "   A new throttled stream.");
+static PyObject *
+throttled_output (PyObject *module, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = { "path",      "latency", "jitter", "bandwidth",
+                            "max_chunk", "seed",    NULL };
+  PyObject *path = Py_None;
+  double latency = 0, jitter = 0;
+  long long bandwidth = 0;
+  Py_ssize_t max_chunk = 0;
+  unsigned int seed = 0;
+
+  if (!PyArg_ParseTupleAndKeywords (args, kwds, "|O$ddLnI", kwlist, &path,
+                                    &latency, &jitter, &bandwidth,
+                                    &max_chunk, &seed))
+    return NULL;
+
+  ThrottleParams params;
+  if (parse_params (&params, latency, jitter, bandwidth, max_chunk, seed) < 0)
+    return NULL;
+
+  GOutputStream *base;
+  if (path == Py_None)
+    base = g_memory_output_stream_new_resizable ();
+  else
+    {
+      PyObject *fs_path = NULL;
+      if (!PyUnicode_FSConverter (path, &fs_path))
+        return NULL;
+
+      GError *error = NULL;
+      GFile *file = g_file_new_for_path (PyBytes_AS_STRING (fs_path));
+      Py_DECREF (fs_path);
+      base = G_OUTPUT_STREAM (g_file_replace (file, NULL, FALSE,
+                                              G_FILE_CREATE_NONE, NULL,
+                                              &error));
+      g_object_unref (file);
+      if (!base)
+        return err_gerror (error);
+    }
+
+  GOutputStream *stream = throttled_output_stream_new (base, &params);
+  g_object_unref (base);
+  return wrap_stream (stream);
+}
+
+static PyMethodDef _gio_pyio_testing_methods[]
+    = { { "throttled_input", (PyCFunction)throttled_input,
+          METH_VARARGS | METH_KEYWORDS, throttled_input_doc },
+        { "throttled_output", (PyCFunction)throttled_output,
+          METH_VARARGS | METH_KEYWORDS, throttled_output_doc },
+        { NULL, NULL, 0, NULL } };
+
+static struct PyModuleDef _gio_pyio_testing_module
+    = { PyModuleDef_HEAD_INIT,
+        "_gio_pyio_testing",
+        "Streams simulating remote backends for tests and benchmarks",
+        -1,
+        _gio_pyio_testing_methods,
+        NULL,
+        NULL,
+        NULL,
+        NULL };
+
+PyMODINIT_FUNC
+PyInit__gio_pyio_testing (void)
+{
+  if (!pygobject_init (-1, -1, -1))
+    return NULL;
+
+  return PyModule_Create (&_gio_pyio_testing_module);
+}
@@ -4,14 +4,22 @@
 # https://github.com/python/cpython/blob/main/LICENSE
 
 import contextlib
+import datetime
 import gc
+import io
 import json
+import os
 import pickle
+import socket
 import subprocess
 import sys
+import sysconfig
+import threading
+import tracemalloc
 import unittest
 from array import array
 from collections import UserList
+from multiprocessing.reduction import ForkingPickler
 from pathlib import Path
 from weakref import proxy
 
@@ -19,6 +27,20 @@ from gi.repository import GLib, Gio
 
 import gio_pyio
 
+try:
+    import _interpreters as interpreters
+except ImportError:
+    try:
+        import _xxsubinterpreters as interpreters
+    except ImportError:
+        interpreters = None
+
+try:
+    # Built by meson with -Dtesting=true, see tests/meson.build
+    import _gio_pyio_testing
+except ImportError:
+    _gio_pyio_testing = None
+
 
 class GioPyIO(unittest.TestCase):
 
@@ -38,6 +60,68 @@ class GioPyIO(unittest.TestCase):
         self.f = gio_pyio.open(self.file, 'wb', buffering=0, native=False)
         self.assertTrue(isinstance(self.f, gio_pyio.StreamWrapper))
 
+    def testNativeAuto(self):
+        self.f.write(b'spam')
+        self.f.close()
+        profile = self.file.get_path() + '.routes'
+        os.environ['GIO_PYIO_ROUTE_PROFILE'] = profile
+        self.addCleanup(os.environ.pop, 'GIO_PYIO_ROUTE_PROFILE')
+        # Local files need no measuring
+        self.f = gio_pyio.open(self.file, 'rb', buffering=0, native='auto')
+        self.assertIsInstance(self.f, io.FileIO)
+        self.assertEqual(self.f.read(), b'spam')
+        self.assertFalse(os.path.exists(profile))
+        self.assertRaises(ValueError, gio_pyio.open, self.file, 'rb',
+                          native='fuse')
+
+    def testFdFastPath(self):
+        self.f.write(b'spam\neggs\nham')
+        self.f.close()
+        self.f = gio_pyio.open(self.file, 'r+b', buffering=0, native=False)
+        self.assertEqual(self.f.readline(), b'spam\n')
+        # The rest of the file is buffered now
+        self.assertEqual(self.f.tell(), 5)
+        self.assertEqual(self.f.read(4), b'eggs')
+        self.assertEqual(self.f.seek(1, 1), 10)
+        self.assertEqual(self.f.read(), b'ham')
+        self.assertEqual(os.lseek(self.f.fileno(), 0, os.SEEK_CUR), 13)
+        self.assertEqual(self.f.seek(-3, 2), 10)
+        self.assertEqual(self.f.write(b'SPAM'), 4)
+        self.assertEqual(self.f.tell(), 14)
+        self.assertEqual(self.f.seek(0), 0)
+        buffer = bytearray(5)
+        self.assertEqual(self.f.readinto(buffer), 5)
+        self.assertEqual(buffer, b'spam\n')
+        self.f.close()
+        with gio_pyio.open(self.file, 'rb', native=True) as f:
+            self.assertEqual(f.read(), b'spam\neggs\nSPAM')
+
+    def testReadintoMany(self):
+        self.f.write(b'HEADpayload!')
+        self.f.close()
+        self.f = gio_pyio.open(self.file, 'rb', buffering=0, native=False)
+        header, empty, payload = bytearray(4), bytearray(), bytearray(10)
+        self.assertEqual(self.f.readinto_many([header, empty, payload]), 12)
+        self.assertEqual(header, b'HEAD')
+        self.assertEqual(payload[:8], b'payload!')
+        self.assertEqual(self.f.readinto_many([bytearray(1)]), 0)
+        first, second = bytearray(3), memoryview(bytearray(2))
+        self.assertEqual(self.f.readinto_many_at(4, [first, second]), 5)
+        self.assertEqual((first, second.tobytes()), (b'pay', b'lo'))
+        self.assertEqual(self.f.tell(), 12)
+        self.assertRaises(BufferError, self.f.readinto_many, [b'spam'])
+        self.assertRaises(ValueError, self.f.readinto_many_at, -1, [])
+
+        # Streams without a descriptor are read one buffer at a time
+        memory = Gio.MemoryInputStream.new_from_bytes(GLib.Bytes(b'spameggs'))
+        with gio_pyio.StreamWrapper(memory) as f:
+            buffers = [bytearray(3), bytearray(3)]
+            self.assertEqual(f.readinto_many_at(2, buffers), 6)
+            self.assertEqual(buffers, [b'ame', b'ggs'])
+            self.assertEqual(f.tell(), 0)
+            self.assertEqual(f.readinto_many(buffers), 6)
+            self.assertEqual(buffers, [b'spa', b'meg'])
+
     def testContextManager(self):
         self.f.close()
         with gio_pyio.open(self.file, 'wb', buffering=0, native=False) as f:
@@ -398,3 +482,552 @@ class GioPyIO(unittest.TestCase):
     def testStreamWrapper(self):
         bogus = 'Hello'
         self.assertRaises(TypeError, gio_pyio.StreamWrapper, bogus)
+
+    def testLazyImport(self):
+        code = ('import sys, gio_pyio\n'
+                'print(any(m.startswith("gi.repository") for m in sys.modules))')
+        result = subprocess.run([sys.executable, '-c', code],
+                                capture_output=True, text=True, check=True)
+        self.assertEqual(result.stdout.strip(), 'False')
+
+    def testFromFd(self):
+        r, w = os.pipe()
+        with gio_pyio.StreamWrapper.from_fd(w, 'wb') as f:
+            self.assertTrue(f.writable())
+            self.assertFalse(f.readable())
+            self.assertEqual(f.fileno(), w)
+            f.write(b'spam\neggs\n')
+        with gio_pyio.StreamWrapper.from_fd(r, 'rb') as f:
+            self.assertEqual(f.readlines(), [b'spam\n', b'eggs\n'])
+        self.assertRaises(OSError, os.fstat, r)
+
+        r, w = os.pipe()
+        f = gio_pyio.StreamWrapper.from_fd(r, close_fd=False)
+        f.close()
+        # Failing leaves the descriptor to the caller
+        self.assertRaises(ValueError, gio_pyio.StreamWrapper.from_fd, w, 'w',
+                          offset=5)
+        self.assertRaises(OSError, gio_pyio.StreamWrapper.from_fd, r,
+                          offset=5)
+        os.close(w)
+        os.close(r)
+
+        self.assertRaises(ValueError, gio_pyio.StreamWrapper.from_fd, 0, 'rw')
+        self.assertRaises(OSError, gio_pyio.StreamWrapper.from_fd, -1)
+
+    def testFromCapsule(self):
+        self.f.close()
+        stream = self.file.read(None)
+        with gio_pyio.StreamWrapper.from_capsule(stream.__gpointer__) as f:
+            self.assertTrue(f.readable())
+        self.assertTrue(stream.is_closed())
+        self.assertRaises(TypeError, gio_pyio.StreamWrapper.from_capsule,
+                          self.file.__gpointer__)
+        self.assertRaises(TypeError, gio_pyio.StreamWrapper.from_capsule,
+                          datetime.datetime_CAPI)
+
+    @unittest.skipIf(interpreters is None, 'requires Python 3.12')
+    def testSubinterpreter(self):
+        code = (
+            'import io, os, gio_pyio\n'
+            'r, w = os.pipe()\n'
+            'os.write(w, b"spam")\n'
+            'os.close(w)\n'
+            'with gio_pyio.StreamWrapper.from_fd(r) as f:\n'
+            '    assert f.read() == b"spam"\n'
+            '    try:\n'
+            '        f.write(b"eggs")\n'
+            '    except io.UnsupportedOperation:\n'
+            '        pass\n')
+        interp = interpreters.create()
+        try:
+            # Python 3.13 returns the failure, 3.12 raises it
+            error = interpreters.run_string(interp, code)
+        except Exception as e:
+            error = e
+        finally:
+            interpreters.destroy(interp)
+        self.assertIsNone(error)
+
+    def testHandle(self):
+        data = bytes(range(256))
+        self.f.write(data)
+        self.f.close()
+        self.f = gio_pyio.open(self.file, 'rb', buffering=0, native=False)
+        handle = self.f.handle(10, 5)
+        self.assertEqual(handle.uri, self.file.get_uri())
+        self.assertEqual(handle.mode, 'rb')
+
+        copy = pickle.loads(pickle.dumps(handle))
+        self.assertEqual(copy.uri, handle.uri)
+        self.assertEqual(copy.etag, handle.etag)
+        with copy.open() as f:
+            self.assertEqual(f.read(copy.length), data[10:15])
+
+        # multiprocessing passes the descriptor along
+        copy = pickle.loads(ForkingPickler.dumps(handle))
+        with copy.open() as f:
+            self.assertEqual(f.read(copy.length), data[10:15])
+        self.assertEqual(self.f.tell(), 0)
+
+        self.file.replace_contents(b'changed', None, False,
+                                   Gio.FileCreateFlags.NONE, None)
+        copy = pickle.loads(pickle.dumps(handle))
+        self.assertRaises(OSError, copy.open)
+        self.assertRaises(OSError, handle.open)
+
+    def testBounded(self):
+        data = b'spam\neggs\nbacon\n'
+        self.f.write(data)
+        self.f.close()
+        self.f = gio_pyio.StreamWrapper(self.file.read(None), offset=5,
+                                        length=10)
+        self.assertFalse(self.f.writable())
+        self.assertEqual(self.f.readline(), b'eggs\n')
+        self.assertEqual(self.f.tell(), 5)
+        self.assertEqual(self.f.read(), b'bacon')
+        self.assertEqual(self.f.read(), b'')
+        self.assertEqual(self.f.seek(-3, 2), 7)
+        self.assertEqual(self.f.read(10), b'con')
+        self.f.seek(0)
+        self.assertEqual(self.f.readlines(), [b'eggs\n', b'bacon\n'])
+        self.assertRaises(ValueError, self.f.seek, -1)
+
+    def testWindow(self):
+        data = bytes(range(256)) * 64
+        self.f.write(data)
+        self.f.close()
+        self.f = gio_pyio.StreamWrapper(self.file.read(None))
+        self.f.seek(10)
+        windows = [self.f.window(i * 4096, 4096) for i in range(4)]
+        self.assertEqual(windows[1].read(4), data[4096:4100])
+        self.assertEqual(windows[1].tell(), 4)
+        self.assertEqual(windows[0].seek(-2, 2), 4094)
+        self.assertEqual(windows[0].read(), data[4094:4096])
+        self.assertEqual(self.f.window(16000).read(), data[16000:])
+        results = {}
+
+        def read(i):
+            windows[i].seek(0)
+            results[i] = b''.join(iter(lambda: windows[i].read(100), b''))
+
+        threads = [threading.Thread(target=read, args=(i,)) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(b''.join(results[i] for i in range(4)), data[:16384])
+        self.assertEqual(self.f.tell(), 10)
+        for window in windows:
+            window.close()
+        self.assertEqual(self.f.read(2), data[10:12])
+
+    def testConcat(self):
+        self.f.write(b'spam\neg')
+        self.f.close()
+        other, stream = Gio.File.new_tmp('TestGFile.XXXXXX')
+        stream.get_output_stream().write_all(b'gs\nbacon\n', None)
+        stream.close()
+        self.addCleanup(other.delete, None)
+        memory = Gio.MemoryInputStream.new_from_bytes(GLib.Bytes(b'ham\n'))
+        self.f = gio_pyio.concat([self.file, memory, other, self.file])
+        self.assertFalse(self.f.writable())
+        self.assertEqual(self.f.readlines(),
+                         [b'spam\n', b'egham\n', b'gs\n', b'bacon\n',
+                          b'spam\n', b'eg\n'])
+        self.assertEqual(self.f.seek(5), 5)
+        self.assertEqual(self.f.read(8), b'egham\ngs')
+        self.assertEqual(self.f.seek(-3, 2), 24)
+        self.assertEqual(self.f.read(), b'\neg')
+        self.assertEqual(self.f.seek(8), 8)
+        self.assertEqual(self.f.read(3), b'am\n')
+        self.assertRaises(TypeError, gio_pyio.concat, [b'spam'])
+
+    def testTee(self):
+        self.f.close()
+        memory = Gio.MemoryOutputStream.new_resizable()
+        output = self.file.replace(None, False, Gio.FileCreateFlags.NONE,
+                                   None)
+        self.f = gio_pyio.tee([output, memory])
+        self.assertFalse(self.f.readable())
+        data = bytes(range(256)) * 1024
+        self.f.write(data)
+        self.f.write(b'spam')
+        self.f.close()
+        self.assertTrue(memory.is_closed())
+        self.assertEqual(memory.steal_as_bytes().get_data(), data + b'spam')
+        with gio_pyio.open(self.file, 'rb', buffering=0, native=False) as f:
+            self.assertEqual(f.read(), data + b'spam')
+
+    def testIOPool(self):
+        self.f.write(b'spam\n')
+        self.f.close()
+        self.f = None
+        self.addCleanup(gio_pyio.set_io_pool, 'file:///', 8)
+        gio_pyio.set_io_pool('file:///', 2, cpus=[0])
+        completed = gio_pyio.io_pool_stats()['file://']['completed']
+
+        # Opening the second file ahead of time runs on the file:// pool
+        with gio_pyio.concat([self.file, self.file]) as f:
+            self.assertEqual(f.read(), b'spam\n' * 2)
+        stats = gio_pyio.io_pool_stats()['file://']
+        self.assertEqual(stats['max_threads'], 2)
+        self.assertGreater(stats['completed'], completed)
+        self.assertLessEqual(stats['threads'], 2)
+
+        completed = gio_pyio.io_pool_stats()[None]['completed']
+        outputs = [Gio.MemoryOutputStream.new_resizable() for _ in range(3)]
+        with gio_pyio.tee(outputs) as f:
+            f.write(b'spam')
+        self.assertGreater(gio_pyio.io_pool_stats()[None]['completed'],
+                           completed)
+
+        self.assertRaises(ValueError, gio_pyio.set_io_pool, None, 0)
+        self.assertRaises(ValueError, gio_pyio.set_io_pool, 'spam', 1)
+
+    def testSplitRanges(self):
+        lines = [b'x' * (i % 7) + b'\n' for i in range(100)]
+        self.f.write(b''.join(lines))
+        self.f.close()
+        self.f = None
+        ranges = gio_pyio.split_ranges(self.file, 4)
+        self.assertEqual(len(ranges), 4)
+        self.assertEqual(ranges[0].offset, 0)
+        read = []
+        for handle, next_handle in zip(ranges, ranges[1:] + [None]):
+            if next_handle is not None:
+                self.assertEqual(handle.offset + handle.length,
+                                 next_handle.offset)
+            with pickle.loads(pickle.dumps(handle)).open() as f:
+                chunk = f.read()
+                self.assertTrue(chunk.endswith(b'\n'))
+                read.append(chunk)
+        self.assertEqual(b''.join(read), b''.join(lines))
+
+        # The handles' descriptors outlive the wrapper they came from
+        with ranges[-1].open() as f:
+            self.assertEqual(f.read(), read[-1])
+
+    def testMemoryUsage(self):
+        self.f.write(b'spam\n' * 100)
+        self.f.close()
+        self.f = gio_pyio.open(self.file, 'rb', buffering=0, native=False)
+        usage = self.f.memory_usage()
+        self.assertGreater(usage['buffer'], 0)
+        self.assertEqual(usage['scratch'], 0)
+        self.f.readlines()
+        usage = self.f.memory_usage()
+        self.assertEqual(usage['scratch'], 0)
+        self.assertGreater(usage['peak_scratch'], 0)
+        self.assertEqual(usage['total'], usage['buffer'])
+
+    def testTracemallocDomain(self):
+        self.f.close()
+        tracemalloc.start()
+        try:
+            self.f = gio_pyio.open(self.file, 'rb', buffering=0,
+                                   native=False)
+            domain = tracemalloc.DomainFilter(True,
+                                              gio_pyio.TRACEMALLOC_DOMAIN)
+            snapshot = tracemalloc.take_snapshot().filter_traces([domain])
+            self.assertTrue(snapshot.traces)
+            self.f.close()
+            self.f = None
+            gc.collect()
+            snapshot = tracemalloc.take_snapshot().filter_traces([domain])
+            self.assertFalse(snapshot.traces)
+        finally:
+            tracemalloc.stop()
+
+    def testConcurrentReads(self):
+        block = bytes(range(256))
+        self.f.write(block * 400)
+        self.f.close()
+        self.f = gio_pyio.open(self.file, 'rb', buffering=0, native=False)
+        chunks = []
+
+        def reader():
+            while chunk := self.f.read(len(block)):
+                chunks.append(chunk)
+
+        threads = [threading.Thread(target=reader) for _i in range(8)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(len(chunks), 400)
+        self.assertTrue(all(chunk == block for chunk in chunks))
+
+    def testConcurrentReadWrite(self):
+        a, b = socket.socketpair()
+        self.addCleanup(a.close)
+        self.addCleanup(b.close)
+        f = gio_pyio.StreamWrapper.from_fd(a.fileno(), 'r+b', close_fd=False)
+        self.addCleanup(f.close)
+        received = []
+
+        # A read blocked on the input side must not hold up the output side
+        reader = threading.Thread(target=lambda: received.append(f.read(4)),
+                                  daemon=True)
+        reader.start()
+        writer = threading.Thread(target=f.write, args=(b'ping',),
+                                  daemon=True)
+        writer.start()
+        writer.join(5)
+        self.assertFalse(writer.is_alive())
+        self.assertEqual(b.recv(4), b'ping')
+        b.sendall(b'pong')
+        reader.join(5)
+        self.assertEqual(received, [b'pong'])
+
+    def testCancel(self):
+        a, b = socket.socketpair()
+        self.addCleanup(a.close)
+        self.addCleanup(b.close)
+        f = gio_pyio.StreamWrapper.from_fd(a.fileno(), 'rb', close_fd=False)
+        self.addCleanup(f.close)
+
+        f.timeout = 0.05
+        self.assertEqual(f.timeout, 0.05)
+        self.assertRaises(TimeoutError, f.read, 1)
+        f.timeout = None
+        timer = threading.Timer(0.05, f.cancel)
+        timer.start()
+        self.assertRaises(InterruptedError, f.read, 1)
+        timer.join()
+        # Neither outlives the operation it cancelled
+        b.sendall(b'x')
+        self.assertEqual(f.read(1), b'x')
+
+    def testPriority(self):
+        self.f.write(b'spam')
+        self.f.close()
+        self.f = None
+
+        with gio_pyio.open(self.file, 'rb', native=False,
+                           priority=GLib.PRIORITY_LOW) as f:
+            self.assertEqual(f.raw.priority, GLib.PRIORITY_LOW)
+            self.assertEqual(f.read(2), b'sp')
+            f.raw.priority = GLib.PRIORITY_HIGH
+            self.assertEqual(f.raw.priority, GLib.PRIORITY_HIGH)
+            self.assertEqual(f.read(), b'am')
+            with self.assertRaises(TypeError):
+                f.raw.priority = 'high'
+
+    def testLimiter(self):
+        self.f.close()
+        self.f = None
+        data = bytes(range(250)) * 12
+        # A full bucket holds 1000 bytes, the rest takes 0.1s to earn
+        limiter = gio_pyio.Limiter(bandwidth=20000, iops=1000, burst=0.05)
+
+        with gio_pyio.open(self.file, 'wb', buffering=0, native=False,
+                           limiter=limiter) as f:
+            self.assertIs(f.limiter, limiter)
+            self.assertEqual(f.write(data), len(data))
+        stats = limiter.stats()
+        self.assertEqual(stats['bytes'], len(data))
+        self.assertEqual(stats['operations'], 3)
+        self.assertGreaterEqual(stats['waits'], 1)
+        self.assertGreater(stats['wait_time'], 0.02)
+
+        limiter.bandwidth = None
+        self.assertIsNone(limiter.bandwidth)
+        with gio_pyio.open(self.file, 'rb', native=False,
+                           limiter=limiter) as f:
+            self.assertEqual(f.read(), data)
+        self.assertEqual(limiter.stats()['bytes'], 2 * len(data))
+
+        # Line reads refill the buffer through the limiter too
+        with gio_pyio.open(self.file, 'rb', buffering=0, native=False,
+                           limiter=limiter) as f:
+            while f.readline():
+                pass
+        self.assertEqual(limiter.stats()['bytes'], 3 * len(data))
+
+        self.assertRaises(ValueError, gio_pyio.Limiter, bandwidth=0)
+        self.assertRaises(TypeError, gio_pyio.open, self.file, 'rb',
+                          native=False, limiter=object())
+
+    def testBackendConcurrency(self):
+        uri = self.file.get_uri()
+        self.addCleanup(gio_pyio.set_backend_concurrency, uri, 0)
+        gio_pyio.set_backend_concurrency(uri, 1)
+        self.assertEqual(gio_pyio.backend_stats('file:///')['limit'], 1)
+
+        # The writes hold no slot while the iterable reads from the backend
+        other, stream = Gio.File.new_tmp('TestGFile.XXXXXX')
+        stream.close()
+        self.addCleanup(other.delete, None)
+        other.replace_contents(b'spam\n' * 4, None, False,
+                               Gio.FileCreateFlags.NONE, None)
+        with gio_pyio.open(other, 'rb', native=False) as src:
+            self.f.writelines(iter(src.readline, b''))
+        self.f.close()
+        self.f = None
+
+        results = []
+
+        def read():
+            with gio_pyio.open(self.file, 'rb', native=False) as f:
+                results.append(f.read())
+
+        threads = [threading.Thread(target=read) for _ in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join(5)
+        self.assertEqual(results, [b'spam\n' * 4] * 4)
+        stats = gio_pyio.backend_stats(uri)
+        self.assertEqual((stats['active'], stats['waiting']), (0, 0))
+        self.assertGreater(stats['operations'], 4)
+
+        gio_pyio.set_backend_concurrency(uri, 'auto')
+        stats = gio_pyio.backend_stats(uri)
+        self.assertEqual((stats['limit'], stats['auto']), (4, True))
+        self.assertRaises(ValueError, gio_pyio.set_backend_concurrency, uri,
+                          'fast')
+        self.assertRaises(ValueError, gio_pyio.backend_stats, 'spam')
+
+    def testScheduler(self):
+        self.f.close()
+        self.f = None
+        data = bytes(range(250)) * 20
+        scheduler = gio_pyio.Scheduler(slots=2, quantum=1000)
+        scheduler.set_weight('bulk', 0.5)
+
+        with gio_pyio.open(self.file, 'wb', buffering=0, native=False,
+                           scheduler=scheduler, tenant='bulk') as f:
+            self.assertEqual(f.write(data), len(data))
+        with gio_pyio.open(self.file, 'rb', buffering=0, native=False,
+                           scheduler=scheduler) as f:
+            self.assertEqual(f.read(1500), data[:1500])
+
+        stats = scheduler.stats()
+        self.assertEqual(stats['bulk']['weight'], 0.5)
+        self.assertEqual(stats['bulk']['bytes'], len(data))
+        self.assertEqual(stats['bulk']['operations'], 5)
+        self.assertEqual(stats['']['bytes'], 1500)
+        self.assertEqual(stats['']['operations'], 2)
+
+        self.assertRaises(ValueError, gio_pyio.Scheduler, slots=0)
+        self.assertRaises(ValueError, scheduler.set_weight, 'bulk', 0)
+        self.assertRaises(ValueError, gio_pyio.open, self.file, 'rb',
+                          native=False, tenant='bulk')
+
+    def testSpooled(self):
+        with gio_pyio.SpooledStreamWrapper(8) as f:
+            self.assertTrue(f.writable())
+            self.assertFalse(f.readable())
+            f.write(b'spam')
+            self.assertFalse(f.spilled)
+            buffer = f.getbuffer()
+            self.assertTrue(f.closed)
+        self.assertEqual(buffer, b'spam')
+        self.assertTrue(buffer.readonly)
+        with f.contents() as g:
+            self.assertEqual(g.read(), b'spam')
+
+        f = gio_pyio.SpooledStreamWrapper(8)
+        f.write(b'spam')
+        f.seek(2)
+        f.write(b'AM and eggs')
+        # Moved to the file, still at the same position
+        self.assertTrue(f.spilled)
+        self.assertEqual(f.tell(), 13)
+        f.seek(0)
+        f.write(b'S')
+        self.assertRaises(io.UnsupportedOperation, f.getbuffer)
+        for _ in range(2):
+            with f.contents() as g:
+                self.assertEqual(g.read(), b'SpAM and eggs')
+        self.assertRaises(ValueError, gio_pyio.SpooledStreamWrapper, -1)
+
+        # Inherited classmethods don't spool
+        r, w = os.pipe()
+        os.close(r)
+        with gio_pyio.SpooledStreamWrapper.from_fd(w, 'wb') as f:
+            self.assertIs(type(f), gio_pyio.StreamWrapper)
+        f = gio_pyio.SpooledStreamWrapper.__new__(
+            gio_pyio.SpooledStreamWrapper)
+        self.assertRaises(ValueError, getattr, f, 'spilled')
+        self.assertRaises(ValueError, f.getbuffer)
+        self.assertRaises(ValueError, f.contents)
+
+    @unittest.skipUnless(sysconfig.get_config_var('Py_GIL_DISABLED'),
+                         'requires a free-threaded build')
+    def testGILNotUsed(self):
+        code = 'import sys, gio_pyio\nprint(sys._is_gil_enabled())'
+        result = subprocess.run([sys.executable, '-c', code],
+                                capture_output=True, text=True, check=True)
+        self.assertEqual(result.stdout.strip(), 'False')
+
+    def testSubclass(self):
+        class Wrapper(gio_pyio.StreamWrapper):
+            pass
+
+        r, w = os.pipe()
+        os.close(w)
+        with Wrapper.from_fd(r) as f:
+            self.assertIsInstance(f, Wrapper)
+            self.assertEqual(f.read(4), b'')
+            # Raised with the exception class from the module state
+            self.assertRaises(io.UnsupportedOperation, f.write, b'spam')
+
+    def testReentrantCall(self):
+        def lines():
+            yield b'spam'
+            self.f.write(b'eggs')
+
+        self.assertRaises(RuntimeError, self.f.writelines, lines())
+        self.f.write(b'bacon')
+
+        # tell() takes the input lock too, which this thread doesn't hold
+        def positions():
+            yield b'spam'
+            self.f.tell()
+
+        self.assertRaises(RuntimeError, self.f.writelines, positions())
+        self.assertEqual(self.f.write(b'eggs'), 4)
+
+    @unittest.skipIf(_gio_pyio_testing is None, 'test helpers not built')
+    def testThrottledRead(self):
+        data = bytes(range(256)) * 64
+        stream = _gio_pyio_testing.throttled_input(data, max_chunk=100,
+                                                   latency=0.0001)
+        with gio_pyio.StreamWrapper(stream) as f:
+            self.assertEqual(f.read(1000), data[:1000])
+            f.seek(10)
+            self.assertEqual(f.read(5), data[10:15])
+            f.seek(0)
+            self.assertEqual(f.read(), data)
+
+    @unittest.skipIf(_gio_pyio_testing is None, 'test helpers not built')
+    def testRetries(self):
+        data = bytes(range(256)) * 16
+        self.file.replace_contents(data, None, False,
+                                   Gio.FileCreateFlags.NONE, None)
+        path = self.file.get_path()
+
+        stream = _gio_pyio_testing.throttled_input(path, fail_after=1000)
+        with gio_pyio.StreamWrapper(stream, file=self.file, retries=1) as f:
+            self.assertEqual(f.read(), data)
+
+        stream = _gio_pyio_testing.throttled_input(path, fail_after=1000)
+        with gio_pyio.StreamWrapper(stream, file=self.file, retries=1) as f:
+            self.assertEqual(f.read(500), data[:500])
+            os.utime(path, (0, 0))
+            self.assertRaises(OSError, f.read)
+
+        self.assertRaises(ValueError, gio_pyio.open, self.file, 'wb',
+                          retries=1)
+
+    @unittest.skipIf(_gio_pyio_testing is None, 'test helpers not built')
+    def testThrottledWrite(self):
+        self.f.close()
+        stream = _gio_pyio_testing.throttled_output(self.file.peek_path(),
+                                                    max_chunk=100)
+        with gio_pyio.StreamWrapper(stream) as f:
+            f.write(b'spam' * 1000)
+        self.f = gio_pyio.open(self.file, 'rb', buffering=0, native=False)
+        self.assertEqual(self.f.read(), b'spam' * 1000)
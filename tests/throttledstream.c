@@ -0,0 +1,400 @@
+#include "throttledstream.h"
+
+// Longest uninterrupted sleep, cancellation is checked in between
+#define SLEEP_SLICE 10000
+
+typedef struct
+{
+  ThrottleParams params;
+  GRand *rand;
+  GMutex lock;
+} Throttle;
+
+static void
+throttle_init (Throttle *throttle, const ThrottleParams *params)
+{
+  throttle->params = *params;
+  throttle->rand = g_rand_new_with_seed (params->seed);
+  g_mutex_init (&throttle->lock);
+}
+
+static void
+throttle_clear (Throttle *throttle)
+{
+  g_clear_pointer (&throttle->rand, g_rand_free);
+  g_mutex_clear (&throttle->lock);
+}
+
+static gsize
+throttle_clamp (Throttle *throttle, gsize count)
+{
+  if (throttle->params.max_chunk && count > throttle->params.max_chunk)
+    return throttle->params.max_chunk;
+  return count;
+}
+
+/*
+ * Sleep for as long as a remote call transferring *bytes* would take. This
+ * happens before the call is forwarded, so a cancelled call leaves the
+ * wrapped stream untouched.
+ */
+static gboolean
+throttle_wait (Throttle *throttle, gsize bytes, GCancellable *cancellable,
+               GError **error)
+{
+  gint64 delay = throttle->params.latency;
+
+  if (throttle->params.jitter > 0)
+    {
+      g_mutex_lock (&throttle->lock);
+      delay += (gint64)g_rand_double_range (throttle->rand, 0,
+                                            throttle->params.jitter);
+      g_mutex_unlock (&throttle->lock);
+    }
+
+  if (throttle->params.bandwidth > 0)
+    delay += (gint64)(bytes * G_USEC_PER_SEC / throttle->params.bandwidth);
+
+  gint64 deadline = g_get_monotonic_time () + delay;
+  gint64 now;
+  while ((now = g_get_monotonic_time ()) < deadline)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+      g_usleep (MIN (deadline - now, SLEEP_SLICE));
+    }
+
+  return !g_cancellable_set_error_if_cancelled (cancellable, error);
+}
+
+static gboolean
+err_seek_unsupported (GError **error)
+{
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Seek not supported on stream");
+  return FALSE;
+}
+
+static gboolean
+err_truncate_unsupported (GError **error)
+{
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Truncate not supported on stream");
+  return FALSE;
+}
+
+struct _ThrottledInputStream
+{
+  GInputStream parent_instance;
+  GInputStream *base;
+  Throttle throttle;
+  goffset bytes_read;
+};
+
+static void
+throttled_input_stream_seekable_iface_init (GSeekableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (
+    ThrottledInputStream, throttled_input_stream, G_TYPE_INPUT_STREAM,
+    G_IMPLEMENT_INTERFACE (G_TYPE_SEEKABLE,
+                           throttled_input_stream_seekable_iface_init))
+
+static gssize
+throttled_input_stream_read (GInputStream *stream, void *buffer, gsize count,
+                             GCancellable *cancellable, GError **error)
+{
+  ThrottledInputStream *self = THROTTLED_INPUT_STREAM (stream);
+
+  gint64 fail_after = self->throttle.params.fail_after;
+  if (fail_after >= 0)
+    {
+      // Simulate the connection dropping
+      if (self->bytes_read >= fail_after)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE,
+                               "Connection dropped");
+          return -1;
+        }
+      count = MIN (count, (guint64)(fail_after - self->bytes_read));
+    }
+
+  count = throttle_clamp (&self->throttle, count);
+  if (!throttle_wait (&self->throttle, count, cancellable, error))
+    return -1;
+
+  gssize n = g_input_stream_read (self->base, buffer, count, cancellable,
+                                  error);
+  if (n > 0)
+    self->bytes_read += n;
+  return n;
+}
+
+static gboolean
+throttled_input_stream_close (GInputStream *stream, GCancellable *cancellable,
+                              GError **error)
+{
+  ThrottledInputStream *self = THROTTLED_INPUT_STREAM (stream);
+
+  return g_input_stream_close (self->base, cancellable, error);
+}
+
+static goffset
+throttled_input_stream_tell (GSeekable *seekable)
+{
+  ThrottledInputStream *self = THROTTLED_INPUT_STREAM (seekable);
+
+  if (!G_IS_SEEKABLE (self->base))
+    return 0;
+  return g_seekable_tell (G_SEEKABLE (self->base));
+}
+
+static gboolean
+throttled_input_stream_can_seek (GSeekable *seekable)
+{
+  ThrottledInputStream *self = THROTTLED_INPUT_STREAM (seekable);
+
+  return G_IS_SEEKABLE (self->base)
+         && g_seekable_can_seek (G_SEEKABLE (self->base));
+}
+
+static gboolean
+throttled_input_stream_seek (GSeekable *seekable, goffset offset,
+                             GSeekType type, GCancellable *cancellable,
+                             GError **error)
+{
+  ThrottledInputStream *self = THROTTLED_INPUT_STREAM (seekable);
+
+  if (!G_IS_SEEKABLE (self->base))
+    return err_seek_unsupported (error);
+
+  if (!throttle_wait (&self->throttle, 0, cancellable, error))
+    return FALSE;
+
+  return g_seekable_seek (G_SEEKABLE (self->base), offset, type, cancellable,
+                          error);
+}
+
+static gboolean
+throttled_input_stream_can_truncate (GSeekable *seekable)
+{
+  return FALSE;
+}
+
+static gboolean
+throttled_input_stream_truncate (GSeekable *seekable, goffset offset,
+                                 GCancellable *cancellable, GError **error)
+{
+  return err_truncate_unsupported (error);
+}
+
+static void
+throttled_input_stream_seekable_iface_init (GSeekableIface *iface)
+{
+  iface->tell = throttled_input_stream_tell;
+  iface->can_seek = throttled_input_stream_can_seek;
+  iface->seek = throttled_input_stream_seek;
+  iface->can_truncate = throttled_input_stream_can_truncate;
+  iface->truncate_fn = throttled_input_stream_truncate;
+}
+
+static void
+throttled_input_stream_finalize (GObject *object)
+{
+  ThrottledInputStream *self = THROTTLED_INPUT_STREAM (object);
+
+  g_clear_object (&self->base);
+  throttle_clear (&self->throttle);
+
+  G_OBJECT_CLASS (throttled_input_stream_parent_class)->finalize (object);
+}
+
+static void
+throttled_input_stream_class_init (ThrottledInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = throttled_input_stream_finalize;
+  stream_class->read_fn = throttled_input_stream_read;
+  stream_class->close_fn = throttled_input_stream_close;
+}
+
+static void
+throttled_input_stream_init (ThrottledInputStream *self)
+{
+}
+
+GInputStream *
+throttled_input_stream_new (GInputStream *base, const ThrottleParams *params)
+{
+  ThrottledInputStream *self
+      = g_object_new (THROTTLED_TYPE_INPUT_STREAM, NULL);
+
+  self->base = g_object_ref (base);
+  throttle_init (&self->throttle, params);
+
+  return G_INPUT_STREAM (self);
+}
+
+struct _ThrottledOutputStream
+{
+  GOutputStream parent_instance;
+  GOutputStream *base;
+  Throttle throttle;
+};
+
+static void
+throttled_output_stream_seekable_iface_init (GSeekableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (
+    ThrottledOutputStream, throttled_output_stream, G_TYPE_OUTPUT_STREAM,
+    G_IMPLEMENT_INTERFACE (G_TYPE_SEEKABLE,
+                           throttled_output_stream_seekable_iface_init))
+
+static gssize
+throttled_output_stream_write (GOutputStream *stream, const void *buffer,
+                               gsize count, GCancellable *cancellable,
+                               GError **error)
+{
+  ThrottledOutputStream *self = THROTTLED_OUTPUT_STREAM (stream);
+
+  count = throttle_clamp (&self->throttle, count);
+  if (!throttle_wait (&self->throttle, count, cancellable, error))
+    return -1;
+
+  return g_output_stream_write (self->base, buffer, count, cancellable,
+                                error);
+}
+
+static gboolean
+throttled_output_stream_flush (GOutputStream *stream,
+                               GCancellable *cancellable, GError **error)
+{
+  ThrottledOutputStream *self = THROTTLED_OUTPUT_STREAM (stream);
+
+  if (!throttle_wait (&self->throttle, 0, cancellable, error))
+    return FALSE;
+
+  return g_output_stream_flush (self->base, cancellable, error);
+}
+
+static gboolean
+throttled_output_stream_close (GOutputStream *stream,
+                               GCancellable *cancellable, GError **error)
+{
+  ThrottledOutputStream *self = THROTTLED_OUTPUT_STREAM (stream);
+
+  return g_output_stream_close (self->base, cancellable, error);
+}
+
+static goffset
+throttled_output_stream_tell (GSeekable *seekable)
+{
+  ThrottledOutputStream *self = THROTTLED_OUTPUT_STREAM (seekable);
+
+  if (!G_IS_SEEKABLE (self->base))
+    return 0;
+  return g_seekable_tell (G_SEEKABLE (self->base));
+}
+
+static gboolean
+throttled_output_stream_can_seek (GSeekable *seekable)
+{
+  ThrottledOutputStream *self = THROTTLED_OUTPUT_STREAM (seekable);
+
+  return G_IS_SEEKABLE (self->base)
+         && g_seekable_can_seek (G_SEEKABLE (self->base));
+}
+
+static gboolean
+throttled_output_stream_seek (GSeekable *seekable, goffset offset,
+                              GSeekType type, GCancellable *cancellable,
+                              GError **error)
+{
+  ThrottledOutputStream *self = THROTTLED_OUTPUT_STREAM (seekable);
+
+  if (!G_IS_SEEKABLE (self->base))
+    return err_seek_unsupported (error);
+
+  if (!throttle_wait (&self->throttle, 0, cancellable, error))
+    return FALSE;
+
+  return g_seekable_seek (G_SEEKABLE (self->base), offset, type, cancellable,
+                          error);
+}
+
+static gboolean
+throttled_output_stream_can_truncate (GSeekable *seekable)
+{
+  ThrottledOutputStream *self = THROTTLED_OUTPUT_STREAM (seekable);
+
+  return G_IS_SEEKABLE (self->base)
+         && g_seekable_can_truncate (G_SEEKABLE (self->base));
+}
+
+static gboolean
+throttled_output_stream_truncate (GSeekable *seekable, goffset offset,
+                                  GCancellable *cancellable, GError **error)
+{
+  ThrottledOutputStream *self = THROTTLED_OUTPUT_STREAM (seekable);
+
+  if (!G_IS_SEEKABLE (self->base))
+    return err_truncate_unsupported (error);
+
+  if (!throttle_wait (&self->throttle, 0, cancellable, error))
+    return FALSE;
+
+  return g_seekable_truncate (G_SEEKABLE (self->base), offset, cancellable,
+                              error);
+}
+
+static void
+throttled_output_stream_seekable_iface_init (GSeekableIface *iface)
+{
+  iface->tell = throttled_output_stream_tell;
+  iface->can_seek = throttled_output_stream_can_seek;
+  iface->seek = throttled_output_stream_seek;
+  iface->can_truncate = throttled_output_stream_can_truncate;
+  iface->truncate_fn = throttled_output_stream_truncate;
+}
+
+static void
+throttled_output_stream_finalize (GObject *object)
+{
+  ThrottledOutputStream *self = THROTTLED_OUTPUT_STREAM (object);
+
+  g_clear_object (&self->base);
+  throttle_clear (&self->throttle);
+
+  G_OBJECT_CLASS (throttled_output_stream_parent_class)->finalize (object);
+}
+
+static void
+throttled_output_stream_class_init (ThrottledOutputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = throttled_output_stream_finalize;
+  stream_class->write_fn = throttled_output_stream_write;
+  stream_class->flush = throttled_output_stream_flush;
+  stream_class->close_fn = throttled_output_stream_close;
+}
+
+static void
+throttled_output_stream_init (ThrottledOutputStream *self)
+{
+}
+
+GOutputStream *
+throttled_output_stream_new (GOutputStream *base,
+                             const ThrottleParams *params)
+{
+  ThrottledOutputStream *self
+      = g_object_new (THROTTLED_TYPE_OUTPUT_STREAM, NULL);
+
+  self->base = g_object_ref (base);
+  throttle_init (&self->throttle, params);
+
+  return G_OUTPUT_STREAM (self);
+}
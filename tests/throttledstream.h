@@ -0,0 +1,34 @@
+#ifndef THROTTLEDSTREAM_H
+#define THROTTLEDSTREAM_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Simulated remote backend characteristics applied to every call. */
+typedef struct
+{
+  gint64 latency;    // microseconds added to every call
+  gint64 jitter;     // upper bound of random microseconds added on top
+  guint64 bandwidth; // bytes per second, 0 for unlimited
+  gsize max_chunk;   // upper bound of bytes per call, 0 for unlimited
+  guint32 seed;      // seed for the jitter
+  gint64 fail_after; // bytes read before reads fail, -1 for never
+} ThrottleParams;
+
+#define THROTTLED_TYPE_INPUT_STREAM (throttled_input_stream_get_type ())
+G_DECLARE_FINAL_TYPE (ThrottledInputStream, throttled_input_stream, THROTTLED,
+                      INPUT_STREAM, GInputStream)
+
+#define THROTTLED_TYPE_OUTPUT_STREAM (throttled_output_stream_get_type ())
+G_DECLARE_FINAL_TYPE (ThrottledOutputStream, throttled_output_stream,
+                      THROTTLED, OUTPUT_STREAM, GOutputStream)
+
+GInputStream *throttled_input_stream_new (GInputStream *base,
+                                          const ThrottleParams *params);
+GOutputStream *throttled_output_stream_new (GOutputStream *base,
+                                            const ThrottleParams *params);
+
+G_END_DECLS
+
+#endif